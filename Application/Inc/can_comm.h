@@ -16,6 +16,7 @@
  **********************/
 
 #include "stm32f4xx_hal.h"
+#include <cmsis_os.h>
 #include <string.h>
 
 /**********************
@@ -185,6 +186,8 @@ void can_setFrame(uint32_t data, uint8_t data_id, uint32_t timestamp);
 uint32_t can_msgPending();
 CAN_msg can_readBuffer();
 
+void can_set_rx_task(TaskHandle_t task);
+
 
 void can_init(void);
 
@@ -29,6 +29,7 @@
 #define CM4_H2C_PAYLOAD		0x02
 #define CM4_H2C_SENSORS		0x03
 #define CM4_H2C_FEEDBACK	0x04
+#define CM4_H2C_BAUDRATE	0x05
 
 
 //Initiated by CM4
@@ -60,10 +61,19 @@ typedef enum CM4_STATE {
 	CM4_POWERED_DOWN,
 	CM4_BOOTING,
 	CM4_PREPARING,
+	CM4_NEGOTIATING,
 	CM4_READY,
+	CM4_SHUTTING_DOWN,
 	CM4_ERROR
 }CM4_STATE_t;
 
+//what the link thread works towards
+typedef enum CM4_LINK_REQUEST {
+	CM4_LINK_IDLE = 0x00,
+	CM4_LINK_CONNECT,
+	CM4_LINK_SHUTDOWN
+}CM4_LINK_REQUEST_t;
+
 typedef struct CM4_INST {
 	uint32_t id;
 	MSV2_INST_t msv2;
@@ -127,6 +137,10 @@ CM4_ERROR_t cm4_send_sensors(CM4_INST_t * cm4, CM4_PAYLOAD_SENSOR_t * sens);
 
 CM4_ERROR_t cm4_send_feedback(CM4_INST_t * cm4, CM4_PAYLOAD_FEEDBACK_t * feed);
 
+void cm4_post_sensors(CM4_PAYLOAD_SENSOR_t * sens);
+
+void cm4_post_feedback(CM4_PAYLOAD_FEEDBACK_t * feed);
+
 CM4_ERROR_t cm4_boot(CM4_INST_t * cm4);
 
 CM4_ERROR_t cm4_is_ready(CM4_INST_t * cm4, uint8_t * ready);
@@ -137,6 +151,14 @@ CM4_ERROR_t cm4_is_shutdown(CM4_INST_t * cm4, uint8_t * shutdown);
 
 CM4_ERROR_t cm4_force_shutdown(CM4_INST_t * cm4);
 
+void cm4_link_thread(void * arg);
+
+void cm4_link_set(CM4_LINK_REQUEST_t request);
+
+CM4_STATE_t cm4_link_get_state(void);
+
+uint8_t cm4_link_is_ready(void);
+
 
 
 #ifdef __cplusplus
@@ -22,6 +22,9 @@
  *  CONSTANTS
  **********************/
 
+//histogram of the start jitter of the control cycles
+#define CONTROL_TIMING_BINS		(16)
+#define CONTROL_TIMING_BIN_US	(50)
 
 
 /**********************
@@ -72,12 +75,25 @@ typedef struct CONTROL_STATUS {
 	uint32_t time;
 }CONTROL_STATUS_t;
 
+//cycle timing measured with the cycle counter
+typedef struct CONTROL_TIMING {
+	uint32_t cycles;
+	uint32_t overruns;	//cycles longer than the period
+	uint32_t late;		//cycles started more than half a period late
+	int32_t jitter_min;	//us, start of a cycle against the period
+	int32_t jitter_max;
+	uint32_t exec_max;	//us
+	uint32_t bins[CONTROL_TIMING_BINS]; //absolute jitter
+}CONTROL_TIMING_t;
+
 
 typedef struct CONTROL_INST{
 	CONTROL_STATE_t state;
 	CONTROL_STATE_t shadow_state;
 	uint32_t time;
 	uint32_t last_time;
+	uint32_t heartbeat_time;
+	uint32_t thrust_time;
 	int32_t counter;
 	uint8_t counter_active;
 	uint32_t iter;
@@ -135,6 +151,16 @@ void control_recover(void);
 
 CM4_INST_t * control_get_cm4(void);
 
+void control_get_timing(CONTROL_TIMING_t * timing);
+
+void control_timing_reset(void);
+
+uint8_t control_set_period(uint32_t period);
+
+uint32_t control_get_period(void);
+
+uint32_t control_timing_percentile(const CONTROL_TIMING_t * timing, uint16_t per_mille);
+
 
 
 #ifdef __cplusplus
@@ -57,6 +57,8 @@ SERIAL_RET_t debug_decode_fcn(void * inst, uint8_t data);
 
 void debug_init(DEBUG_INST_t * debug);
 
+void debug_stream_thread(void * arg);
+
 
 
 #ifdef __cplusplus
@@ -59,6 +59,7 @@ typedef struct DSV2_RX_DATA{
 	uint8_t dev_id;
 	uint16_t data_len;
 	uint16_t crc;
+	uint16_t crc_accum;	//running crc of the frame being received
 	uint8_t inst;
 	DSV2_DECODE_STATE_t state;
 	DSV2_DECODE_STATE_t restart_state;
@@ -66,7 +67,6 @@ typedef struct DSV2_RX_DATA{
 	uint16_t length;
 	uint16_t counter;
 	uint8_t data[DSV2_MAX_FRAME_LEN];
-	uint8_t crc_data[DSV2_MAX_FRAME_LEN];
 }DSV2_RX_DATA_t;
 
 typedef struct DSV2_TX_DATA{
@@ -106,6 +106,14 @@ void dsv2_init(DSV2_INST_t * dsv2);
 
 uint16_t dsv2_create_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len, uint8_t inst,  uint8_t * data);
 
+uint16_t dsv2_create_sync_read(DSV2_INST_t * dsv2, uint16_t address, uint16_t length, uint8_t * dev_ids, uint8_t count);
+
+uint16_t dsv2_create_sync_write(DSV2_INST_t * dsv2, uint16_t address, uint16_t length, uint8_t * dev_ids, uint8_t * data, uint8_t count);
+
+uint16_t dsv2_create_bulk_read(DSV2_INST_t * dsv2, uint8_t * dev_ids, uint16_t * addresses, uint16_t * lengths, uint8_t count);
+
+uint16_t dsv2_create_bulk_write(DSV2_INST_t * dsv2, uint8_t * dev_ids, uint16_t * addresses, uint16_t * lengths, uint8_t ** data, uint8_t count);
+
 uint8_t * dsv2_rx_data(DSV2_INST_t * dsv2);
 
 uint8_t * dsv2_tx_data(DSV2_INST_t * dsv2);
@@ -0,0 +1,76 @@
+/*  Title       : Health
+ *  Filename    : health.h
+ *  Date        : 19.10.2026
+ *  Version     : 0.1
+ *  Description : health monitor, aborts on lost links
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+/**********************
+ *  INCLUDES
+ **********************/
+
+#include <stdint.h>
+#include <servo.h>
+
+/**********************
+ *  CONSTANTS
+ **********************/
+
+
+/**********************
+ *  MACROS
+ **********************/
+
+
+/**********************
+ *  TYPEDEFS
+ **********************/
+
+typedef enum HEALTH_SOURCE {
+	HEALTH_CM4_COMMAND = 0x00,
+	HEALTH_SENSORS,
+	HEALTH_SERVOS,
+	HEALTH_PROPULSION,
+	HEALTH_SOURCE_NUM
+}HEALTH_SOURCE_t;
+
+
+/**********************
+ *  VARIABLES
+ **********************/
+
+
+/**********************
+ *  PROTOTYPES
+ **********************/
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void health_init(SERVO_INST_t ** servos, uint8_t count);
+
+void health_feed(HEALTH_SOURCE_t source);
+
+void health_arm(void);
+
+void health_disarm(void);
+
+uint8_t health_check(uint8_t state);
+
+void health_set_threshold(HEALTH_SOURCE_t source, uint32_t threshold);
+
+uint32_t health_get_threshold(HEALTH_SOURCE_t source);
+
+uint32_t health_get_triggers(HEALTH_SOURCE_t source);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* __cplusplus */
+
+#endif /* HEALTH_H */
+
+/* END */
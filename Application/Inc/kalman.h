@@ -0,0 +1,68 @@
+/*  Title       : Kalman
+ *  Filename    : kalman.h
+ *  Date        : 19.10.2026
+ *  Version     : 0.1
+ *  Description : on-board vertical state estimation
+ */
+
+#ifndef KALMAN_H
+#define KALMAN_H
+
+/**********************
+ *  INCLUDES
+ **********************/
+
+#include <stdint.h>
+#include <util.h>
+
+/**********************
+ *  CONSTANTS
+ **********************/
+
+
+
+/**********************
+ *  MACROS
+ **********************/
+
+
+/**********************
+ *  TYPEDEFS
+ **********************/
+
+typedef struct KALMAN_INST {
+	uint8_t initialized;
+	uint32_t last_time;
+	UTIL_MAT21_t x;	//altitude (m), vertical velocity (m/s) in 20.12
+	UTIL_MAT22_t P;
+}KALMAN_INST_t;
+
+
+/**********************
+ *  VARIABLES
+ **********************/
+
+
+/**********************
+ *  PROTOTYPES
+ **********************/
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void kalman_init(KALMAN_INST_t * kalman);
+
+void kalman_update(KALMAN_INST_t * kalman, int32_t acc_z, int32_t alti, uint32_t time);
+
+int32_t kalman_get_altitude(KALMAN_INST_t * kalman);
+
+int32_t kalman_get_velocity(KALMAN_INST_t * kalman);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* __cplusplus */
+
+#endif /* KALMAN_H */
+
+/* END */
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <usart.h>
 #include <util.h>
+#include <cmsis_os.h>
 
 /**********************
  *  CONSTANTS
@@ -26,6 +27,8 @@
 #define SERIAL_MAX_INST	(16)
 #define SERIAL_FIFO_LEN	(1024)
 
+#define SERIAL_DEFAULT_BAUDRATE	(115200)
+
 
 #define SERIAL_USE_GENERIC 1
 
@@ -53,6 +56,11 @@ typedef struct SERIAL_INST {
 	UTIL_BUFFER_U8_t bfr;
 	uint8_t buffer[SERIAL_FIFO_LEN];
 	uint8_t dma_buffer;
+	SemaphoreHandle_t tx_sem;
+	StaticSemaphore_t tx_sem_buffer;
+	uint32_t baudrate_fallback; //restored if the new baudrate is not confirmed
+	TickType_t baudrate_deadline;
+	volatile uint32_t baudrate_request; //applied by the serial thread, 0 if none
 }SERIAL_INST_t;
 
 /**********************
@@ -75,7 +83,21 @@ void serial_garbage_clean(SERIAL_INST_t * ser);
 
 void serial_init(SERIAL_INST_t * ser, UART_HandleTypeDef * uart, void * inst, SERIAL_RET_t (*decode_fcn)(void *, uint8_t));
 
-void serial_send(SERIAL_INST_t * ser, uint8_t * data, uint16_t length);
+uint8_t serial_send(SERIAL_INST_t * ser, uint8_t * data, uint16_t length);
+
+uint8_t serial_tx_wait(SERIAL_INST_t * ser, uint32_t timeout);
+
+uint8_t serial_tx_start(SERIAL_INST_t * ser, uint8_t * data, uint16_t length, uint32_t timeout);
+
+uint8_t serial_baudrate_valid(uint32_t baudrate);
+
+uint32_t serial_get_baudrate(SERIAL_INST_t * ser);
+
+void serial_set_baudrate(SERIAL_INST_t * ser, uint32_t baudrate, uint32_t confirm_timeout);
+
+void serial_baudrate_confirm(SERIAL_INST_t * ser);
+
+void serial_request_baudrate(SERIAL_INST_t * ser, uint32_t baudrate);
 
 void serial_thread(void * arg);
 
@@ -24,6 +24,14 @@
 
 #define DYNAMIXEL_UART	huart1
 
+#define SERVO_RX_MAX	(32)
+
+#define SERVO_REQUEST_MAX	(4)
+
+//round trip histogram, the last bin also counts the longer ones
+#define SERVO_RTT_BINS		(16)
+#define SERVO_RTT_BIN_US	(100)
+
 
 /**********************
  *  MACROS
@@ -58,10 +66,45 @@ struct SERVO_INST{
 	uint16_t psu_voltage;
 	int8_t temperature;
 	int32_t position;
-	uint8_t error;
-
+	uint8_t error;		//hardware error status register
+	uint8_t status;		//error byte of the last status packet, bit 7 is the alert
+	uint8_t torque;
+	uint8_t indirect;
+	SERVO_ERROR_t comm;	//result of the last transaction
+	uint32_t time;		//tick of the last telemetry update
+	int32_t target;
+	uint8_t target_pending;
+	//status packet copied by the decoder, several servos answer back to back
+	uint8_t rx_err;
+	uint16_t rx_len;
+	uint8_t rx_data[SERVO_RX_MAX];
 };
 
+typedef struct SERVO_TELEMETRY {
+	int32_t position;
+	uint16_t psu_voltage;
+	int8_t temperature;
+	uint8_t error;
+	uint8_t status;
+	SERVO_ERROR_t comm;
+	uint32_t time;
+}SERVO_TELEMETRY_t;
+
+typedef struct SERVO_RTT {
+	uint32_t baudrate;
+	uint32_t max_us;
+	uint32_t timeouts;
+	uint32_t bins[SERVO_RTT_BINS];
+}SERVO_RTT_t;
+
+typedef struct SERVO_BULK {
+	SERVO_INST_t * servo;
+	uint16_t address;
+	uint16_t length;
+	uint8_t * data;
+	uint8_t err;
+}SERVO_BULK_t;
+
 
 /**********************
  *  VARIABLES
@@ -90,6 +133,14 @@ SERVO_ERROR_t servo_write(SERVO_INST_t * servo, uint16_t address, uint16_t lengt
 
 SERVO_ERROR_t servo_ping(uint8_t id);
 
+SERVO_ERROR_t servo_sync_read(SERVO_INST_t ** servos, uint8_t count, uint16_t address, uint16_t length, uint8_t * data, uint8_t * err);
+
+SERVO_ERROR_t servo_sync_write(SERVO_INST_t ** servos, uint8_t count, uint16_t address, uint16_t length, uint8_t * data);
+
+SERVO_ERROR_t servo_bulk_read(SERVO_BULK_t * bulk, uint8_t count);
+
+SERVO_ERROR_t servo_bulk_write(SERVO_BULK_t * bulk, uint8_t count);
+
 SERVO_ERROR_t servo_write_u8 (SERVO_INST_t * servo, uint16_t address, uint8_t  data, uint8_t * err);
 SERVO_ERROR_t servo_write_u16(SERVO_INST_t * servo, uint16_t address, uint16_t data, uint8_t * err);
 SERVO_ERROR_t servo_write_u32(SERVO_INST_t * servo, uint16_t address, uint32_t data, uint8_t * err);
@@ -118,6 +169,28 @@ SERVO_ERROR_t servo_config(SERVO_INST_t * servo);
 
 SERVO_ERROR_t servo_move(SERVO_INST_t * servo, int32_t target);
 
+SERVO_ERROR_t servo_sync_all(SERVO_INST_t ** servos, uint8_t count);
+
+SERVO_ERROR_t servo_move_all(SERVO_INST_t ** servos, int32_t * targets, uint8_t count);
+
+SERVO_ERROR_t servo_link_bringup(void);
+
+void servo_get_rtt(SERVO_RTT_t * rtt);
+
+void servo_rtt_reset(void);
+
+//bus scheduler, the functions above block and are only used before servo_bus_start
+
+void servo_bus_thread(void * arg);
+
+void servo_bus_start(void);
+
+void servo_set_target(SERVO_INST_t * servo, int32_t target);
+
+SERVO_ERROR_t servo_request_write(SERVO_INST_t * servo, uint16_t address, uint16_t length, uint8_t * data);
+
+SERVO_TELEMETRY_t servo_get_telemetry(SERVO_INST_t * servo);
+
 
 
 #ifdef __cplusplus
@@ -77,6 +77,8 @@
 #define SERVO_POSITION_TRAJECTORY 		140 //4 bytes	RO
 #define SERVO_PRESENT_INPUT_VOLTAGE 	144 //2 bytes	RO
 #define SERVO_PRESENT_TEMPERATURE 		146 //1 byte	RO
+#define SERVO_INDIRECT_ADDRESS_1		168 //2 bytes	RW	(x28, EEPROM)
+#define SERVO_INDIRECT_DATA_1			224 //1 byte	RW	(x28)
 
 
 
@@ -0,0 +1,76 @@
+/*  Title       : Setpoint
+ *  Filename    : setpoint.h
+ *  Date        : 19.10.2026
+ *  Version     : 0.1
+ *  Description : setpoint generation between cm4 commands
+ */
+
+#ifndef SETPOINT_H
+#define SETPOINT_H
+
+/**********************
+ *  INCLUDES
+ **********************/
+
+#include <stdint.h>
+#include <cm4.h>
+
+/**********************
+ *  CONSTANTS
+ **********************/
+
+
+
+/**********************
+ *  MACROS
+ **********************/
+
+
+/**********************
+ *  TYPEDEFS
+ **********************/
+
+typedef enum SETPOINT_CHANNEL {
+	SETPOINT_THRUST = 0,
+	SETPOINT_VANE_1,
+	SETPOINT_VANE_2,
+	SETPOINT_VANE_3,
+	SETPOINT_VANE_4,
+	SETPOINT_CHANNELS
+}SETPOINT_CHANNEL_t;
+
+typedef enum SETPOINT_MODE {
+	SETPOINT_STEP = 0,
+	SETPOINT_INTERPOLATE,
+	SETPOINT_EXTRAPOLATE
+}SETPOINT_MODE_t;
+
+
+/**********************
+ *  VARIABLES
+ **********************/
+
+
+/**********************
+ *  PROTOTYPES
+ **********************/
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void setpoint_push(CM4_PAYLOAD_COMMAND_t * cmd);
+
+uint8_t setpoint_get(uint32_t time, int32_t * values);
+
+void setpoint_set_mode(SETPOINT_MODE_t mode);
+
+void setpoint_reset(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* __cplusplus */
+
+#endif /* SETPOINT_H */
+
+/* END */
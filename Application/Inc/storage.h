@@ -24,6 +24,10 @@
  *  CONSTANTS
  **********************/
 
+#define STORAGE_MAX_PAYLOAD	(64)
+
+#define STORAGE_SESSION_CURRENT	(0xffffffff)
+
 
 /**********************
  *  MACROS
@@ -34,6 +38,52 @@
  *  TYPEDEFS
  **********************/
 
+//Record types of the log, the schema of each type is compiled in storage.c
+typedef enum STORAGE_TYPE {
+	STORAGE_TYPE_SCHEMA = 0x00,
+	STORAGE_TYPE_STATUS,
+	STORAGE_TYPE_SENSOR,
+	STORAGE_TYPE_COMMAND,
+	STORAGE_TYPE_FEEDBACK,
+	STORAGE_TYPE_CAN,
+	STORAGE_TYPE_STATE,
+	STORAGE_TYPE_HEALTH,
+	STORAGE_TYPE_TIMING,
+	STORAGE_TYPE_NUM
+}STORAGE_TYPE_t;
+
+typedef struct STORAGE_TRANSITION {
+	uint8_t from;
+	uint8_t to;
+}STORAGE_TRANSITION_t;
+
+//Trip of the health monitor
+typedef struct STORAGE_HEALTH {
+	uint8_t source;
+	uint8_t state;
+	uint32_t age; //ms since the last sign of life
+	uint32_t threshold;
+}STORAGE_HEALTH_t;
+
+//Control cycle timing over the last second
+typedef struct STORAGE_TIMING {
+	uint32_t overruns;
+	uint32_t late;
+	int32_t jitter_min; //us
+	int32_t jitter_max;
+	uint32_t exec_max;
+}STORAGE_TIMING_t;
+
+//Entry of the session table, one session per restart
+typedef struct STORAGE_SESSION {
+	uint32_t id;
+	uint32_t start; //flash address of the first block
+	uint32_t length; //bytes
+	uint32_t start_tick;
+	uint32_t fw_version;
+	uint32_t erase_count; //highest erase count of the log when the session was closed
+}STORAGE_SESSION_t;
+
 
 /**********************
  *  VARIABLES
@@ -57,20 +107,32 @@ void storage_record_sample();
 
 uint32_t storage_get_used();
 
+uint32_t storage_get_used_bytes();
+
 void storage_get_sample(uint32_t id, void * dest);
 
+uint32_t storage_get_raw(uint32_t offset, uint8_t * dest, uint32_t length);
+
+uint8_t storage_get_session(uint32_t index, STORAGE_SESSION_t * session);
+
+uint8_t storage_select_session(uint32_t id, uint32_t * length);
+
 void storage_give_sem();
 
 void storage_thread(void * arg);
 
 void storage_enable();
 
+void storage_trigger();
+
 void storage_restart();
 
 void storage_disable();
 
 void storage_notify();
 
+void storage_log(STORAGE_TYPE_t type, const void * payload);
+
 
 
 #ifdef __cplusplus
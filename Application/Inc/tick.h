@@ -0,0 +1,64 @@
+/*  Title       : Tick
+ *  Filename    : tick.h
+ *  Date        : 19.10.2026
+ *  Version     : 0.1
+ *  Description : hardware timer releasing the control thread
+ */
+
+#ifndef TICK_H
+#define TICK_H
+
+/**********************
+ *  INCLUDES
+ **********************/
+
+#include <stdint.h>
+#include <cmsis_os.h>
+
+/**********************
+ *  CONSTANTS
+ **********************/
+
+//control period limits (us)
+#define TICK_MIN_PERIOD	(250)
+#define TICK_MAX_PERIOD	(100000)
+
+
+/**********************
+ *  MACROS
+ **********************/
+
+
+/**********************
+ *  TYPEDEFS
+ **********************/
+
+
+/**********************
+ *  VARIABLES
+ **********************/
+
+
+/**********************
+ *  PROTOTYPES
+ **********************/
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void tick_start(TaskHandle_t task, uint32_t period);
+
+uint8_t tick_set_period(uint32_t period);
+
+uint32_t tick_get_period(void);
+
+uint32_t tick_get_count(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* __cplusplus */
+
+#endif /* TICK_H */
+
+/* END */
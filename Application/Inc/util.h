@@ -17,6 +17,14 @@
 
 #include <stdint.h>
 
+//saturating instructions of the cortex-m4, portable code elsewhere (host)
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include <arm_acle.h>
+#define UTIL_USE_DSP	1
+#else
+#define UTIL_USE_DSP	0
+#endif
+
 /**********************
  *  CONSTANTS
  **********************/
@@ -73,7 +81,7 @@ static inline uint8_t util_buffer_##name##_isempty(UTIL_BUFFER_##name##_t * bfr)
 
 #define util_fix_add(a,b)   ((a)+(b))
 #define util_fix_sub(a,b)   ((a)-(b))
-#define util_fix_mul(a,b)   (((a)*(b))>>UTIL_DECIMAL)
+#define util_fix_mul(a,b)   ((int32_t)(((int64_t)(a)*(b))>>UTIL_DECIMAL))
 #define util_fix_div(a,b)   (((a)/(b))<<UTIL_DECIMAL))
 
 
@@ -270,72 +278,212 @@ static inline int32_t util_decode_i32(uint8_t * data) {
 	return (int32_t) data[0] | data[1] << 8 | data[2] << 16 | data[3] << 24;
 }
 
+//FIXED POINT
+//values with q fractional bits, products are accumulated on 64 bits,
+//rounded and saturated once
+
+static inline int32_t util_fix_sat(int64_t a) {
+	if(a > INT32_MAX) return INT32_MAX;
+	if(a < INT32_MIN) return INT32_MIN;
+	return (int32_t) a;
+}
+
+static inline int32_t util_fix_qadd(int32_t a, int32_t b) {
+#if UTIL_USE_DSP == 1
+	return __qadd(a, b);
+#else
+	return util_fix_sat((int64_t) a + b);
+#endif
+}
+
+static inline int32_t util_fix_qsub(int32_t a, int32_t b) {
+#if UTIL_USE_DSP == 1
+	return __qsub(a, b);
+#else
+	return util_fix_sat((int64_t) a - b);
+#endif
+}
+
+//accumulator back to q bits (rounded)
+static inline int32_t util_fix_qround(int64_t acc, uint8_t q) {
+	if(q) {
+		acc += (int64_t) 1 << (q-1);
+	}
+	return util_fix_sat(acc >> q);
+}
+
+static inline int32_t util_fix_qmul(int32_t a, int32_t b, uint8_t q) {
+	return util_fix_qround((int64_t) a * b, q);
+}
+
+static inline int32_t util_fix_qdiv(int32_t a, int32_t b, uint8_t q) {
+	if(b == 0) {
+		return a < 0 ? INT32_MIN : INT32_MAX;
+	}
+	return util_fix_sat(((int64_t) a << q) / b);
+}
+
+//matrices are row-major int32_t arrays, results must not alias the operands
+
+//R (n x p) = A (n x m) * B (m x p)
+static inline void util_fix_mat_mul(int32_t * R, const int32_t * A, const int32_t * B, uint8_t n, uint8_t m, uint8_t p, uint8_t q) {
+	for(uint8_t i = 0; i < n; i++) {
+		for(uint8_t j = 0; j < p; j++) {
+			int64_t acc = 0;
+			for(uint8_t k = 0; k < m; k++) {
+				acc += (int64_t) A[i*m+k] * B[k*p+j];
+			}
+			R[i*p+j] = util_fix_qround(acc, q);
+		}
+	}
+}
+
+//R (n x p) = A (n x m) * B' with B (p x m)
+static inline void util_fix_mat_mul_t(int32_t * R, const int32_t * A, const int32_t * B, uint8_t n, uint8_t m, uint8_t p, uint8_t q) {
+	for(uint8_t i = 0; i < n; i++) {
+		for(uint8_t j = 0; j < p; j++) {
+			int64_t acc = 0;
+			for(uint8_t k = 0; k < m; k++) {
+				acc += (int64_t) A[i*m+k] * B[j*m+k];
+			}
+			R[i*p+j] = util_fix_qround(acc, q);
+		}
+	}
+}
+
+static inline void util_fix_mat_add(int32_t * R, const int32_t * A, const int32_t * B, uint8_t n, uint8_t m) {
+	for(uint16_t i = 0; i < n*m; i++) {
+		R[i] = util_fix_qadd(A[i], B[i]);
+	}
+}
+
+static inline void util_fix_mat_sub(int32_t * R, const int32_t * A, const int32_t * B, uint8_t n, uint8_t m) {
+	for(uint16_t i = 0; i < n*m; i++) {
+		R[i] = util_fix_qsub(A[i], B[i]);
+	}
+}
+
+static inline void util_fix_mat_scale(int32_t * R, const int32_t * A, int32_t s, uint8_t n, uint8_t m, uint8_t q) {
+	for(uint16_t i = 0; i < n*m; i++) {
+		R[i] = util_fix_qmul(A[i], s, q);
+	}
+}
+
+static inline void util_fix_mat_transpose(int32_t * R, const int32_t * A, uint8_t n, uint8_t m) {
+	for(uint8_t i = 0; i < n; i++) {
+		for(uint8_t j = 0; j < m; j++) {
+			R[j*n+i] = A[i*m+j];
+		}
+	}
+}
+
+static inline void util_fix_mat_identity(int32_t * R, uint8_t n, uint8_t q) {
+	for(uint8_t i = 0; i < n; i++) {
+		for(uint8_t j = 0; j < n; j++) {
+			R[i*n+j] = i == j ? (int32_t) 1 << q : 0;
+		}
+	}
+}
+
+//2x2 helpers in 20.12
 static inline UTIL_MAT21_t util_fix_mat22_mul_mat21(UTIL_MAT22_t A, UTIL_MAT21_t B) {
 	UTIL_MAT21_t R;
-	R.x11 = util_fix_mul(A.x11, B.x11) + util_fix_mul(A.x12, B.x21);
-	R.x21 = util_fix_mul(A.x21, B.x11) + util_fix_mul(A.x22, B.x21);
+	R.x11 = util_fix_qround((int64_t) A.x11 * B.x11 + (int64_t) A.x12 * B.x21, UTIL_DECIMAL);
+	R.x21 = util_fix_qround((int64_t) A.x21 * B.x11 + (int64_t) A.x22 * B.x21, UTIL_DECIMAL);
 	return R;
 }
 
 static inline int32_t util_fix_mat12_mul_mat21(UTIL_MAT12_t A, UTIL_MAT21_t B) {
-	int32_t R;
-	R = util_fix_mul(A.x11, B.x11) + util_fix_mul(A.x12, B.x21);
+	return util_fix_qround((int64_t) A.x11 * B.x11 + (int64_t) A.x12 * B.x21, UTIL_DECIMAL);
+}
+
+static inline UTIL_MAT22_t util_fix_mat22_mul_mat22(UTIL_MAT22_t A, UTIL_MAT22_t B) {
+	UTIL_MAT22_t R;
+	R.x11 = util_fix_qround((int64_t) A.x11 * B.x11 + (int64_t) A.x12 * B.x21, UTIL_DECIMAL);
+	R.x12 = util_fix_qround((int64_t) A.x11 * B.x12 + (int64_t) A.x12 * B.x22, UTIL_DECIMAL);
+	R.x21 = util_fix_qround((int64_t) A.x21 * B.x11 + (int64_t) A.x22 * B.x21, UTIL_DECIMAL);
+	R.x22 = util_fix_qround((int64_t) A.x21 * B.x12 + (int64_t) A.x22 * B.x22, UTIL_DECIMAL);
+	return R;
+}
+
+static inline UTIL_MAT22_t util_fix_mat22_transpose(UTIL_MAT22_t A) {
+	UTIL_MAT22_t R;
+	R.x11 = A.x11;
+	R.x12 = A.x21;
+	R.x21 = A.x12;
+	R.x22 = A.x22;
 	return R;
 }
 
 static inline UTIL_MAT22_t util_fix_mat21_mul_mat12(UTIL_MAT21_t A, UTIL_MAT12_t B) {
 	UTIL_MAT22_t R;
-	R.x11 = util_fix_mul(A.x11, B.x11);
-	R.x12 = util_fix_mul(A.x11, B.x12);
-	R.x21 = util_fix_mul(A.x21, B.x11);
-	R.x22 = util_fix_mul(A.x21, B.x12);
+	R.x11 = util_fix_qmul(A.x11, B.x11, UTIL_DECIMAL);
+	R.x12 = util_fix_qmul(A.x11, B.x12, UTIL_DECIMAL);
+	R.x21 = util_fix_qmul(A.x21, B.x11, UTIL_DECIMAL);
+	R.x22 = util_fix_qmul(A.x21, B.x12, UTIL_DECIMAL);
 	return R;
 }
 
 static inline UTIL_MAT22_t util_fix_fix_mul_mat22(int32_t A, UTIL_MAT22_t B) {
 	UTIL_MAT22_t R;
-	R.x11 = util_fix_mul(A, B.x11);
-	R.x12 = util_fix_mul(A, B.x12);
-	R.x21 = util_fix_mul(A, B.x21);
-	R.x22 = util_fix_mul(A, B.x22);
+	R.x11 = util_fix_qmul(A, B.x11, UTIL_DECIMAL);
+	R.x12 = util_fix_qmul(A, B.x12, UTIL_DECIMAL);
+	R.x21 = util_fix_qmul(A, B.x21, UTIL_DECIMAL);
+	R.x22 = util_fix_qmul(A, B.x22, UTIL_DECIMAL);
 	return R;
 }
 
 static inline UTIL_MAT21_t util_fix_fix_mul_mat21(int32_t A, UTIL_MAT21_t B) {
 	UTIL_MAT21_t R;
-	R.x11 = util_fix_mul(A, B.x11);
-	R.x21 = util_fix_mul(A, B.x21);
+	R.x11 = util_fix_qmul(A, B.x11, UTIL_DECIMAL);
+	R.x21 = util_fix_qmul(A, B.x21, UTIL_DECIMAL);
 	return R;
 }
 
 static inline UTIL_MAT12_t util_fix_fix_mul_mat12(int32_t A, UTIL_MAT12_t B) {
 	UTIL_MAT12_t R;
-	R.x11 = util_fix_mul(A, B.x11);
-	R.x12 = util_fix_mul(A, B.x12);
+	R.x11 = util_fix_qmul(A, B.x11, UTIL_DECIMAL);
+	R.x12 = util_fix_qmul(A, B.x12, UTIL_DECIMAL);
 	return R;
 }
 
 
 static inline UTIL_MAT22_t util_fix_mat22_add_mat22(UTIL_MAT22_t A, UTIL_MAT22_t B) {
 	UTIL_MAT22_t R;
-	R.x11 = A.x11 + B.x11;
-	R.x12 = A.x12 + B.x12;
-	R.x21 = A.x21 + B.x21;
-	R.x22 = A.x22 + B.x22;
+	R.x11 = util_fix_qadd(A.x11, B.x11);
+	R.x12 = util_fix_qadd(A.x12, B.x12);
+	R.x21 = util_fix_qadd(A.x21, B.x21);
+	R.x22 = util_fix_qadd(A.x22, B.x22);
 	return R;
 }
 
 static inline UTIL_MAT21_t util_fix_mat21_add_mat21(UTIL_MAT21_t A, UTIL_MAT21_t B) {
 	UTIL_MAT21_t R;
-	R.x11 = A.x11 + B.x11;
-	R.x21 = A.x21 + B.x21;
+	R.x11 = util_fix_qadd(A.x11, B.x11);
+	R.x21 = util_fix_qadd(A.x21, B.x21);
 	return R;
 }
 
 static inline UTIL_MAT12_t util_fix_mat12_add_mat12(UTIL_MAT12_t A, UTIL_MAT12_t B) {
 	UTIL_MAT12_t R;
-	R.x11 = A.x11 + B.x11;
-	R.x12 = A.x12 + B.x12;
+	R.x11 = util_fix_qadd(A.x11, B.x11);
+	R.x12 = util_fix_qadd(A.x12, B.x12);
+	return R;
+}
+
+static inline UTIL_MAT22_t util_fix_mat22_sub_mat22(UTIL_MAT22_t A, UTIL_MAT22_t B) {
+	UTIL_MAT22_t R;
+	R.x11 = util_fix_qsub(A.x11, B.x11);
+	R.x12 = util_fix_qsub(A.x12, B.x12);
+	R.x21 = util_fix_qsub(A.x21, B.x21);
+	R.x22 = util_fix_qsub(A.x22, B.x22);
+	return R;
+}
+
+static inline UTIL_MAT21_t util_fix_mat21_sub_mat21(UTIL_MAT21_t A, UTIL_MAT21_t B) {
+	UTIL_MAT21_t R;
+	R.x11 = util_fix_qsub(A.x11, B.x11);
+	R.x21 = util_fix_qsub(A.x21, B.x21);
 	return R;
 }
 
@@ -0,0 +1,64 @@
+/*  Title       : Vane
+ *  Filename    : vane.h
+ *  Date        : 19.10.2026
+ *  Version     : 0.1
+ *  Description : TVC vane control
+ */
+
+#ifndef VANE_H
+#define VANE_H
+
+/**********************
+ *  INCLUDES
+ **********************/
+
+#include <stdint.h>
+#include <servo.h>
+
+/**********************
+ *  CONSTANTS
+ **********************/
+
+#define VANE_COUNT	(4)
+
+#define VANE_NEUTRAL	(2048)
+
+
+/**********************
+ *  MACROS
+ **********************/
+
+
+/**********************
+ *  TYPEDEFS
+ **********************/
+
+
+/**********************
+ *  VARIABLES
+ **********************/
+
+
+/**********************
+ *  PROTOTYPES
+ **********************/
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void vane_init(SERVO_INST_t ** servos);
+
+void vane_update(uint32_t time, int32_t * targets);
+
+void vane_neutral(void);
+
+uint8_t vane_get_positions(int32_t * positions);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* __cplusplus */
+
+#endif /* VANE_H */
+
+/* END */
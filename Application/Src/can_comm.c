@@ -40,6 +40,9 @@ CAN_msg can_buffer[CAN_BUFFER_DEPTH];
 volatile int32_t can_buffer_pointer_rx = 0;
 volatile int32_t can_buffer_pointer_tx = 0;
 
+//notified at each received frame
+static TaskHandle_t can_rx_task = NULL;
+
 
 uint32_t can_readFrame(void);
 
@@ -139,8 +142,17 @@ void can_setFrame(uint32_t data, uint8_t data_id, uint32_t timestamp) {
 }
 
 void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
 	can_readFrame();
 	can_addMsg(can_current_msg);
+	if(can_rx_task != NULL) {
+		vTaskNotifyGiveFromISR(can_rx_task, &xHigherPriorityTaskWoken);
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+
+void can_set_rx_task(TaskHandle_t task) {
+	can_rx_task = task;
 }
 
 uint32_t can_msgPending() {
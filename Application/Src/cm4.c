@@ -13,6 +13,16 @@
  *
  *		HB sends status request
  *		CM4 responds with it's internal status (or nothing if not yet completely booted)
+ *
+ *	The transactions which wait for the cm4 (ping, shutdown, link speed) are
+ *	run by the cm4 link thread, the control thread only posts a request with
+ *	cm4_link_set and reads the state with cm4_link_get_state.
+ *	The link thread sleeps until a request or an edge of RUN_PG (EXTI), the
+ *	pings during boot and the shutdown commands are retried with an
+ *	exponential back-off.
+ *	The sensor and feedback data are posted with cm4_post_sensors and
+ *	cm4_post_feedback, the link thread sends the latest values while the link
+ *	is ready, so that the producers never wait for the uart.
  */
 
 
@@ -35,6 +45,7 @@
 #include <main.h>
 #include <control.h>
 #include <pipeline.h>
+#include <storage.h>
 #include <led.h>
 
 
@@ -49,6 +60,13 @@
 
 #define CM4_RUN_PG_PIN 		RUN_PG_Pin
 #define CM4_RUN_PG_PORT 	RUN_PG_GPIO_Port
+#define CM4_RUN_PG_IRQn		EXTI15_10_IRQn
+
+//highest priority allowed to call the FreeRTOS API
+#define CM4_RUN_PG_IRQ_PRIORITY	(configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY)
+
+//fastest rate proposed to the cm4, halved until it is accepted
+#define CM4_BAUDRATE		921600
 
 /**********************
  *	CONSTANTS
@@ -56,10 +74,23 @@
 
 #define COMM_TIMEOUT pdMS_TO_TICKS(10)
 #define DRIV_TIMEOUT pdMS_TO_TICKS(200)
+#define TX_TIMEOUT 50 //ms
 #define LONG_TIME 0xffff
 
 #define GARBAGE_THRESHOLD 10
 
+#define BAUDRATE_PING_TRIES 3
+#define BAUDRATE_FALLBACK_DELAY 2500 //ms, cm4 goes back to the default rate after 2s of silence
+
+#define LINK_BACKOFF_MIN pdMS_TO_TICKS(10)
+#define LINK_BACKOFF_MAX pdMS_TO_TICKS(640)
+//nothing to do, only in case an edge of RUN_PG was missed
+#define LINK_IDLE_WAIT pdMS_TO_TICKS(1000)
+
+//data posted for the link thread
+#define LINK_POST_SENSORS	0b01
+#define LINK_POST_FEEDBACK	0b10
+
 
 /**********************
  *	MACROS
@@ -70,7 +101,11 @@
  *	TYPEDEFS
  **********************/
 
-
+typedef struct CM4_NEGOTIATION {
+	uint32_t baudrate; //rate proposed to the cm4, 0 when not negotiating
+	uint8_t tries; //pings left to confirm the rate, 0 until the cm4 accepts it
+	TickType_t resume; //the cm4 falls back after some silence
+}CM4_NEGOTIATION_t;
 
 /**********************
  *	VARIABLES
@@ -81,6 +116,23 @@
 static SemaphoreHandle_t cm4_busy_sem = NULL;
 static StaticSemaphore_t cm4_busy_sem_buffer;
 
+static SemaphoreHandle_t cm4_link_sem = NULL;
+static StaticSemaphore_t cm4_link_sem_buffer;
+
+//only one cm4, the last initialized instance
+static CM4_INST_t * cm4_link_inst = NULL;
+static volatile CM4_LINK_REQUEST_t cm4_link_request = CM4_LINK_IDLE;
+static volatile CM4_STATE_t cm4_link_state = CM4_POWERED_DOWN;
+//incremented by each request, the link thread drops the results of older ones
+static volatile uint32_t cm4_link_generation = 0;
+//only used by the link thread
+static CM4_NEGOTIATION_t cm4_negotiation = {0};
+
+//latest values posted, a value not sent yet is replaced by the newer one
+static CM4_PAYLOAD_SENSOR_t cm4_post_sens;
+static CM4_PAYLOAD_FEEDBACK_t cm4_post_feed;
+static volatile uint8_t cm4_post_pending = 0;
+
 
 
 
@@ -92,6 +144,13 @@ static StaticSemaphore_t cm4_busy_sem_buffer;
 static uint8_t is_booted(void);
 static void allow_boot(void);
 static void hold_boot(void);
+static void run_pg_init(void);
+static void cm4_link_update(uint32_t generation, CM4_STATE_t state);
+static void cm4_link_lost(void);
+static uint8_t cm4_negotiate_step(CM4_INST_t * cm4, TickType_t * wait);
+static void cm4_negotiate_start(TickType_t delay);
+static void cm4_negotiate_stop(CM4_INST_t * cm4);
+static void cm4_link_send_posted(CM4_INST_t * cm4);
 
 SERIAL_RET_t cm4_decode_fcn(void * inst, uint8_t data);
 
@@ -117,6 +176,8 @@ static uint16_t response_fcn_max = sizeof(response_fcn) / sizeof(void *);
 
 void cm4_global_init(void) {
 	cm4_busy_sem = xSemaphoreCreateMutexStatic(&cm4_busy_sem_buffer);
+	cm4_link_sem = xSemaphoreCreateBinaryStatic(&cm4_link_sem_buffer);
+	run_pg_init();
 }
 
 void cm4_init(CM4_INST_t * cm4) {
@@ -126,7 +187,7 @@ void cm4_init(CM4_INST_t * cm4) {
 	cm4->rx_sem = xSemaphoreCreateBinaryStatic(&cm4->rx_sem_buffer);
 	msv2_init(&cm4->msv2);
 	serial_init(&cm4->ser, &CM4_UART, cm4, cm4_decode_fcn);
-
+	cm4_link_inst = cm4;
 
 }
 
@@ -200,6 +261,7 @@ static void cm4_response_command(uint8_t * data, uint16_t data_len, uint8_t * re
 		cmd.state = util_decode_u16(data+48);
 
 		control_set_cmd(cmd);
+		storage_log(STORAGE_TYPE_COMMAND, &cmd);
 
 		pipeline_send_control(&cmd);
 
@@ -218,8 +280,10 @@ static void cm4_response_command(uint8_t * data, uint16_t data_len, uint8_t * re
 CM4_ERROR_t cm4_send(CM4_INST_t * cm4, uint8_t cmd, uint8_t * data, uint16_t length, uint8_t ** resp_data, uint16_t * resp_len) {
 	if (xSemaphoreTake(cm4_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
 		//led_on();
+		//the previous frame may still be in flight from the same buffer
+		serial_tx_wait(&cm4->ser, TX_TIMEOUT);
 		uint16_t frame_length = msv2_create_frame(&cm4->msv2, cmd, length/2, data);
-		serial_send(&cm4->ser, msv2_tx_data(&cm4->msv2), frame_length);
+		serial_tx_start(&cm4->ser, msv2_tx_data(&cm4->msv2), frame_length, TX_TIMEOUT);
 		if(cm4->rx_sem == NULL) {
 			xSemaphoreGive(cm4_busy_sem);
 			return CM4_LOCAL_ERROR;
@@ -241,9 +305,15 @@ CM4_ERROR_t cm4_send(CM4_INST_t * cm4, uint8_t cmd, uint8_t * data, uint16_t len
 				return CM4_REMOTE_ERROR;
 			}
 		} else {
-			cm4->garbage_counter++;
+			//pings while connecting or shutting down are expected to go unanswered
+			if(cm4_link_get_state() == CM4_READY) {
+				cm4->garbage_counter++;
+			}
 			if(cm4->garbage_counter > GARBAGE_THRESHOLD) {
-				serial_garbage_clean(&cm4->ser);
+				//link lost, both sides fall back to the default rate (the serial thread
+				//owns the uart) and the link thread negotiates the rate again
+				serial_request_baudrate(&cm4->ser, SERIAL_DEFAULT_BAUDRATE);
+				cm4_link_lost();
 				cm4->garbage_counter = 0;
 			}
 			xSemaphoreGive(cm4_busy_sem);
@@ -312,6 +382,119 @@ CM4_ERROR_t cm4_send_feedback(CM4_INST_t * cm4, CM4_PAYLOAD_FEEDBACK_t * feed) {
 	return error;
 }
 
+/*
+ * Never blocks, the data is dropped while the link is not ready
+ */
+void cm4_post_sensors(CM4_PAYLOAD_SENSOR_t * sens) {
+	if(!cm4_link_is_ready()) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	cm4_post_sens = *sens;
+	cm4_post_pending |= LINK_POST_SENSORS;
+	taskEXIT_CRITICAL();
+	if(cm4_link_sem != NULL) {
+		xSemaphoreGive(cm4_link_sem);
+	}
+}
+
+void cm4_post_feedback(CM4_PAYLOAD_FEEDBACK_t * feed) {
+	if(!cm4_link_is_ready()) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	cm4_post_feed = *feed;
+	cm4_post_pending |= LINK_POST_FEEDBACK;
+	taskEXIT_CRITICAL();
+	if(cm4_link_sem != NULL) {
+		xSemaphoreGive(cm4_link_sem);
+	}
+}
+
+//called by the link thread while the link is ready
+static void cm4_link_send_posted(CM4_INST_t * cm4) {
+	CM4_PAYLOAD_SENSOR_t sens;
+	CM4_PAYLOAD_FEEDBACK_t feed;
+	taskENTER_CRITICAL();
+	uint8_t pending = cm4_post_pending;
+	cm4_post_pending = 0;
+	sens = cm4_post_sens;
+	feed = cm4_post_feed;
+	taskEXIT_CRITICAL();
+	if(pending & LINK_POST_SENSORS) {
+		cm4_send_sensors(cm4, &sens);
+	}
+	if(pending & LINK_POST_FEEDBACK) {
+		cm4_send_feedback(cm4, &feed);
+	}
+}
+
+/*
+ * Agree on a faster link speed once the cm4 answers, one transaction per step
+ * so that the link thread checks its request and RUN_PG in between.
+ * The cm4 answers at the current rate before switching, the new rate is
+ * then confirmed by pings, on failure both sides go back to the default.
+ * returns 1 once the negotiation is over, wait is the delay before the next step
+ */
+static uint8_t cm4_negotiate_step(CM4_INST_t * cm4, TickType_t * wait) {
+	CM4_NEGOTIATION_t * neg = &cm4_negotiation;
+	TickType_t now = xTaskGetTickCount();
+	*wait = 0;
+	if((int32_t)(neg->resume - now) > 0) {
+		*wait = neg->resume - now;
+		return 0;
+	}
+	if(neg->tries == 0) {
+		uint8_t send_data[4];
+		uint8_t * recv_data;
+		uint16_t recv_len = 0;
+		if(neg->baudrate <= SERIAL_DEFAULT_BAUDRATE) {
+			//stays at the default rate
+			neg->baudrate = 0;
+			return 1;
+		}
+		if(serial_baudrate_valid(neg->baudrate)) {
+			util_encode_u32(send_data, neg->baudrate);
+			if(cm4_send(cm4, CM4_H2C_BAUDRATE, send_data, 4, &recv_data, &recv_len) == CM4_SUCCESS &&
+					recv_len == 2 && recv_data[0] == MSV2_OK_LO && recv_data[1] == MSV2_OK_HI) {
+				serial_request_baudrate(&cm4->ser, neg->baudrate);
+				neg->tries = BAUDRATE_PING_TRIES;
+				return 0;
+			}
+		}
+		neg->baudrate /= 2;
+		return 0;
+	}
+	if(cm4_ping(cm4) == CM4_SUCCESS) {
+		neg->baudrate = 0;
+		neg->tries = 0;
+		return 1;
+	}
+	if(--neg->tries == 0) {
+		serial_request_baudrate(&cm4->ser, SERIAL_DEFAULT_BAUDRATE);
+		neg->baudrate /= 2;
+		neg->resume = now + pdMS_TO_TICKS(BAUDRATE_FALLBACK_DELAY);
+		*wait = pdMS_TO_TICKS(BAUDRATE_FALLBACK_DELAY);
+	}
+	return 0;
+}
+
+//delay before the first step
+static void cm4_negotiate_start(TickType_t delay) {
+	cm4_negotiation.baudrate = CM4_BAUDRATE;
+	cm4_negotiation.tries = 0;
+	cm4_negotiation.resume = xTaskGetTickCount() + delay;
+}
+
+//the cm4 may not follow a rate that is not confirmed yet, both sides go back to the default
+static void cm4_negotiate_stop(CM4_INST_t * cm4) {
+	if(cm4_negotiation.tries) {
+		serial_request_baudrate(&cm4->ser, SERIAL_DEFAULT_BAUDRATE);
+	}
+	cm4_negotiation.baudrate = 0;
+	cm4_negotiation.tries = 0;
+}
+
 CM4_ERROR_t cm4_boot(CM4_INST_t * cm4) {
 	allow_boot();
 	return CM4_SUCCESS;
@@ -356,10 +539,136 @@ CM4_ERROR_t cm4_is_shutdown(CM4_INST_t * cm4, uint8_t * shutdown) {
 
 
 CM4_ERROR_t cm4_force_shutdown(CM4_INST_t * cm4) {
+	cm4_link_set(CM4_LINK_IDLE);
 	hold_boot();
 	return CM4_SUCCESS;
 }
 
+/*
+ * Supervises the cm4 power and link for the control thread
+ * CONNECT: once RUN_PG is up, ping until the cm4 answers, then agree on the link speed
+ *   step by step (again when cm4_send loses the link), then send the posted data
+ * SHUTDOWN: send the shutdown command until RUN_PG falls, then hold the cm4 down
+ * IDLE: the cm4 is held down, wait for RUN_PG to fall
+ */
+void cm4_link_thread(void * arg) {
+	TickType_t wait = LINK_IDLE_WAIT;
+	TickType_t backoff = LINK_BACKOFF_MIN;
+	uint32_t last_generation = 0;
+
+	while(cm4_link_inst == NULL) {
+		osDelay(1);
+	}
+
+	for(;;) {
+		xSemaphoreTake(cm4_link_sem, wait);
+		CM4_INST_t * cm4 = cm4_link_inst;
+		uint32_t generation = cm4_link_generation;
+		CM4_LINK_REQUEST_t request = cm4_link_request;
+		uint8_t booted = is_booted();
+		wait = LINK_IDLE_WAIT;
+
+		if(generation != last_generation) {
+			//new request, first try at once
+			backoff = LINK_BACKOFF_MIN;
+			last_generation = generation;
+			cm4_negotiate_stop(cm4);
+		}
+
+		if(request == CM4_LINK_CONNECT) {
+			if(!booted) {
+				//woken up by the rising edge
+				cm4_negotiate_stop(cm4);
+				cm4_link_update(generation, CM4_BOOTING);
+			} else if(cm4_link_state == CM4_NEGOTIATING) {
+				if(!cm4_negotiation.baudrate) {
+					//link lost by cm4_send, the cm4 goes back to the default rate after some silence
+					cm4_negotiate_start(pdMS_TO_TICKS(BAUDRATE_FALLBACK_DELAY));
+				}
+				//stays at the default rate if the cm4 does not agree
+				if(cm4_negotiate_step(cm4, &wait)) {
+					cm4_link_update(generation, CM4_READY);
+				}
+			} else if(cm4_link_state != CM4_READY) {
+				cm4_link_update(generation, CM4_PREPARING);
+				if(cm4_ping(cm4) == CM4_SUCCESS) {
+					cm4_negotiate_stop(cm4);
+					cm4_negotiate_start(0);
+					cm4_link_update(generation, CM4_NEGOTIATING);
+					wait = 0;
+				} else {
+					wait = backoff;
+					backoff = backoff*2 < LINK_BACKOFF_MAX ? backoff*2 : LINK_BACKOFF_MAX;
+				}
+			} else {
+				cm4_link_send_posted(cm4);
+			}
+		} else if(request == CM4_LINK_SHUTDOWN) {
+			if(booted) {
+				cm4_link_update(generation, CM4_SHUTTING_DOWN);
+				cm4_shutdown(cm4);
+				wait = backoff;
+				backoff = backoff*2 < LINK_BACKOFF_MAX ? backoff*2 : LINK_BACKOFF_MAX;
+			} else {
+				hold_boot();
+				cm4_link_update(generation, CM4_POWERED_DOWN);
+			}
+		} else {
+			cm4_link_update(generation, booted ? CM4_SHUTTING_DOWN : CM4_POWERED_DOWN);
+		}
+	}
+}
+
+//the state is only changed if no request came in the meantime
+static void cm4_link_update(uint32_t generation, CM4_STATE_t state) {
+	taskENTER_CRITICAL();
+	if(generation == cm4_link_generation) {
+		cm4_link_state = state;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * The link went silent at its current rate, it is not ready until the link
+ * thread has negotiated the rate again
+ */
+static void cm4_link_lost(void) {
+	taskENTER_CRITICAL();
+	if(cm4_link_state == CM4_READY) {
+		cm4_link_state = CM4_NEGOTIATING;
+	}
+	taskEXIT_CRITICAL();
+	if(cm4_link_sem != NULL) {
+		xSemaphoreGive(cm4_link_sem);
+	}
+}
+
+/*
+ * Never blocks, the link is not ready until the new request is served
+ */
+void cm4_link_set(CM4_LINK_REQUEST_t request) {
+	taskENTER_CRITICAL();
+	cm4_link_generation++;
+	cm4_link_request = request;
+	if(request == CM4_LINK_CONNECT) {
+		cm4_link_state = CM4_BOOTING;
+	} else if(cm4_link_state != CM4_POWERED_DOWN) {
+		cm4_link_state = CM4_SHUTTING_DOWN;
+	}
+	taskEXIT_CRITICAL();
+	if(cm4_link_sem != NULL) {
+		xSemaphoreGive(cm4_link_sem);
+	}
+}
+
+CM4_STATE_t cm4_link_get_state(void) {
+	return cm4_link_state;
+}
+
+uint8_t cm4_link_is_ready(void) {
+	return cm4_link_state == CM4_READY;
+}
+
 
 
 static uint8_t is_booted(void) {
@@ -374,6 +683,31 @@ static void hold_boot(void) {
 	CM4_GLOBAL_EN_PORT->BSRR = CM4_GLOBAL_EN_PIN << 16;
 }
 
+/*
+ * Both edges of RUN_PG wake up the link thread
+ */
+static void run_pg_init(void) {
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+	GPIO_InitStruct.Pin = CM4_RUN_PG_PIN;
+	GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	HAL_GPIO_Init(CM4_RUN_PG_PORT, &GPIO_InitStruct);
+	HAL_NVIC_SetPriority(CM4_RUN_PG_IRQn, CM4_RUN_PG_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(CM4_RUN_PG_IRQn);
+}
+
+void EXTI15_10_IRQHandler(void) {
+	HAL_GPIO_EXTI_IRQHandler(CM4_RUN_PG_PIN);
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	if(GPIO_Pin == CM4_RUN_PG_PIN && cm4_link_sem != NULL) {
+		xSemaphoreGiveFromISR(cm4_link_sem, &xHigherPriorityTaskWoken);
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+
 
 
 
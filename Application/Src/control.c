@@ -9,6 +9,8 @@
 /**********************
  *	INCLUDES
  **********************/
+#include <string.h>
+
 #include <main.h>
 #include <cmsis_os.h>
 #include <control.h>
@@ -18,12 +20,22 @@
 #include <servo.h>
 #include <cm4.h>
 #include <pipeline.h>
+#include <vane.h>
+#include <setpoint.h>
+#include <health.h>
+#include <tick.h>
 
 /**********************
  *	CONFIGURATION
  **********************/
 
-#define CONTROL_HEART_BEAT	10 /* ms */
+//default period, can be changed at runtime with control_set_period
+#define CONTROL_PERIOD		10000 /* us */
+
+#define CONTROL_CAN_HEART_BEAT	1000 /* ms */
+
+//thrust command on CAN, independent of the control period
+#define CONTROL_CAN_THRUST_PERIOD	10 /* ms */
 
 
 
@@ -31,15 +43,18 @@
  *	CONSTANTS
  **********************/
 
-#define TIME_TOL (CONTROL_HEART_BEAT/2)
-
-
 #define TARGET_REACHED_DELAY_CYCLES	(50)
 
 #define SCHED_ALLOWED_WIDTH	(6)
 
 #define CONTROL_SAVE_DELAY	(5000)
 
+//the loop still runs if the tick timer stops
+#define CONTROL_RELEASE_TIMEOUT	pdMS_TO_TICKS(2*TICK_MAX_PERIOD/1000)
+
+//cycle timing logged every second
+#define CONTROL_TIMING_LOG_PERIOD	(1000) /* ms */
+
 #define USE_DYNAMIXEL 0
 
 #define USE_PIPELINE  0
@@ -60,6 +75,15 @@
 
 static CONTROL_INST_t control;
 
+//cycle timing, written by the control thread only
+static CONTROL_TIMING_t control_timing;
+static STORAGE_TIMING_t control_timing_window;
+static uint32_t control_timing_window_cycles;
+static uint32_t control_timing_window_start;
+static uint32_t control_cycle_start;
+static uint8_t control_cycle_started;
+static volatile uint8_t control_timing_reset_pending; //applied by the control thread
+
 
 //Authorisations table
 static CONTROL_SCHED_t sched_allowed[][SCHED_ALLOWED_WIDTH] = {
@@ -75,6 +99,7 @@ static CONTROL_SCHED_t sched_allowed[][SCHED_ALLOWED_WIDTH] = {
  *	PROTOTYPES
  **********************/
 static void init_control(CONTROL_INST_t * control);
+static void control_set_state(CONTROL_INST_t * control, CONTROL_STATE_t state);
 static void control_update(CONTROL_INST_t * control);
 
 // Enter state functions
@@ -99,6 +124,11 @@ static uint8_t control_sched_should_run(CONTROL_INST_t * control, CONTROL_SCHED_
 static void control_sched_done(CONTROL_INST_t * control, CONTROL_SCHED_t num);
 static void control_sched_set(CONTROL_INST_t * control, CONTROL_SCHED_t num);
 
+//timing
+
+static void control_timing_start(void);
+static void control_timing_end(void);
+
 
 static void (*control_fcn[])(CONTROL_INST_t *) = {
 		idle,
@@ -116,8 +146,6 @@ static void (*control_fcn[])(CONTROL_INST_t *) = {
 
 void control_thread(void * arg) {
 
-	static TickType_t last_wake_time;
-	static const TickType_t period = pdMS_TO_TICKS(CONTROL_HEART_BEAT);
 
 
 
@@ -125,17 +153,36 @@ void control_thread(void * arg) {
 
 	init_control(&control);
 
+	//cycle counter for the cycle timing
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 #if USE_DYNAMIXEL == 1
 
-	static SERVO_INST_t tvc_servo;
+	static SERVO_INST_t tvc_servos[VANE_COUNT];
+	static SERVO_INST_t * tvc_list[VANE_COUNT];
+
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		servo_init(&tvc_servos[i], i+1);
+		tvc_list[i] = &tvc_servos[i];
+	}
+
+	servo_link_bringup();
+
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		servo_config(&tvc_servos[i]);
+	}
 
-	servo_global_init();
+	control.tvc_servo = &tvc_servos[0];
 
-	servo_init(&tvc_servo, 1);
+	vane_init(tvc_list);
 
-	servo_config(&tvc_servo);
+	health_init(tvc_list, VANE_COUNT);
 
-	control.tvc_servo = &tvc_servo;
+	//from here the servo bus thread owns the bus
+	servo_bus_start();
+#else
+	health_init(NULL, 0);
 #endif
 
 	cm4_global_init();
@@ -153,23 +200,21 @@ void control_thread(void * arg) {
 
 
 
-	last_wake_time = xTaskGetTickCount();
+	//released by the tick timer
+	tick_start(xTaskGetCurrentTaskHandle(), CONTROL_PERIOD);
 
 
 	for(;;) {
 
+		control_timing_start();
+
 #if USE_DYNAMIXEL == 1
 		static uint8_t lol = 0;
-		static uint16_t cnt = 0;
-		if(cnt++ > 10) {
+		static uint32_t lol_time = 0;
+		if(control.time - lol_time > 100) {
 			lol = !lol;
-			cnt = 0;
-		}
-
-		if(lol) {
-			servo_enable_led(control.tvc_servo, NULL);
-		} else {
-			servo_disable_led(control.tvc_servo, NULL);
+			lol_time = control.time;
+			servo_request_write(control.tvc_servo, SERVO_LED, 1, &lol);
 		}
 #endif
 
@@ -179,7 +224,10 @@ void control_thread(void * arg) {
 		if(control.state < CS_NUM && control.state >= 0) {
 			control_fcn[control.state](&control);
 		}
-		vTaskDelayUntil( &last_wake_time, period );
+
+		control_timing_end();
+
+		ulTaskNotifyTake(pdTRUE, CONTROL_RELEASE_TIMEOUT);
 	}
 }
 
@@ -194,20 +242,18 @@ static void control_update(CONTROL_INST_t * control) {
 		control->counter -= (control->time - control->last_time);
 	}
 
-	static uint16_t hb_count = 0;
-	hb_count += CONTROL_HEART_BEAT;
-	if(hb_count > 1000) {
+	if(control->time - control->heartbeat_time >= CONTROL_CAN_HEART_BEAT) {
 		pipeline_send_heartbeat(control->state, control->command_payload.state, control->time);
-		hb_count = 0;
+		control->heartbeat_time = control->time;
 	}
 
-#if USE_DYNAMIXEL == 1
-	//read servo parameters
-	servo_sync(control->tvc_servo);
-#endif
-
 	//init error if there is an issue with a motor
 
+	//lost link, the abort is handled in this same cycle
+	if(health_check(control->state)) {
+		control_abort();
+	}
+
 	if(control_sched_should_run(control, CONTROL_SCHED_ABORT)) {
 		init_abort(control);
 		control_sched_done(control, CONTROL_SCHED_ABORT);
@@ -220,8 +266,19 @@ static void init_control(CONTROL_INST_t * control) {
 	control->command_payload.thrust = 2000;
 }
 
+/*
+ * Change state and log the transition
+ */
+static void control_set_state(CONTROL_INST_t * control, CONTROL_STATE_t state) {
+	STORAGE_TRANSITION_t transition;
+	transition.from = control->state;
+	transition.to = state;
+	control->state = state;
+	storage_log(STORAGE_TYPE_STATE, &transition);
+}
+
 static void init_idle(CONTROL_INST_t * control) {
-	control->state = CS_IDLE;
+	control_set_state(control, CS_IDLE);
 	led_set_color(LED_GREEN);
 	storage_disable();
 	cm4_force_shutdown(control->cm4);
@@ -231,7 +288,7 @@ static void init_idle(CONTROL_INST_t * control) {
 static void idle(CONTROL_INST_t * control) {
 #if USE_DYNAMIXEL == 1
 	if(control_sched_should_run(control, CONTROL_SCHED_MOVE_TVC)) {
-		servo_move(control->tvc_servo, control->tvc_mov_target);
+		servo_set_target(control->tvc_servo, control->tvc_mov_target);
 		control_sched_done(control, CONTROL_SCHED_MOVE_TVC);
 	}
 #endif
@@ -246,15 +303,14 @@ static void init_boot(CONTROL_INST_t * control) {
 	//global enable
 	//to boot the rpi
 	led_set_color(LED_LILA);
-	control->state = CS_BOOT;
+	control_set_state(control, CS_BOOT);
 	cm4_boot(control->cm4);
+	cm4_link_set(CM4_LINK_CONNECT);
 }
 
 static void boot(CONTROL_INST_t * control) {
-	//wait for the cm4 to start answering with concluent status packets
-	uint8_t ready = 0;
-	cm4_is_ready(control->cm4, &ready);
-	if(ready) {
+	//the link thread pings the cm4 and agrees on the link speed
+	if(cm4_link_is_ready()) {
 		init_compute(control);
 	}
 }
@@ -262,13 +318,25 @@ static void boot(CONTROL_INST_t * control) {
 static void init_compute(CONTROL_INST_t * control) {
 	//start sending data to raspberry pi
 	led_set_color(LED_BLUE);
-	control->state = CS_COMPUTE;
 	storage_restart();
-	storage_enable();
+	storage_trigger();
+	setpoint_reset();
+	health_arm();
+	control_set_state(control, CS_COMPUTE);
 
 }
 
 static void compute(CONTROL_INST_t * control) {
+	//cm4 commands smoothed to the control rate
+	int32_t setpoints[SETPOINT_CHANNELS];
+	uint8_t valid = setpoint_get(control->time, setpoints);
+	if(valid && control->time - control->thrust_time >= CONTROL_CAN_THRUST_PERIOD) {
+		pipeline_send_thrust(setpoints[SETPOINT_THRUST], control->time);
+		control->thrust_time = control->time;
+	}
+#if USE_DYNAMIXEL == 1
+	vane_update(control->time, valid ? setpoints+SETPOINT_VANE_1 : NULL);
+#endif
 
 	if(control_sched_should_run(control, CONTROL_SCHED_SHUTDOWN)) {
 		init_shutdown(control);
@@ -279,16 +347,15 @@ static void compute(CONTROL_INST_t * control) {
 
 static void init_shutdown(CONTROL_INST_t * control) {
 	led_set_color(LED_ORANGE);
-	control->state = CS_SHUTDOWN;
-	cm4_shutdown(control->cm4);
+	control_set_state(control, CS_SHUTDOWN);
+	health_disarm();
+	cm4_link_set(CM4_LINK_SHUTDOWN);
 	storage_disable();
 }
 
 static void shutdown(CONTROL_INST_t * control) {
-	uint8_t shutdown = 0;
-	cm4_shutdown(control->cm4);
-	cm4_is_shutdown(control->cm4, &shutdown);
-	if(shutdown) {
+	//the link thread sends the shutdown command until RUN_PG falls
+	if(cm4_link_get_state() == CM4_POWERED_DOWN) {
 		init_idle(control);
 	}
 }
@@ -296,11 +363,13 @@ static void shutdown(CONTROL_INST_t * control) {
 static void init_abort(CONTROL_INST_t * control) {
 	led_set_color(LED_PINK);
 	control->shadow_state = control->state;
-	control->state = CS_ABORT;
+	control_set_state(control, CS_ABORT);
+	health_disarm();
 #if USE_DYNAMIXEL == 1
-	servo_move(control->tvc_servo, 2048); //2048 is the straight position
+	vane_neutral();
 #endif
 	control->counter_active=0;
+	storage_trigger();
 	storage_disable();
 	cm4_force_shutdown(control->cm4);
 }
@@ -314,8 +383,10 @@ static void _abort(CONTROL_INST_t * control) {
 
 static void init_error(CONTROL_INST_t * control) {
 	led_set_color(LED_RED);
-	control->state = CS_ERROR;
+	control_set_state(control, CS_ERROR);
+	health_disarm();
 	control->counter_active = 0;
+	storage_trigger();
 	storage_disable();
 }
 
@@ -357,10 +428,14 @@ void control_recover() {
 CONTROL_STATUS_t control_get_status() {
 	CONTROL_STATUS_t status = {0};
 	status.state = control.state;
-	status.tvc_error = control.tvc_servo->error;
-	status.tvc_psu_voltage = control.tvc_servo->psu_voltage;
-	status.tvc_temperature = control.tvc_servo->temperature;
-	status.tvc_position = control.tvc_servo->position;
+	if(control.tvc_servo != NULL) {
+		//last values read by the servo bus thread
+		SERVO_TELEMETRY_t tvc = servo_get_telemetry(control.tvc_servo);
+		status.tvc_error = tvc.error;
+		status.tvc_psu_voltage = tvc.psu_voltage;
+		status.tvc_temperature = tvc.temperature;
+		status.tvc_position = tvc.position;
+	}
 	status.time = control.last_time;
 
 	return status;
@@ -370,6 +445,58 @@ CM4_INST_t * control_get_cm4(void) {
 	return control.cm4;
 }
 
+void control_get_timing(CONTROL_TIMING_t * timing) {
+	taskENTER_CRITICAL();
+	*timing = control_timing;
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * The counters are cleared by the control thread at the start of its next cycle
+ */
+void control_timing_reset(void) {
+	control_timing_reset_pending = 1;
+}
+
+/*
+ * period in us, between TICK_MIN_PERIOD and TICK_MAX_PERIOD
+ * applies from the next cycle, the timing counters are cleared
+ */
+uint8_t control_set_period(uint32_t period) {
+	if(!tick_set_period(period)) {
+		return 0;
+	}
+	control_timing_reset();
+	return 1;
+}
+
+uint32_t control_get_period(void) {
+	return tick_get_period();
+}
+
+/*
+ * Upper edge of the jitter bin holding the given fraction of the cycles
+ * the last bin also holds everything above it
+ */
+uint32_t control_timing_percentile(const CONTROL_TIMING_t * timing, uint16_t per_mille) {
+	uint32_t total = 0;
+	for(uint8_t i = 0; i < CONTROL_TIMING_BINS; i++) {
+		total += timing->bins[i];
+	}
+	if(!total) {
+		return 0;
+	}
+	uint32_t target = ((uint64_t) total * per_mille + 999) / 1000;
+	uint32_t sum = 0;
+	for(uint8_t i = 0; i < CONTROL_TIMING_BINS; i++) {
+		sum += timing->bins[i];
+		if(sum >= target) {
+			return (i+1)*CONTROL_TIMING_BIN_US;
+		}
+	}
+	return CONTROL_TIMING_BINS*CONTROL_TIMING_BIN_US;
+}
+
 void control_set_sens(CM4_PAYLOAD_SENSOR_t sens) {
 	control.sensor_payload = sens;
 }
@@ -380,6 +507,8 @@ CM4_PAYLOAD_SENSOR_t control_get_sens(void) {
 
 void control_set_cmd(CM4_PAYLOAD_COMMAND_t cmd) {
 	control.command_payload = cmd;
+	setpoint_push(&cmd);
+	health_feed(HEALTH_CM4_COMMAND);
 }
 
 CM4_PAYLOAD_COMMAND_t control_get_cmd(void) {
@@ -422,6 +551,66 @@ static void control_sched_set(CONTROL_INST_t * control, CONTROL_SCHED_t num) {
 }
 
 
+/*
+ * Start of a cycle, the jitter is the time since the previous start
+ * against the period
+ */
+static void control_timing_start(void) {
+	uint32_t now = DWT->CYCCNT;
+	int32_t period = tick_get_period();
+	if(control_timing_reset_pending) {
+		control_timing_reset_pending = 0;
+		memset(&control_timing, 0, sizeof(control_timing));
+		//no jitter sample across the reset
+		control_cycle_started = 0;
+	}
+	if(control_cycle_started) {
+		int32_t jitter = (int32_t) ((now - control_cycle_start) / (SystemCoreClock / 1000000)) - period;
+		uint32_t bin = (jitter < 0 ? -jitter : jitter) / CONTROL_TIMING_BIN_US;
+		if(!control_timing.cycles || jitter < control_timing.jitter_min) {
+			control_timing.jitter_min = jitter;
+		}
+		if(!control_timing.cycles || jitter > control_timing.jitter_max) {
+			control_timing.jitter_max = jitter;
+		}
+		control_timing.bins[bin < CONTROL_TIMING_BINS ? bin : CONTROL_TIMING_BINS-1]++;
+		if(jitter > period/2) {
+			control_timing.late++;
+			control_timing_window.late++;
+		}
+		if(!control_timing_window_cycles || jitter < control_timing_window.jitter_min) {
+			control_timing_window.jitter_min = jitter;
+		}
+		if(!control_timing_window_cycles || jitter > control_timing_window.jitter_max) {
+			control_timing_window.jitter_max = jitter;
+		}
+		control_timing.cycles++;
+		control_timing_window_cycles++;
+	}
+	control_cycle_start = now;
+	control_cycle_started = 1;
+}
+
+static void control_timing_end(void) {
+	uint32_t exec = (DWT->CYCCNT - control_cycle_start) / (SystemCoreClock / 1000000);
+	if(exec > control_timing.exec_max) {
+		control_timing.exec_max = exec;
+	}
+	if(exec > control_timing_window.exec_max) {
+		control_timing_window.exec_max = exec;
+	}
+	if(exec > tick_get_period()) {
+		control_timing.overruns++;
+		control_timing_window.overruns++;
+	}
+	if(control.time - control_timing_window_start >= CONTROL_TIMING_LOG_PERIOD) {
+		storage_log(STORAGE_TYPE_TIMING, &control_timing_window);
+		memset(&control_timing_window, 0, sizeof(control_timing_window));
+		control_timing_window_cycles = 0;
+		control_timing_window_start = control.time;
+	}
+}
+
 
 /* END */
 
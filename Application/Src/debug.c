@@ -11,16 +11,64 @@
  *	Read sensor data
  *	Read stored data
  *	Configure ignition sequence parameters
+ *
+ *	Log streaming:
+ *	STREAM_START (offset, length) answers OK, then the debug stream thread pushes
+ *	the range of the selected session in STREAM frames:
+ *		[seq (2)][length (2)][offset (4)][length bytes of data]
+ *	At most STREAM_WINDOW frames are in flight (selective repeat). The host
+ *	acknowledges with STREAM_ACK (seq, bitmap), not answered: every frame before
+ *	seq was received, bit i of the bitmap tells that frame seq+1+i was received.
+ *	Frames missing below a received one (lost or wrong crc) are sent again at
+ *	once, frames still unacknowledged after STREAM_TIMEOUT ms are sent again.
+ *	STREAM_STOP aborts the transfer.
+ *
+ *	Live telemetry:
+ *	TELEMETRY (groups, period) subscribes to the groups of the mask, the board
+ *	then pushes a TELEMETRY_PUSH frame every period ms:
+ *		[seq (2)][groups (2)][status (24)][command (46)][sensors (28)][feedback (24)]
+ *	only the selected groups are present, encoded as their polling commands.
+ *	The subscription ends after TELEMETRY_LEASE ms unless it is renewed,
+ *	a period or mask of 0 ends it at once. No telemetry is sent during a log stream.
+ *
+ *	Link speed:
+ *	BAUDRATE (rate) is answered at the current rate, then the uart switches.
+ *	The host must send a valid frame at the new rate within BAUDRATE_CONFIRM ms,
+ *	otherwise the previous rate is restored.
+ *
+ *	Servo link:
+ *	SERVO_RTT ([reset (2)]) returns the round trip times of the servo bus:
+ *		[baudrate (4)][max us (4)][timeouts (4)][bin width us (2)][bins (2)][bins x count (4)]
+ *	a non zero reset clears the histogram after it is read.
+ *
+ *	Health monitor:
+ *	HEALTH ([source (2)][threshold ms (4)]) sets the threshold of a source
+ *	(0 disables it), then returns the state of every source:
+ *		[sources (2)][threshold (4)][triggers (4)] x sources
+ *
+ *	Control loop timing:
+ *	CONTROL_TIMING ([reset (2)]) returns the cycle timing of the control thread:
+ *		[cycles (4)][overruns (4)][late (4)][jitter min us (4)][jitter max us (4)]
+ *		[exec max us (4)][p50 (4)][p99 (4)][p999 (4)][bin width us (2)][bins (2)][bins x count (4)]
+ *	the percentiles are the upper edges of the bins of the absolute jitter,
+ *	a non zero reset clears the counters after they are read.
+ *	CONTROL_PERIOD ([period us (4)]) changes the period of the control loop,
+ *	then returns the current period (4), an out of range period answers ERROR.
  */
 
 /**********************
  *	INCLUDES
  **********************/
 
+#include <string.h>
+
 #include <debug.h>
 #include <usart.h>
 #include <control.h>
 #include <storage.h>
+#include <util.h>
+#include <servo.h>
+#include <health.h>
 
 
 /**********************
@@ -31,6 +79,39 @@
 
 
 #define DOWNLOAD_LEN  (4)
+#define DOWNLOAD_RAW_LEN  (4)
+#define DOWNLOAD_RAW_MAX  (256)
+#define SESSION_LIST_LEN  (4)
+#define SESSION_LIST_MAX  (8)
+#define SESSION_ENTRY_LEN  (20)
+#define SESSION_SELECT_LEN  (4)
+#define STREAM_START_LEN  (8)
+#define STREAM_ACK_LEN  (2)
+#define STREAM_SACK_LEN  (4)
+#define STREAM_HEAD  (8)
+#define STREAM_CHUNK  (500)
+#define STREAM_WINDOW  (16) //bitmap width
+#define STREAM_TIMEOUT  (300)
+#define STREAM_TX_TIMEOUT  (100)
+#define DEBUG_TX_TIMEOUT  (100)
+#define STREAM_OPCODE  (0x0E)
+#define BAUDRATE_LEN  (4)
+#define TELEMETRY_LEN  (4)
+#define TELEMETRY_HEAD  (4)
+#define TELEMETRY_MIN_PERIOD  (10)
+#define TELEMETRY_LEASE  (5000)
+#define TELEMETRY_PUSH  (0x92) //board initiated, top bit set
+#define TELEMETRY_STATUS  (0x01)
+#define TELEMETRY_COMMAND  (0x02)
+#define TELEMETRY_SENSORS  (0x04)
+#define TELEMETRY_FEEDBACK  (0x08)
+#define TELEMETRY_ALL  (0x0f)
+#define TELEMETRY_FEEDBACK_LEN  (24)
+#define BAUDRATE_CONFIRM  (1000)
+#define SERVO_RTT_RESET_LEN  (2)
+#define HEALTH_SET_LEN  (6)
+#define CONTROL_TIMING_RESET_LEN  (2)
+#define CONTROL_PERIOD_LEN  (4)
 #define TVC_MOVE_LEN  (4)
 #define TRANSACTION_SENS_LEN  (28)
 #define TRANSACTION_CMD_LEN  (46)
@@ -56,11 +137,49 @@
  *	TYPEDEFS
  **********************/
 
+typedef enum DEBUG_FRAME_STATE{
+	FRAME_SENT,
+	FRAME_RESENT,
+	FRAME_ACKED,
+	FRAME_RESEND
+}DEBUG_FRAME_STATE_t;
+
+typedef struct DEBUG_STREAM{
+	uint8_t active;
+	uint32_t end;
+	uint16_t base; //oldest unacknowledged frame
+	uint16_t next; //next new frame
+	uint32_t next_offset;
+	//frames in flight, indexed by seq
+	uint32_t offsets[STREAM_WINDOW];
+	uint16_t lengths[STREAM_WINDOW];
+	DEBUG_FRAME_STATE_t state[STREAM_WINDOW];
+}DEBUG_STREAM_t;
+
+typedef struct DEBUG_TELEMETRY{
+	uint16_t groups; //0 when not subscribed
+	uint16_t seq;
+	TickType_t period;
+	TickType_t next;
+	TickType_t lease_end;
+}DEBUG_TELEMETRY_t;
+
 
 /**********************
  *	VARIABLES
  **********************/
 
+static DEBUG_INST_t * debug_inst = NULL;
+
+static DEBUG_STREAM_t debug_stream;
+static DEBUG_TELEMETRY_t debug_telemetry;
+static MSV2_INST_t stream_msv2; //separate tx buffer, responses may be sent during a stream
+
+static uint32_t debug_baudrate_pending = 0;
+
+static SemaphoreHandle_t stream_sem = NULL;
+static StaticSemaphore_t stream_sem_buffer;
+
 
 /**********************
  *	PROTOTYPES
@@ -78,6 +197,18 @@ static void debug_sensor_write(uint8_t * data, uint16_t data_len, uint8_t * resp
 static void debug_command_read(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
 static void debug_sensor_read(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
 static void debug_feedback_write(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_download_raw(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_session_list(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_session_select(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_stream_start(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_stream_ack(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_stream_stop(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_baudrate(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_telemetry_subscribe(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_servo_rtt(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_health(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_control_timing(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
+static void debug_control_period(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len);
 
 
 /**********************
@@ -94,7 +225,19 @@ static void (*debug_fcn[]) (uint8_t *, uint16_t, uint8_t *, uint16_t *) = {
 		debug_sensor_write,			//0x07
 		debug_command_read,			//0x08
 		debug_sensor_read,			//0x09
-		debug_feedback_write		//0x0A
+		debug_feedback_write,		//0x0A
+		debug_download_raw,			//0x0B
+		debug_session_list,			//0x0C
+		debug_session_select,		//0x0D
+		debug_stream_start,			//0x0E
+		debug_stream_ack,			//0x0F
+		debug_stream_stop,			//0x10
+		debug_baudrate,				//0x11
+		debug_telemetry_subscribe,	//0x12
+		debug_servo_rtt,			//0x13
+		debug_health,				//0x14
+		debug_control_timing,		//0x15
+		debug_control_period		//0x16
 };
 
 static uint16_t debug_fcn_max = sizeof(debug_fcn) / sizeof(void *);
@@ -113,18 +256,25 @@ SERIAL_RET_t debug_decode_fcn(void * inst, uint8_t data) {
 	MSV2_ERROR_t tmp = msv2_decode_fragment(&debug->msv2, data);
 
 	if(tmp == MSV2_SUCCESS) {
+		//the host talks at the negotiated baudrate
+		serial_baudrate_confirm(&debug->ser);
+		//length is in bytes, a command that does not answer leaves it at 0
+		length = 0;
 		if(debug->msv2.rx.opcode < debug_fcn_max) {
-
 			debug_fcn[debug->msv2.rx.opcode](debug->msv2.rx.data, debug->msv2.rx.length, send_data, &length);
-			//length is in words
-			bin_length = msv2_create_frame(&debug->msv2, debug->msv2.rx.opcode, length/2, send_data);
-			serial_send(&debug->ser, msv2_tx_data(&debug->msv2), bin_length);
 		} else {
 			send_data[0] = CRC_ERROR_LO;
 			send_data[1] = CRC_ERROR_HI;
 			length = 2;
+		}
+		//the previous answer or a stream frame may still be in flight
+		if(length && serial_tx_wait(&debug->ser, DEBUG_TX_TIMEOUT)) {
 			bin_length = msv2_create_frame(&debug->msv2, debug->msv2.rx.opcode, length/2, send_data);
-			serial_send(&debug->ser, msv2_tx_data(&debug->msv2), bin_length);
+			serial_tx_start(&debug->ser, msv2_tx_data(&debug->msv2), bin_length, DEBUG_TX_TIMEOUT);
+		}
+		if(debug_baudrate_pending) {
+			serial_set_baudrate(&debug->ser, debug_baudrate_pending, BAUDRATE_CONFIRM);
+			debug_baudrate_pending = 0;
 		}
 	}
 
@@ -136,6 +286,13 @@ void debug_init(DEBUG_INST_t * debug) {
 	msv2_init(&debug->msv2);
 	serial_init(&debug->ser, &DEBUG_UART, debug, debug_decode_fcn);
 	debug->id = id_counter++;
+	if(debug_inst == NULL) {
+		debug_inst = debug;
+		msv2_init(&stream_msv2);
+		stream_sem = xSemaphoreCreateBinaryStatic(&stream_sem_buffer);
+		debug_stream.active = 0;
+		debug_telemetry.groups = 0;
+	}
 }
 
 static void debug_get_status(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
@@ -149,7 +306,8 @@ static void debug_get_status(uint8_t * data, uint16_t data_len, uint8_t * resp,
 	util_encode_u16(resp+16, status.tvc_psu_voltage);
 	util_encode_u8(resp+18, status.tvc_error);
 	util_encode_i8(resp+19, status.tvc_temperature);
-	*resp_len = 20;
+	util_encode_u32(resp+20, storage_get_used_bytes());
+	*resp_len = 24;
 }
 
 static void debug_boot(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
@@ -178,6 +336,407 @@ static void debug_download(uint8_t * data, uint16_t data_len, uint8_t * resp, ui
 	}
 }
 
+//downloads the compressed log as stored in flash, offset relative to the start of the selected session
+static void debug_download_raw(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == DOWNLOAD_RAW_LEN) {
+		uint32_t offset = util_decode_u32(data);
+		uint32_t length = storage_get_raw(offset, resp, DOWNLOAD_RAW_MAX);
+		if(length & 0x01) {
+			resp[length++] = 0xff;
+		}
+		*resp_len = length;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+//lists up to 8 sessions starting at an index, index 0 is the current session
+static void debug_session_list(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == SESSION_LIST_LEN) {
+		uint32_t index = util_decode_u32(data);
+		STORAGE_SESSION_t session;
+		uint16_t length = 0;
+		for(uint8_t i = 0; i < SESSION_LIST_MAX && storage_get_session(index+i, &session); i++) {
+			util_encode_u32(resp+length, session.id);
+			util_encode_u32(resp+length+4, session.start);
+			util_encode_u32(resp+length+8, session.length);
+			util_encode_u32(resp+length+12, session.start_tick);
+			util_encode_u32(resp+length+16, session.fw_version);
+			length += SESSION_ENTRY_LEN;
+		}
+		if(length == 0) {
+			resp[length++] = ERROR_LO;
+			resp[length++] = ERROR_HI;
+		}
+		*resp_len = length;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+//selects the session served by the raw download, answers with its length
+static void debug_session_select(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	uint32_t length;
+	if(data_len == SESSION_SELECT_LEN && storage_select_session(util_decode_u32(data), &length)) {
+		util_encode_u32(resp, length);
+		*resp_len = 4;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+//starts streaming a range of the selected session
+static void debug_stream_start(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == STREAM_START_LEN && stream_sem != NULL) {
+		uint32_t offset = util_decode_u32(data);
+		uint32_t length = util_decode_u32(data+4);
+		taskENTER_CRITICAL();
+		debug_stream.end = offset + length;
+		debug_stream.base = 0;
+		debug_stream.next = 0;
+		debug_stream.next_offset = offset;
+		debug_stream.active = 1;
+		taskEXIT_CRITICAL();
+		xSemaphoreGive(stream_sem);
+		resp[0] = OK_LO;
+		resp[1] = OK_HI;
+		*resp_len = 2;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+//selective acknowledgement, not answered
+static void debug_stream_ack(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == STREAM_ACK_LEN || data_len == STREAM_SACK_LEN) {
+		uint16_t seq = util_decode_u16(data);
+		uint16_t bitmap = (data_len == STREAM_SACK_LEN) ? util_decode_u16(data+2) : 0;
+		taskENTER_CRITICAL();
+		uint16_t in_flight = debug_stream.next - debug_stream.base;
+		if((uint16_t)(seq - debug_stream.base) <= in_flight) {
+			debug_stream.base = seq;
+			in_flight = debug_stream.next - seq;
+			//the frames missing below the last one received were lost
+			int16_t highest = -1;
+			for(uint16_t i = 0; i < STREAM_WINDOW-1 && i+1 < in_flight; i++) {
+				if(bitmap & (1 << i)) {
+					debug_stream.state[(seq+1+i) % STREAM_WINDOW] = FRAME_ACKED;
+					highest = i+1;
+				}
+			}
+			for(int16_t i = 0; i < highest; i++) {
+				if(debug_stream.state[(seq+i) % STREAM_WINDOW] == FRAME_SENT) {
+					debug_stream.state[(seq+i) % STREAM_WINDOW] = FRAME_RESEND;
+				}
+			}
+		}
+		taskEXIT_CRITICAL();
+		xSemaphoreGive(stream_sem);
+	}
+	*resp_len = 0;
+}
+
+static void debug_stream_stop(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	debug_stream.active = 0;
+	resp[0] = OK_LO;
+	resp[1] = OK_HI;
+	*resp_len = 2;
+}
+
+//switches the link speed after the answer, see serial_set_baudrate
+static void debug_baudrate(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == BAUDRATE_LEN && serial_baudrate_valid(util_decode_u32(data))) {
+		debug_baudrate_pending = util_decode_u32(data);
+		resp[0] = OK_LO;
+		resp[1] = OK_HI;
+		*resp_len = 2;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+static void debug_servo_rtt(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	SERVO_RTT_t rtt;
+	servo_get_rtt(&rtt);
+	if(data_len == SERVO_RTT_RESET_LEN && util_decode_u16(data)) {
+		servo_rtt_reset();
+	}
+	util_encode_u32(resp, rtt.baudrate);
+	util_encode_u32(resp+4, rtt.max_us);
+	util_encode_u32(resp+8, rtt.timeouts);
+	util_encode_u16(resp+12, SERVO_RTT_BIN_US);
+	util_encode_u16(resp+14, SERVO_RTT_BINS);
+	for(uint8_t i = 0; i < SERVO_RTT_BINS; i++) {
+		util_encode_u32(resp+16+i*4, rtt.bins[i]);
+	}
+	*resp_len = 16 + SERVO_RTT_BINS*4;
+}
+
+static void debug_health(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == HEALTH_SET_LEN) {
+		health_set_threshold(util_decode_u16(data), util_decode_u32(data+2));
+	}
+	util_encode_u16(resp, HEALTH_SOURCE_NUM);
+	for(uint8_t i = 0; i < HEALTH_SOURCE_NUM; i++) {
+		util_encode_u32(resp+2+i*8, health_get_threshold(i));
+		util_encode_u32(resp+6+i*8, health_get_triggers(i));
+	}
+	*resp_len = 2 + HEALTH_SOURCE_NUM*8;
+}
+
+static void debug_control_timing(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	CONTROL_TIMING_t timing;
+	control_get_timing(&timing);
+	if(data_len == CONTROL_TIMING_RESET_LEN && util_decode_u16(data)) {
+		control_timing_reset();
+	}
+	util_encode_u32(resp, timing.cycles);
+	util_encode_u32(resp+4, timing.overruns);
+	util_encode_u32(resp+8, timing.late);
+	util_encode_i32(resp+12, timing.jitter_min);
+	util_encode_i32(resp+16, timing.jitter_max);
+	util_encode_u32(resp+20, timing.exec_max);
+	util_encode_u32(resp+24, control_timing_percentile(&timing, 500));
+	util_encode_u32(resp+28, control_timing_percentile(&timing, 990));
+	util_encode_u32(resp+32, control_timing_percentile(&timing, 999));
+	util_encode_u16(resp+36, CONTROL_TIMING_BIN_US);
+	util_encode_u16(resp+38, CONTROL_TIMING_BINS);
+	for(uint8_t i = 0; i < CONTROL_TIMING_BINS; i++) {
+		util_encode_u32(resp+40+i*4, timing.bins[i]);
+	}
+	*resp_len = 40 + CONTROL_TIMING_BINS*4;
+}
+
+static void debug_control_period(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == CONTROL_PERIOD_LEN && !control_set_period(util_decode_u32(data))) {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+		return;
+	}
+	util_encode_u32(resp, control_get_period());
+	*resp_len = 4;
+}
+
+//period of 0 unsubscribes
+static void debug_telemetry_subscribe(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
+	if(data_len == TELEMETRY_LEN && stream_sem != NULL) {
+		uint16_t groups = util_decode_u16(data) & TELEMETRY_ALL;
+		uint16_t period = util_decode_u16(data+2);
+		if(period && period < TELEMETRY_MIN_PERIOD) {
+			period = TELEMETRY_MIN_PERIOD;
+		}
+		taskENTER_CRITICAL();
+		if(!period || !groups) {
+			debug_telemetry.groups = 0;
+		} else {
+			if(!debug_telemetry.groups) {
+				debug_telemetry.next = xTaskGetTickCount();
+			}
+			debug_telemetry.groups = groups;
+			debug_telemetry.period = pdMS_TO_TICKS(period);
+			debug_telemetry.lease_end = xTaskGetTickCount() + pdMS_TO_TICKS(TELEMETRY_LEASE);
+		}
+		taskEXIT_CRITICAL();
+		xSemaphoreGive(stream_sem);
+		resp[0] = OK_LO;
+		resp[1] = OK_HI;
+		*resp_len = 2;
+	} else {
+		resp[0] = ERROR_LO;
+		resp[1] = ERROR_HI;
+		*resp_len = 2;
+	}
+}
+
+/*
+ * One telemetry frame with the current values of the subscribed groups
+ */
+static void debug_telemetry_send(uint8_t * frame) {
+	uint16_t length = TELEMETRY_HEAD;
+	uint16_t group_len;
+	uint16_t groups = debug_telemetry.groups;
+	util_encode_u16(frame, debug_telemetry.seq++);
+	util_encode_u16(frame+2, groups);
+	if(groups & TELEMETRY_STATUS) {
+		debug_get_status(NULL, 0, frame+length, &group_len);
+		length += group_len;
+	}
+	if(groups & TELEMETRY_COMMAND) {
+		debug_command_read(NULL, 0, frame+length, &group_len);
+		length += group_len;
+	}
+	if(groups & TELEMETRY_SENSORS) {
+		debug_sensor_read(NULL, 0, frame+length, &group_len);
+		length += group_len;
+	}
+	if(groups & TELEMETRY_FEEDBACK) {
+		CM4_PAYLOAD_FEEDBACK_t feedback = control_get_fdb();
+		util_encode_u32(frame+length, feedback.timestamp);
+		util_encode_i32(frame+length+4, feedback.cc_pressure);
+		util_encode_i32(frame+length+8, feedback.dynamixel[0]);
+		util_encode_i32(frame+length+12, feedback.dynamixel[1]);
+		util_encode_i32(frame+length+16, feedback.dynamixel[2]);
+		util_encode_i32(frame+length+20, feedback.dynamixel[3]);
+		length += TELEMETRY_FEEDBACK_LEN;
+	}
+	if(!serial_tx_wait(&debug_inst->ser, STREAM_TX_TIMEOUT)) {
+		return;
+	}
+	uint16_t bin_length = msv2_create_frame(&stream_msv2, TELEMETRY_PUSH, length/2, frame);
+	serial_tx_start(&debug_inst->ser, msv2_tx_data(&stream_msv2), bin_length, STREAM_TX_TIMEOUT);
+}
+
+/*
+ * Pick the next frame to transmit: retransmissions first, then new frames
+ * returns 0 if nothing can be sent
+ */
+static uint8_t debug_stream_pick(uint16_t * seq, uint32_t * offset, uint32_t * length, uint8_t * is_new) {
+	uint8_t found = 0;
+	taskENTER_CRITICAL();
+	for(uint16_t s = debug_stream.base; s != debug_stream.next; s++) {
+		if(debug_stream.state[s % STREAM_WINDOW] == FRAME_RESEND) {
+			*seq = s;
+			*offset = debug_stream.offsets[s % STREAM_WINDOW];
+			*length = debug_stream.lengths[s % STREAM_WINDOW];
+			*is_new = 0;
+			debug_stream.state[s % STREAM_WINDOW] = FRAME_RESENT;
+			found = 1;
+			break;
+		}
+	}
+	if(!found && (uint16_t)(debug_stream.next - debug_stream.base) < STREAM_WINDOW && debug_stream.next_offset < debug_stream.end) {
+		*seq = debug_stream.next;
+		*offset = debug_stream.next_offset;
+		*length = debug_stream.end - debug_stream.next_offset;
+		*is_new = 1;
+		found = 1;
+	}
+	taskEXIT_CRITICAL();
+	return found;
+}
+
+/*
+ * Pushes the stream frames, the next chunk is read from flash while the
+ * current frame is being transmitted
+ */
+void debug_stream_thread(void * arg) {
+	static uint8_t frame[STREAM_HEAD+STREAM_CHUNK+1];
+	static uint8_t ahead[STREAM_CHUNK];
+	uint32_t ahead_offset = 0;
+	uint32_t ahead_len = 0;
+
+	while(stream_sem == NULL) {
+		osDelay(10);
+	}
+
+	for(;;) {
+		if(!debug_stream.active) {
+			ahead_len = 0;
+			if(!debug_telemetry.groups) {
+				xSemaphoreTake(stream_sem, portMAX_DELAY);
+				continue;
+			}
+			TickType_t now = xTaskGetTickCount();
+			if((int32_t)(now - debug_telemetry.lease_end) >= 0) {
+				debug_telemetry.groups = 0;
+			} else if((int32_t)(now - debug_telemetry.next) >= 0) {
+				debug_telemetry_send(frame);
+				debug_telemetry.next += debug_telemetry.period;
+				if((int32_t)(now - debug_telemetry.next) >= 0) {
+					//the link is too slow for the period, skip the missed frames
+					debug_telemetry.next = now + debug_telemetry.period;
+				}
+			} else {
+				xSemaphoreTake(stream_sem, debug_telemetry.next - now);
+			}
+			continue;
+		}
+
+		uint16_t seq;
+		uint32_t offset;
+		uint32_t length;
+		uint8_t is_new;
+		if(!debug_stream_pick(&seq, &offset, &length, &is_new)) {
+			if(debug_stream.base == debug_stream.next && debug_stream.next_offset >= debug_stream.end) {
+				debug_stream.active = 0;
+				continue;
+			}
+			//wait for an acknowledgement, send everything unacknowledged again if none comes
+			if(xSemaphoreTake(stream_sem, pdMS_TO_TICKS(STREAM_TIMEOUT)) != pdTRUE) {
+				taskENTER_CRITICAL();
+				for(uint16_t s = debug_stream.base; s != debug_stream.next; s++) {
+					if(debug_stream.state[s % STREAM_WINDOW] != FRAME_ACKED) {
+						debug_stream.state[s % STREAM_WINDOW] = FRAME_RESEND;
+					}
+				}
+				taskEXIT_CRITICAL();
+			}
+			continue;
+		}
+
+		if(is_new) {
+			if(ahead_len == 0 || ahead_offset != offset) {
+				ahead_len = storage_get_raw(offset, ahead, STREAM_CHUNK);
+				ahead_offset = offset;
+			}
+			if(length > ahead_len) {
+				length = ahead_len;
+			}
+			if(length == 0) {
+				//past the end of the session
+				debug_stream.active = 0;
+				continue;
+			}
+		}
+
+		if(!serial_tx_wait(&debug_inst->ser, STREAM_TX_TIMEOUT)) {
+			if(!is_new) {
+				debug_stream.state[seq % STREAM_WINDOW] = FRAME_RESEND;
+			}
+			continue;
+		}
+		util_encode_u16(frame, seq);
+		util_encode_u16(frame+2, length);
+		util_encode_u32(frame+4, offset);
+		if(is_new) {
+			memcpy(frame+STREAM_HEAD, ahead, length);
+		} else {
+			storage_get_raw(offset, frame+STREAM_HEAD, length);
+		}
+		frame[STREAM_HEAD+length] = 0xff; //padding to a word
+		uint16_t bin_length = msv2_create_frame(&stream_msv2, STREAM_OPCODE, (STREAM_HEAD+length+1)/2, frame);
+
+		if(is_new) {
+			taskENTER_CRITICAL();
+			debug_stream.offsets[seq % STREAM_WINDOW] = offset;
+			debug_stream.lengths[seq % STREAM_WINDOW] = length;
+			debug_stream.state[seq % STREAM_WINDOW] = FRAME_SENT;
+			debug_stream.next = seq + 1;
+			debug_stream.next_offset = offset + length;
+			taskEXIT_CRITICAL();
+		}
+
+		serial_tx_start(&debug_inst->ser, msv2_tx_data(&stream_msv2), bin_length, STREAM_TX_TIMEOUT);
+
+		//read ahead while the frame is on the line
+		if(is_new && offset + length < debug_stream.end) {
+			ahead_offset = offset + length;
+			ahead_len = storage_get_raw(ahead_offset, ahead, STREAM_CHUNK);
+		}
+	}
+}
+
 static void debug_tvc_move(uint8_t * data, uint16_t data_len, uint8_t * resp, uint16_t * resp_len) {
 	if(data_len == TVC_MOVE_LEN) {
 		int32_t target = util_decode_i32(data);
@@ -220,7 +779,7 @@ static void debug_sensor_write(uint8_t * data, uint16_t data_len, uint8_t * resp
 		sens_data.baro = util_decode_i32(data+24);
 
 		control_set_sens(sens_data);
-		cm4_send_sensors(control_get_cm4(), &sens_data);
+		cm4_post_sensors(&sens_data);
 		storage_notify();
 
 		resp[0] = OK_LO;
@@ -281,7 +840,7 @@ static void debug_feedback_write(uint8_t * data, uint16_t data_len, uint8_t * re
 		CM4_PAYLOAD_FEEDBACK_t feedback_data = {};
 		feedback_data.cc_pressure = util_decode_u32(data);
 
-		cm4_send_feedback(control_get_cm4(), &feedback_data);
+		cm4_post_feedback(&feedback_data);
 
 		resp[0] = OK_LO;
 		resp[1] = OK_HI;
@@ -28,6 +28,19 @@
 #define H3		(0xfd)
 #define H4		(0x00)
 
+#define HEADER_LEN		(8)
+#define BROADCAST		(0xFE)
+
+#define SYNC_READ		(0x82)
+#define SYNC_WRITE		(0x83)
+#define BULK_READ		(0x92)
+#define BULK_WRITE		(0x93)
+
+//1: 16 entries CRC table instead of 256 (smaller, about twice slower)
+#ifndef DSV2_CRC_NIBBLE
+#define DSV2_CRC_NIBBLE	0
+#endif
+
 
 
 /**********************
@@ -53,55 +66,76 @@
 
 static uint16_t calc_crc(uint16_t crc_accum, uint8_t * data_blk_ptr, uint16_t data_blk_size);
 
+static uint16_t finish_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len, uint8_t inst);
+
 
 /**********************
  *	DECLARATIONS
  **********************/
 
-static uint16_t calc_crc(uint16_t crc_accum, uint8_t * data_blk_ptr, uint16_t data_blk_size) {
-    unsigned short i, j;
-    unsigned short crc_table[256] = {
-        0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
-        0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
-        0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
-        0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
-        0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
-        0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
-        0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
-        0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
-        0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
-        0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
-        0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
-        0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
-        0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
-        0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
-        0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
-        0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
-        0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
-        0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
-        0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
-        0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
-        0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
-        0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
-        0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
-        0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
-        0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
-        0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
-        0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
-        0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
-        0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
-        0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
-        0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
-        0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
-    };
-
-    for(j = 0; j < data_blk_size; j++)
-    {
-        i = ((unsigned short)(crc_accum >> 8) ^ data_blk_ptr[j]) & 0xFF;
-        crc_accum = (crc_accum << 8) ^ crc_table[i];
-    }
+#if DSV2_CRC_NIBBLE == 1
+
+//CRC-16 (poly 0x8005) of a nibble, 32 bytes of flash
+static const uint16_t crc_table[16] = {
+		0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+		0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022
+};
+
+static inline uint16_t crc_update(uint16_t crc_accum, uint8_t d) {
+	crc_accum = (crc_accum << 4) ^ crc_table[((crc_accum >> 12) ^ (d >> 4)) & 0x0F];
+	crc_accum = (crc_accum << 4) ^ crc_table[((crc_accum >> 12) ^ d) & 0x0F];
+	return crc_accum;
+}
+
+#else
+
+//CRC-16 (poly 0x8005) of a byte, kept in flash
+static const uint16_t crc_table[256] = {
+		0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+		0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+		0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+		0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+		0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+		0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+		0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+		0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+		0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+		0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+		0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+		0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+		0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+		0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+		0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+		0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+		0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+		0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+		0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+		0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+		0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+		0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+		0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+		0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+		0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+		0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+		0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+		0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+		0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+		0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+		0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+		0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
+};
+
+static inline uint16_t crc_update(uint16_t crc_accum, uint8_t d) {
+	return (crc_accum << 8) ^ crc_table[((crc_accum >> 8) ^ d) & 0xFF];
+}
 
-    return crc_accum;
+#endif
+
+static uint16_t calc_crc(uint16_t crc_accum, uint8_t * data_blk_ptr, uint16_t data_blk_size) {
+	for(uint16_t j = 0; j < data_blk_size; j++) {
+		crc_accum = crc_update(crc_accum, data_blk_ptr[j]);
+	}
+	return crc_accum;
 }
 
 
@@ -110,7 +144,10 @@ void dsv2_init(DSV2_INST_t * dsv2) {
 	dsv2->id = id_counter++;
 }
 
-uint16_t dsv2_create_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len, uint8_t inst, uint8_t * data) {
+/*
+ * header and crc around the parameters already in the tx buffer
+ */
+static uint16_t finish_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len, uint8_t inst) {
 	dsv2->tx.data[0] = H1;
 	dsv2->tx.data[1] = H2;
 	dsv2->tx.data[2] = H3;
@@ -119,16 +156,87 @@ uint16_t dsv2_create_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len
 	dsv2->tx.data[5] = (data_len+3) & 0xff;
 	dsv2->tx.data[6] = (data_len+3)>>8;
 	dsv2->tx.data[7] = inst;
-	uint16_t counter=8;
-	for(uint16_t i = 0; i < data_len; i++) {
-		dsv2->tx.data[counter++] = data[i];
-	}
-	uint16_t crc = calc_crc(0, dsv2->tx.data, data_len + 8);
+	uint16_t counter = HEADER_LEN + data_len;
+	uint16_t crc = calc_crc(0, dsv2->tx.data, counter);
 	dsv2->tx.data[counter++] = crc&0xff; //crc bytes are inverted (LSB first) !!
 	dsv2->tx.data[counter++] = crc>>8;
 	return counter;
 }
 
+uint16_t dsv2_create_frame(DSV2_INST_t * dsv2, uint8_t dev_id, uint16_t data_len, uint8_t inst, uint8_t * data) {
+	for(uint16_t i = 0; i < data_len; i++) {
+		dsv2->tx.data[HEADER_LEN+i] = data[i];
+	}
+	return finish_frame(dsv2, dev_id, data_len, inst);
+}
+
+/*
+ * Same area of several devices, each one answers with its own status packet
+ * in the order of dev_ids
+ */
+uint16_t dsv2_create_sync_read(DSV2_INST_t * dsv2, uint16_t address, uint16_t length, uint8_t * dev_ids, uint8_t count) {
+	uint8_t * params = dsv2->tx.data + HEADER_LEN;
+	params[0] = address & 0xff;
+	params[1] = address>>8;
+	params[2] = length & 0xff;
+	params[3] = length>>8;
+	for(uint8_t i = 0; i < count; i++) {
+		params[4+i] = dev_ids[i];
+	}
+	return finish_frame(dsv2, BROADCAST, 4+count, SYNC_READ);
+}
+
+/*
+ * Same area of several devices, data holds length bytes per device, no answer
+ */
+uint16_t dsv2_create_sync_write(DSV2_INST_t * dsv2, uint16_t address, uint16_t length, uint8_t * dev_ids, uint8_t * data, uint8_t count) {
+	uint8_t * params = dsv2->tx.data + HEADER_LEN;
+	uint16_t counter = 4;
+	params[0] = address & 0xff;
+	params[1] = address>>8;
+	params[2] = length & 0xff;
+	params[3] = length>>8;
+	for(uint8_t i = 0; i < count; i++) {
+		params[counter++] = dev_ids[i];
+		for(uint16_t j = 0; j < length; j++) {
+			params[counter++] = data[i*length+j];
+		}
+	}
+	return finish_frame(dsv2, BROADCAST, counter, SYNC_WRITE);
+}
+
+/*
+ * A different area for each device, answered like the sync read
+ */
+uint16_t dsv2_create_bulk_read(DSV2_INST_t * dsv2, uint8_t * dev_ids, uint16_t * addresses, uint16_t * lengths, uint8_t count) {
+	uint8_t * params = dsv2->tx.data + HEADER_LEN;
+	uint16_t counter = 0;
+	for(uint8_t i = 0; i < count; i++) {
+		params[counter++] = dev_ids[i];
+		params[counter++] = addresses[i] & 0xff;
+		params[counter++] = addresses[i]>>8;
+		params[counter++] = lengths[i] & 0xff;
+		params[counter++] = lengths[i]>>8;
+	}
+	return finish_frame(dsv2, BROADCAST, counter, BULK_READ);
+}
+
+uint16_t dsv2_create_bulk_write(DSV2_INST_t * dsv2, uint8_t * dev_ids, uint16_t * addresses, uint16_t * lengths, uint8_t ** data, uint8_t count) {
+	uint8_t * params = dsv2->tx.data + HEADER_LEN;
+	uint16_t counter = 0;
+	for(uint8_t i = 0; i < count; i++) {
+		params[counter++] = dev_ids[i];
+		params[counter++] = addresses[i] & 0xff;
+		params[counter++] = addresses[i]>>8;
+		params[counter++] = lengths[i] & 0xff;
+		params[counter++] = lengths[i]>>8;
+		for(uint16_t j = 0; j < lengths[i]; j++) {
+			params[counter++] = data[i][j];
+		}
+	}
+	return finish_frame(dsv2, BROADCAST, counter, BULK_WRITE);
+}
+
 SERIAL_RET_t dsv2_decode_func(void * inst, uint8_t data) {
 	return dsv2_decode_fragment((DSV2_INST_t *) inst, data);
 }
@@ -142,63 +250,63 @@ DSV2_ERROR_t dsv2_decode_fragment(DSV2_INST_t * dsv2, uint8_t d) {
 	/*
 	if(dsv2->rx.restart_state == DSV2_WAITING_H4 && d == H4) {
 		dsv2->rx.state = DSV2_WAITING_ID;
-		dsv2->rx.crc_data[3] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.counter = 0;
 		return DSV2_PROGRESS;
 	} else if(dsv2->rx.restart_state == DSV2_WAITING_H3 && d == H3) {
 		dsv2->rx.restart_state = DSV2_WAITING_H4;
-		dsv2->rx.crc_data[2] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 	} else if(dsv2->rx.restart_state == DSV2_WAITING_H2 && d == H2) {
 		dsv2->rx.restart_state = DSV2_WAITING_H3;
-		dsv2->rx.crc_data[1] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 	} else if(d == H1) {
 		dsv2->rx.restart_state = DSV2_WAITING_H2;
-		dsv2->rx.crc_data[0] = d;
+		dsv2->rx.crc_accum = crc_update(0, d);
 	}
 	*/
 
     if(dsv2->rx.state == DSV2_WAITING_H1 && d == H1) {
     	dsv2->rx.state = DSV2_WAITING_H2;
-    	dsv2->rx.crc_data[0] = d;
+    	dsv2->rx.crc_accum = crc_update(0, d);
     	return DSV2_PROGRESS;
     }
     if(dsv2->rx.state == DSV2_WAITING_H2 && d == H2) {
 		dsv2->rx.state = DSV2_WAITING_H3;
-		dsv2->rx.crc_data[1] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_H3 && d == H3) {
 		dsv2->rx.state = DSV2_WAITING_H4;
-		dsv2->rx.crc_data[2] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_H4 && d == H4) {
 		dsv2->rx.state = DSV2_WAITING_ID;
-		dsv2->rx.crc_data[3] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_ID) {
 		dsv2->rx.state = DSV2_WAITING_LEN1;
-		dsv2->rx.crc_data[4] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.dev_id = d;
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_LEN1) {
 		dsv2->rx.state = DSV2_WAITING_LEN2;
-		dsv2->rx.crc_data[5] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.data_len = d;
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_LEN2) {
 		dsv2->rx.state = DSV2_WAITING_INST;
-		dsv2->rx.crc_data[6] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.data_len |= d<<8;
 		return DSV2_PROGRESS;
 	}
     if(dsv2->rx.state == DSV2_WAITING_INST) {
 		dsv2->rx.state = DSV2_WAITING_DATA;
 		dsv2->rx.counter = 0;
-		dsv2->rx.crc_data[7] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.inst = d;
 		if(dsv2->rx.inst != 85) {
 			dsv2->rx.state = DSV2_WAITING_H1;
@@ -206,7 +314,7 @@ DSV2_ERROR_t dsv2_decode_fragment(DSV2_INST_t * dsv2, uint8_t d) {
 		return DSV2_PROGRESS;
 	}
 	if(dsv2->rx.state == DSV2_WAITING_DATA) {
-		dsv2->rx.crc_data[dsv2->rx.counter + 8] = d;
+		dsv2->rx.crc_accum = crc_update(dsv2->rx.crc_accum, d);
 		dsv2->rx.data[dsv2->rx.counter++] = d;
 		if(dsv2->rx.counter == dsv2->rx.data_len-3) {  //DATA LENGTH CONTAINS INST, ERR AND CRC
 			dsv2->rx.state = DSV2_WAITING_CRC1;
@@ -222,11 +330,10 @@ DSV2_ERROR_t dsv2_decode_fragment(DSV2_INST_t * dsv2, uint8_t d) {
 		dsv2->rx.state = DSV2_WAITING_H1;
 		dsv2->rx.crc |= d<<8;
 
-		uint16_t crc = calc_crc(0, dsv2->rx.crc_data, dsv2->rx.data_len + 5);
 		dsv2->rx.counter = 0;
 
 		if(dsv2->rx.inst == 85) {
-			if(crc == dsv2->rx.crc) {
+			if(dsv2->rx.crc_accum == dsv2->rx.crc) {
 				return DSV2_SUCCESS;
 			}else {
 				return DSV2_WRONG_CRC;
@@ -0,0 +1,202 @@
+/*  Title		: Health
+ *  Filename	: health.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: health monitor, aborts on lost links
+ *
+ *	The threads receiving data report each sign of life of a source with
+ *	health_feed. While armed (in COMPUTE), the control thread calls
+ *	health_check at every cycle, a source silent for longer than its
+ *	threshold trips the monitor and the caller aborts in the same cycle.
+ *	The abort latency is at most the threshold plus one control period,
+ *	whatever the state of the CM4 link.
+ *	The servos are checked from their telemetry: stale telemetry or the
+ *	alert bit of the status packet.
+ *	A threshold of 0 disables the source. Every trip is logged.
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <cmsis_os.h>
+#include <health.h>
+#include <storage.h>
+
+/**********************
+ *	CONFIGURATION
+ **********************/
+
+//default thresholds (ms), 0 disables the check
+#define HEALTH_CM4_COMMAND_TIMEOUT	(250)
+#define HEALTH_SENSORS_TIMEOUT		(200)
+#define HEALTH_SERVOS_TIMEOUT		(100)
+#define HEALTH_PROPULSION_TIMEOUT	(500)
+
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+#define HEALTH_MAX_SERVOS	(8)
+
+//error field of the status packet, hardware error flagged by the servo
+#define HEALTH_SERVO_ALERT	(0x80)
+
+
+/**********************
+ *	MACROS
+ **********************/
+
+
+/**********************
+ *	TYPEDEFS
+ **********************/
+
+typedef struct HEALTH_INST {
+	uint8_t armed;
+	uint8_t tripped;
+	uint32_t arm_time;
+	uint32_t last_seen[HEALTH_SOURCE_NUM];
+	uint32_t threshold[HEALTH_SOURCE_NUM];
+	uint32_t triggers[HEALTH_SOURCE_NUM];
+	SERVO_INST_t * servos[HEALTH_MAX_SERVOS];
+	uint8_t servo_count;
+}HEALTH_INST_t;
+
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static HEALTH_INST_t health = {
+		.threshold = {
+				HEALTH_CM4_COMMAND_TIMEOUT,
+				HEALTH_SENSORS_TIMEOUT,
+				HEALTH_SERVOS_TIMEOUT,
+				HEALTH_PROPULSION_TIMEOUT
+		}
+};
+
+
+/**********************
+ *	PROTOTYPES
+ **********************/
+
+static uint32_t health_servo_age(uint32_t time, uint8_t * alert);
+
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+/*
+ * servos is NULL when the servos are not used
+ */
+void health_init(SERVO_INST_t ** servos, uint8_t count) {
+	if(count > HEALTH_MAX_SERVOS) {
+		count = HEALTH_MAX_SERVOS;
+	}
+	for(uint8_t i = 0; i < count; i++) {
+		health.servos[i] = servos[i];
+	}
+	health.servo_count = servos != NULL ? count : 0;
+	health.armed = 0;
+}
+
+void health_feed(HEALTH_SOURCE_t source) {
+	if(source < HEALTH_SOURCE_NUM) {
+		health.last_seen[source] = xTaskGetTickCount();
+	}
+}
+
+/*
+ * Every source gets a full threshold from now
+ */
+void health_arm(void) {
+	uint32_t time = xTaskGetTickCount();
+	health.arm_time = time;
+	for(uint8_t i = 0; i < HEALTH_SOURCE_NUM; i++) {
+		health.last_seen[i] = time;
+	}
+	health.tripped = 0;
+	health.armed = 1;
+}
+
+void health_disarm(void) {
+	health.armed = 0;
+}
+
+//oldest telemetry of the servos
+static uint32_t health_servo_age(uint32_t time, uint8_t * alert) {
+	uint32_t age = 0;
+	*alert = 0;
+	for(uint8_t i = 0; i < health.servo_count; i++) {
+		SERVO_TELEMETRY_t telemetry = servo_get_telemetry(health.servos[i]);
+		uint32_t last = telemetry.time;
+		if(time - health.arm_time < time - last) {
+			last = health.arm_time;
+		}
+		if(time - last > age) {
+			age = time - last;
+		}
+		if(telemetry.status & HEALTH_SERVO_ALERT) {
+			*alert = 1;
+		}
+	}
+	return age;
+}
+
+/*
+ * Called by the control thread at every cycle
+ * returns the mask of the sources tripped during this call
+ */
+uint8_t health_check(uint8_t state) {
+	if(!health.armed) {
+		return 0;
+	}
+	uint32_t time = xTaskGetTickCount();
+	uint8_t tripped = 0;
+	for(uint8_t i = 0; i < HEALTH_SOURCE_NUM; i++) {
+		uint32_t threshold = health.threshold[i];
+		if(!threshold || (health.tripped & (1<<i))) {
+			continue;
+		}
+		uint8_t alert = 0;
+		uint32_t age;
+		if(i == HEALTH_SERVOS) {
+			age = health_servo_age(time, &alert);
+		} else {
+			age = time - health.last_seen[i];
+		}
+		if(age > threshold || alert) {
+			STORAGE_HEALTH_t event;
+			event.source = i;
+			event.state = state;
+			event.age = age;
+			event.threshold = threshold;
+			storage_log(STORAGE_TYPE_HEALTH, &event);
+			health.triggers[i]++;
+			tripped |= 1<<i;
+		}
+	}
+	health.tripped |= tripped;
+	return tripped;
+}
+
+void health_set_threshold(HEALTH_SOURCE_t source, uint32_t threshold) {
+	if(source < HEALTH_SOURCE_NUM) {
+		health.threshold[source] = threshold;
+	}
+}
+
+uint32_t health_get_threshold(HEALTH_SOURCE_t source) {
+	return source < HEALTH_SOURCE_NUM ? health.threshold[source] : 0;
+}
+
+uint32_t health_get_triggers(HEALTH_SOURCE_t source) {
+	return source < HEALTH_SOURCE_NUM ? health.triggers[source] : 0;
+}
+
+
+/* END */
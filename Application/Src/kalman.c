@@ -0,0 +1,155 @@
+/*  Title		: Kalman
+ *  Filename	: kalman.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: on-board vertical state estimation
+ *
+ *	Two states kalman filter, altitude and vertical velocity, in 20.12 fixed
+ *	point. The vertical acceleration (acc_z, milli-g, 1000 at rest) drives
+ *	the prediction, the barometric altitude (m) is the measurement:
+ *		x = F x + [a dt^2/2, a dt]'		F = [1 dt; 0 1]
+ *		P = F P F' + Q
+ *		K = P H' / (H P H' + R)			H = [1 0]
+ *		x = x + K (alti - x1)
+ *		P = (I - K H) P
+ *	It is a fallback for the estimate of the CM4, used while it is missing.
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <kalman.h>
+
+/**********************
+ *	CONFIGURATION
+ **********************/
+
+//process noise per second, (m)^2 and (m/s)^2
+#define KALMAN_Q_ALT	((int32_t) util_double_2_fix(0.05))
+#define KALMAN_Q_VEL	((int32_t) util_double_2_fix(2.0))
+
+//barometric altitude variance (m)^2
+#define KALMAN_R_ALT	((int32_t) util_double_2_fix(1.0))
+
+//initial velocity variance (m/s)^2
+#define KALMAN_P0_VEL	((int32_t) util_double_2_fix(1.0))
+
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+#define KALMAN_G		((int32_t) util_double_2_fix(9.80665))
+
+#define KALMAN_ONE_G	(1000) /* milli-g */
+
+//longer gaps are not predicted over
+#define KALMAN_MAX_DT	(100) /* ms */
+
+
+/**********************
+ *	MACROS
+ **********************/
+
+
+/**********************
+ *	TYPEDEFS
+ **********************/
+
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+
+/**********************
+ *	PROTOTYPES
+ **********************/
+
+static void kalman_predict(KALMAN_INST_t * kalman, int32_t acc, int32_t dt);
+static void kalman_correct(KALMAN_INST_t * kalman, int32_t alti);
+
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+void kalman_init(KALMAN_INST_t * kalman) {
+	kalman->initialized = 0;
+}
+
+/*
+ * dt and acc in 20.12 (s, m/s^2)
+ */
+static void kalman_predict(KALMAN_INST_t * kalman, int32_t acc, int32_t dt) {
+	UTIL_MAT22_t F = {util_int_2_fix(1), dt, 0, util_int_2_fix(1)};
+	UTIL_MAT22_t Q = {util_fix_mul(KALMAN_Q_ALT, dt), 0, 0, util_fix_mul(KALMAN_Q_VEL, dt)};
+	UTIL_MAT21_t u;
+
+	//velocity increment, then its effect on the altitude
+	u.x21 = util_fix_mul(acc, dt);
+	u.x11 = util_fix_mul(u.x21, dt) / 2;
+
+	kalman->x = util_fix_mat21_add_mat21(util_fix_mat22_mul_mat21(F, kalman->x), u);
+	kalman->P = util_fix_mat22_add_mat22(
+			util_fix_mat22_mul_mat22(util_fix_mat22_mul_mat22(F, kalman->P), util_fix_mat22_transpose(F)),
+			Q);
+}
+
+static void kalman_correct(KALMAN_INST_t * kalman, int32_t alti) {
+	UTIL_MAT12_t H = {util_int_2_fix(1), 0};
+	UTIL_MAT21_t K;
+
+	int32_t S = util_fix_qadd(kalman->P.x11, KALMAN_R_ALT);
+	K.x11 = util_fix_qdiv(kalman->P.x11, S, UTIL_DECIMAL);
+	K.x21 = util_fix_qdiv(kalman->P.x21, S, UTIL_DECIMAL);
+
+	int32_t innovation = util_fix_qsub(alti, util_fix_mat12_mul_mat21(H, kalman->x));
+	kalman->x = util_fix_mat21_add_mat21(kalman->x, util_fix_fix_mul_mat21(innovation, K));
+
+	//P = P - K H P
+	kalman->P = util_fix_mat22_sub_mat22(kalman->P,
+			util_fix_mat22_mul_mat22(util_fix_mat21_mul_mat12(K, H), kalman->P));
+}
+
+/*
+ * acc_z in milli-g, alti in m, time in ms
+ */
+void kalman_update(KALMAN_INST_t * kalman, int32_t acc_z, int32_t alti, uint32_t time) {
+	int32_t z = util_int_2_fix(alti);
+	if(!kalman->initialized) {
+		kalman->x.x11 = z;
+		kalman->x.x21 = 0;
+		kalman->P.x11 = KALMAN_R_ALT;
+		kalman->P.x12 = 0;
+		kalman->P.x21 = 0;
+		kalman->P.x22 = KALMAN_P0_VEL;
+		kalman->last_time = time;
+		kalman->initialized = 1;
+		return;
+	}
+	uint32_t dt_ms = time - kalman->last_time;
+	kalman->last_time = time;
+	if(dt_ms > KALMAN_MAX_DT) {
+		dt_ms = KALMAN_MAX_DT;
+	}
+	int32_t dt = (util_int_2_fix(dt_ms) + 500) / 1000;
+	int32_t acc = (int32_t)((int64_t)(acc_z - KALMAN_ONE_G) * KALMAN_G / KALMAN_ONE_G);
+
+	kalman_predict(kalman, acc, dt);
+	kalman_correct(kalman, z);
+}
+
+//m, as DATA_ID_KALMAN_Z
+int32_t kalman_get_altitude(KALMAN_INST_t * kalman) {
+	return util_fix_2_int(kalman->x.x11 + (1 << (UTIL_DECIMAL-1)));
+}
+
+//mm/s, as DATA_ID_KALMAN_VZ
+int32_t kalman_get_velocity(KALMAN_INST_t * kalman) {
+	return (int32_t)(((int64_t) kalman->x.x21 * 1000) >> UTIL_DECIMAL);
+}
+
+
+/* END */
@@ -23,12 +23,24 @@
 
 #include <storage.h>
 
+#include <vane.h>
+
+#include <kalman.h>
+#include <health.h>
+
 
 /**********************
  *	CONSTANTS
  **********************/
 
-#define PIPELINE_HEART_BEAT	1
+//longest wait without a received frame
+#define PIPELINE_HEART_BEAT	10
+
+//the on-board estimate goes on CAN when the cm4 one is older
+#define PIPELINE_CM4_ESTIMATE_TIMEOUT	pdMS_TO_TICKS(200)
+
+//frames posted by the control thread and the cm4 estimate
+#define PIPELINE_TX_QUEUE_DEPTH	(16)
 
 
 /**********************
@@ -98,6 +110,12 @@ typedef struct PIPELINE_FEEDBACK_DATA {
 	int32_t dyn4;
 }PIPELINE_FEEDBACK_DATA_t;
 
+typedef struct PIPELINE_TX {
+	uint32_t data;
+	uint32_t time;
+	uint8_t id;
+}PIPELINE_TX_t;
+
 typedef struct PIPELINE_INST {
 	CAN_msg msg;
 	PIPELINE_CONTROL_FLAGS_t control_flags;
@@ -107,6 +125,8 @@ typedef struct PIPELINE_INST {
 	PIPELINE_FEEDBACK_FLAGS_t feedback_flags;
 	CM4_PAYLOAD_FEEDBACK_t feedback_data;
 	CM4_INST_t * cm4;
+	KALMAN_INST_t kalman;
+	TickType_t cm4_estimate_time; //only used by the pipeline thread
 }PIPELINE_INST_t;
 
 
@@ -116,12 +136,19 @@ typedef struct PIPELINE_INST {
 
 static PIPELINE_INST_t pipeline = {0};
 
+static TaskHandle_t pipeline_task = NULL;
+
+static QueueHandle_t pipeline_tx_queue = NULL;
+static StaticQueue_t pipeline_tx_queue_buffer;
+static uint8_t pipeline_tx_queue_storage[PIPELINE_TX_QUEUE_DEPTH*sizeof(PIPELINE_TX_t)];
+
 
 
 /**********************
  *	PROTOTYPES
  **********************/
 
+static void pipeline_post(uint32_t data, uint8_t id, uint32_t time);
 
 /**********************
  *	DECLARATIONS
@@ -129,27 +156,44 @@ static PIPELINE_INST_t pipeline = {0};
 
 
 void pipeline_init(CM4_INST_t * cm4) {
+	pipeline_tx_queue = xQueueCreateStatic(PIPELINE_TX_QUEUE_DEPTH, sizeof(PIPELINE_TX_t), pipeline_tx_queue_storage, &pipeline_tx_queue_buffer);
 	pipeline.cm4 = cm4;
 	pipeline.control_data.thrust = 2000;
+	kalman_init(&pipeline.kalman);
 }
 
 void pipeline_thread(void * arg) {
 
-	static TickType_t last_wake_time;
 	static const TickType_t period = pdMS_TO_TICKS(PIPELINE_HEART_BEAT);
 
-	last_wake_time = xTaskGetTickCount();
-
 	while(pipeline.cm4 == NULL) {
 		osDelay(1);
 	}
 
+	//released by the can frames and the frames of the control thread
+	pipeline_task = xTaskGetCurrentTaskHandle();
+	can_set_rx_task(pipeline_task);
+
 	for(;;) {
 
+		//Send the frames of the other threads, can_setFrame may wait for a mailbox
+		PIPELINE_TX_t tx;
+		while(xQueueReceive(pipeline_tx_queue, &tx, 0) == pdTRUE) {
+			can_setFrame(tx.data, tx.id, tx.time);
+			if(tx.id == DATA_ID_KALMAN_Z) {
+				pipeline.cm4_estimate_time = xTaskGetTickCount();
+			}
+		}
+
 		//Receive all can messages
 		while(can_msgPending()) {
 			pipeline.msg = can_readBuffer();
+			storage_log(STORAGE_TYPE_CAN, &pipeline.msg);
 
+			//any frame of the propulsion board is a heartbeat
+			if(pipeline.msg.id_CAN == CAN_ID_PROPULSION_BOARD) {
+				health_feed(HEALTH_PROPULSION);
+			}
 
 			if(pipeline.msg.id == DATA_ID_ALTITUDE){
 				pipeline.sensors_data.alti = (int32_t) pipeline.msg.data;
@@ -197,25 +241,40 @@ void pipeline_thread(void * arg) {
 
 			if(pipeline.sensors_flags == PIPELINE_SENSORS_ALL) {
 				pipeline.sensors_flags = 0;
-				cm4_send_sensors(pipeline.cm4, &pipeline.sensors_data);
+				cm4_post_sensors(&pipeline.sensors_data);
 				control_set_sens(pipeline.sensors_data);
+				health_feed(HEALTH_SENSORS);
+				storage_log(STORAGE_TYPE_SENSOR, &pipeline.sensors_data);
 				storage_notify();
+
+				TickType_t now = xTaskGetTickCount();
+				kalman_update(&pipeline.kalman, pipeline.sensors_data.acc_z, pipeline.sensors_data.alti, now);
+				if(now - pipeline.cm4_estimate_time > PIPELINE_CM4_ESTIMATE_TIMEOUT) {
+					can_setFrame((uint32_t) kalman_get_altitude(&pipeline.kalman), DATA_ID_KALMAN_Z, now);
+					can_setFrame((uint32_t) kalman_get_velocity(&pipeline.kalman), DATA_ID_KALMAN_VZ, now);
+				}
 			}
 
 			if(pipeline.feedback_flags == PIPELINE_FEEDBACK_ALL) {
 				pipeline.feedback_flags = 0;
-				cm4_send_feedback(pipeline.cm4, &pipeline.feedback_data);
+				//measured vane positions from the servo bus, when the vanes are controlled
+				vane_get_positions(pipeline.feedback_data.dynamixel);
+				cm4_post_feedback(&pipeline.feedback_data);
 				control_set_fdb(pipeline.feedback_data);
+				storage_log(STORAGE_TYPE_FEEDBACK, &pipeline.feedback_data);
 			}
 		}
-		vTaskDelayUntil( &last_wake_time, period );
+		ulTaskNotifyTake(pdTRUE, period);
 	}
 }
 
 
 
+/*
+ * the thrust is sent by the control thread, see pipeline_send_thrust
+ * called from the serial thread, the frames go through the pipeline thread
+ */
 void pipeline_send_control(CM4_PAYLOAD_COMMAND_t * cmd) {
-	can_setFrame((uint32_t) cmd->thrust, DATA_ID_THRUST_CMD, cmd->timestamp);
 	/*
 	can_setFrame((uint32_t) cmd->dynamixel[0], DATA_ID_VANE_CMD_1, cmd->timestamp);
 	can_setFrame((uint32_t) cmd->dynamixel[1], DATA_ID_VANE_CMD_2, cmd->timestamp);
@@ -228,14 +287,33 @@ void pipeline_send_control(CM4_PAYLOAD_COMMAND_t * cmd) {
 	can_setFrame((uint32_t) cmd->position[1], DATA_ID_KALMAN_Y, cmd->timestamp);
 	can_setFrame((uint32_t) cmd->speed[1], DATA_ID_KALMAN_VY, cmd->timestamp);
 	*/
-	can_setFrame((uint32_t) cmd->position[2], DATA_ID_KALMAN_Z, cmd->timestamp);
-	can_setFrame((uint32_t) cmd->speed[2], DATA_ID_KALMAN_VZ, cmd->timestamp);
+	pipeline_post((uint32_t) cmd->position[2], DATA_ID_KALMAN_Z, cmd->timestamp);
+	pipeline_post((uint32_t) cmd->speed[2], DATA_ID_KALMAN_VZ, cmd->timestamp);
+}
 
+
+/*
+ * Never blocks, the frame is dropped if the queue is full
+ */
+static void pipeline_post(uint32_t data, uint8_t id, uint32_t time) {
+	PIPELINE_TX_t tx;
+	if(pipeline_tx_queue == NULL) {
+		return;
+	}
+	tx.data = data;
+	tx.id = id;
+	tx.time = time;
+	if(xQueueSend(pipeline_tx_queue, &tx, 0) == pdTRUE && pipeline_task != NULL) {
+		xTaskNotifyGive(pipeline_task);
+	}
 }
 
+void pipeline_send_thrust(int32_t thrust, uint32_t time) {
+	pipeline_post((uint32_t) thrust, DATA_ID_THRUST_CMD, time);
+}
 
 void pipeline_send_heartbeat(CONTROL_STATE_t state, uint8_t gnc_state, uint32_t time) {
-	can_setFrame((state&0xFF) | ((gnc_state&0xFF)<<8) , DATA_ID_TVC_HEARTBEAT, time);
+	pipeline_post((state&0xFF) | ((gnc_state&0xFF)<<8) , DATA_ID_TVC_HEARTBEAT, time);
 }
 
 
@@ -18,6 +18,10 @@
  *	CONSTANTS
  **********************/
 
+#define SERIAL_TX_DRAIN_TIMEOUT	(50)
+#define SERIAL_TX_TIMEOUT	(100)
+#define SERIAL_FALLBACK_POLL	pdMS_TO_TICKS(100)
+
 
 /**********************
  *	MACROS
@@ -42,6 +46,14 @@ static uint16_t serial_devices_count = 0;
 
 
 
+//rates both msv2 peers can agree on, the fastest first
+static const uint32_t serial_baudrates[] = {
+		921600,
+		460800,
+		230400,
+		SERIAL_DEFAULT_BAUDRATE
+};
+
 static SemaphoreHandle_t serial_rx_sem = NULL;
 static StaticSemaphore_t serial_rx_sem_buffer;
 
@@ -73,6 +85,20 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
 	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 }
 
+/*
+ * UART TX ISR
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	for(uint16_t i = 0; i < serial_devices_count; i++) {
+		if(serial_devices[i]->uart == huart) {
+			xSemaphoreGiveFromISR( serial_devices[i]->tx_sem, &xHigherPriorityTaskWoken );
+			break;
+		}
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
 	UART_HandleTypeDef * lol = huart;
 }
@@ -90,6 +116,10 @@ void serial_init(SERIAL_INST_t * ser, UART_HandleTypeDef * uart, void * inst, SE
 	ser->inst = inst;
 	ser->decode_fcn = decode_fcn;
 	util_buffer_u8_init(&ser->bfr, ser->buffer, SERIAL_FIFO_LEN);
+	ser->tx_sem = xSemaphoreCreateBinaryStatic(&ser->tx_sem_buffer);
+	xSemaphoreGive(ser->tx_sem);
+	ser->baudrate_fallback = 0;
+	ser->baudrate_request = 0;
 	if(serial_devices_count < SERIAL_MAX_INST) {
 		HAL_UART_Receive_DMA(uart, &ser->dma_buffer, 1);
 		serial_devices[serial_devices_count] = ser;
@@ -97,27 +127,141 @@ void serial_init(SERIAL_INST_t * ser, UART_HandleTypeDef * uart, void * inst, SE
 	serial_devices_count++;
 }
 
-void serial_send(SERIAL_INST_t * ser, uint8_t * data, uint16_t length) {
-	HAL_UART_Transmit_DMA(ser->uart, data, length);
-	//HAL_UART_Transmit(ser->uart, data, length, 500);
+/*
+ * Single transfer, waits for the transfer in progress (stream frames) to complete
+ * the data must not be the buffer of a transfer that may still be running,
+ * use serial_tx_wait before building it in that case
+ * returns 0 if the uart stayed busy
+ */
+uint8_t serial_send(SERIAL_INST_t * ser, uint8_t * data, uint16_t length) {
+	if(!serial_tx_wait(ser, SERIAL_TX_TIMEOUT)) {
+		return 0;
+	}
+	return serial_tx_start(ser, data, length, SERIAL_TX_TIMEOUT);
+}
+
+/*
+ * Streams of frames: wait for the previous transfer to complete before
+ * reusing its buffer, then start the next one with serial_tx_start
+ * returns 0 if the transfer did not complete within timeout ms
+ */
+uint8_t serial_tx_wait(SERIAL_INST_t * ser, uint32_t timeout) {
+	return xSemaphoreTake(ser->tx_sem, pdMS_TO_TICKS(timeout)) == pdTRUE;
+}
+
+/*
+ * Start a transfer after serial_tx_wait, the data must stay valid until the next wait
+ * returns 0 if the uart stayed busy for timeout ms
+ */
+uint8_t serial_tx_start(SERIAL_INST_t * ser, uint8_t * data, uint16_t length, uint32_t timeout) {
+	while(HAL_UART_Transmit_DMA(ser->uart, data, length) == HAL_BUSY) {
+		if(!timeout--) {
+			xSemaphoreGive(ser->tx_sem);
+			return 0;
+		}
+		osDelay(1);
+	}
+	return 1;
+}
+
+uint8_t serial_baudrate_valid(uint32_t baudrate) {
+	for(uint8_t i = 0; i < sizeof(serial_baudrates)/sizeof(uint32_t); i++) {
+		if(serial_baudrates[i] == baudrate) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint32_t serial_get_baudrate(SERIAL_INST_t * ser) {
+	return ser->uart->Init.BaudRate;
+}
+
+/*
+ * Switch the uart to a new baudrate once the frame being sent is out
+ * (the answer to the negotiation still goes at the old rate).
+ * With a confirm timeout (ms) the previous baudrate is restored unless
+ * serial_baudrate_confirm is called in time, 0 makes the change final.
+ */
+void serial_set_baudrate(SERIAL_INST_t * ser, uint32_t baudrate, uint32_t confirm_timeout) {
+	uint32_t timeout = SERIAL_TX_DRAIN_TIMEOUT;
+	while(ser->uart->gState == HAL_UART_STATE_BUSY_TX && timeout--) {
+		osDelay(1);
+	}
+	uint32_t previous = ser->uart->Init.BaudRate;
+	HAL_UART_Abort(ser->uart);
+	ser->uart->Init.BaudRate = baudrate;
+	if(ser->uart->Instance->CR3 & USART_CR3_HDSEL) {
+		HAL_HalfDuplex_Init(ser->uart);
+	} else {
+		HAL_UART_Init(ser->uart);
+	}
+	HAL_UART_Receive_DMA(ser->uart, &ser->dma_buffer, 1);
+	//the aborted transfer will not complete
+	xSemaphoreGive(ser->tx_sem);
+	if(confirm_timeout && baudrate != previous) {
+		ser->baudrate_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(confirm_timeout);
+		ser->baudrate_fallback = previous;
+		//wake up the serial thread to watch the deadline
+		xSemaphoreGive(serial_rx_sem);
+	} else {
+		ser->baudrate_fallback = 0;
+	}
+}
+
+void serial_baudrate_confirm(SERIAL_INST_t * ser) {
+	ser->baudrate_fallback = 0;
 }
 
 void serial_garbage_clean(SERIAL_INST_t * ser) {
 	HAL_UART_Receive_DMA(ser->uart, &ser->dma_buffer, 1);
 }
 
+/*
+ * Change the baudrate from another thread than the serial thread
+ * the serial thread owns the reception, it applies the change (a request for
+ * the current baudrate only restarts the reception). The uart is held until
+ * then, so the next transfer already goes at the new rate.
+ */
+void serial_request_baudrate(SERIAL_INST_t * ser, uint32_t baudrate) {
+	serial_tx_wait(ser, SERIAL_TX_TIMEOUT);
+	ser->baudrate_request = baudrate;
+	xSemaphoreGive(serial_rx_sem);
+}
+
 void serial_thread(void * arg) {
 
 	serial_global_init();
 
 	for(;;) {
-		if( xSemaphoreTake(serial_rx_sem, 0xffff) == pdTRUE ) {
+		uint8_t fallback_pending = 0;
+		for(uint16_t i = 0; i < serial_devices_count; i++) {
+			fallback_pending |= serial_devices[i]->baudrate_fallback != 0;
+		}
+		if( xSemaphoreTake(serial_rx_sem, fallback_pending?SERIAL_FALLBACK_POLL:0xffff) == pdTRUE ) {
 			for(uint16_t i = 0; i < serial_devices_count; i++) {
 				while(!util_buffer_u8_isempty(&serial_devices[i]->bfr)) {
 					serial_devices[i]->decode_fcn(serial_devices[i]->inst, util_buffer_u8_get(&serial_devices[i]->bfr));
 				}
 			}
 		}
+		for(uint16_t i = 0; i < serial_devices_count; i++) {
+			SERIAL_INST_t * ser = serial_devices[i];
+			uint32_t baudrate = ser->baudrate_request;
+			if(baudrate) {
+				ser->baudrate_request = 0;
+				if(baudrate == serial_get_baudrate(ser)) {
+					serial_garbage_clean(ser);
+					xSemaphoreGive(ser->tx_sem);
+				} else {
+					serial_set_baudrate(ser, baudrate, 0);
+				}
+			}
+			//new baudrates that were never confirmed by the peer
+			if(ser->baudrate_fallback && (int32_t)(xTaskGetTickCount() - ser->baudrate_deadline) >= 0) {
+				serial_set_baudrate(ser, ser->baudrate_fallback, 0);
+			}
+		}
 	}
 }
 
@@ -10,6 +10,7 @@
  *	INCLUDES
  **********************/
 
+#include <main.h>
 #include <servo.h>
 #include <cmsis_os.h>
 #include <servo_def.h>
@@ -18,6 +19,15 @@
  *	CONFIGURATION
  **********************/
 
+#define SERVO_BUS_PERIOD	10 /* ms */
+
+//register writes requested by the other threads executed per bus cycle
+#define SERVO_REQUESTS_PER_CYCLE	(4)
+
+//link set up by servo_link_bringup
+#define SERVO_LINK_BAUDRATE		(1000000)
+#define SERVO_LINK_RETURN_DELAY	(0)	//units of 2us, factory default is 250
+
 
 /**********************
  *	CONSTANTS
@@ -40,6 +50,21 @@
 
 #define DATA_SIZE 4
 
+#define SERVO_TX_TIMEOUT 10
+
+#define REQUEST_QUEUE_DEPTH	(8)
+
+//contiguous telemetry read by servo_sync_all, from SERVO_PRESENT_POSITION to SERVO_PRESENT_TEMPERATURE
+#define SYNC_AREA_START		SERVO_PRESENT_POSITION
+#define SYNC_AREA_LEN		(SERVO_PRESENT_TEMPERATURE + 1 - SERVO_PRESENT_POSITION)
+
+//telemetry mapped by servo_config at SERVO_INDIRECT_DATA_1
+#define INDIRECT_ERROR		0
+#define INDIRECT_POSITION	1
+#define INDIRECT_VOLTAGE	5
+#define INDIRECT_TEMPERATURE	7
+#define INDIRECT_LEN		8
+
 /**********************
  *	MACROS
  **********************/
@@ -49,6 +74,18 @@
  *	TYPEDEFS
  **********************/
 
+typedef struct SERVO_LINK_BAUD {
+	uint32_t baudrate;
+	uint8_t code;	//value of SERVO_BAUD_RATE
+}SERVO_LINK_BAUD_t;
+
+typedef struct SERVO_REQUEST {
+	SERVO_INST_t * servo;
+	uint16_t address;
+	uint16_t length;
+	uint8_t data[SERVO_REQUEST_MAX];
+}SERVO_REQUEST_t;
+
 
 /**********************
  *	VARIABLES
@@ -63,13 +100,52 @@ static DSV2_INST_t servo_dsv2;
 static SemaphoreHandle_t servo_busy_sem = NULL;
 static StaticSemaphore_t servo_busy_sem_buffer;
 
+static SemaphoreHandle_t servo_bus_start_sem = NULL;
+static StaticSemaphore_t servo_bus_start_sem_buffer;
+
+static SERVO_RTT_t servo_rtt;
+static uint32_t servo_tx_cycles;
+
+static QueueHandle_t servo_request_queue = NULL;
+static StaticQueue_t servo_request_queue_buffer;
+static uint8_t servo_request_queue_storage[REQUEST_QUEUE_DEPTH*sizeof(SERVO_REQUEST_t)];
 
 
 
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+//one indirect address per byte, in the order of the INDIRECT_ offsets
+static const uint16_t servo_indirect_map[INDIRECT_LEN] = {
+		SERVO_HARDWARE_ERROR_STATUS,
+		SERVO_PRESENT_POSITION,
+		SERVO_PRESENT_POSITION+1,
+		SERVO_PRESENT_POSITION+2,
+		SERVO_PRESENT_POSITION+3,
+		SERVO_PRESENT_INPUT_VOLTAGE,
+		SERVO_PRESENT_INPUT_VOLTAGE+1,
+		SERVO_PRESENT_TEMPERATURE
+};
+
+//searched in this order by servo_link_bringup: target, factory default, uart default
+static const SERVO_LINK_BAUD_t servo_link_bauds[] = {
+		{SERVO_LINK_BAUDRATE, 3},
+		{57600, 1},
+		{115200, 2},
+		{2000000, 4},
+		{9600, 0}
+};
+
 /**********************
  *	PROTOTYPES
  **********************/
 
+static void servo_send(uint16_t length);
+static SERVO_ERROR_t servo_wait_status(SERVO_INST_t * servo, uint8_t * data, uint16_t length, uint8_t * err);
+static void servo_rtt_record(SERVO_ERROR_t error);
+static SERVO_ERROR_t servo_ping_wait(SERVO_INST_t * servo);
 
 
 /**********************
@@ -82,6 +158,11 @@ void servo_init(SERVO_INST_t * servo, uint8_t dev_id) {
 	servo->id = id_counter++;
 
 	servo->dev_id = dev_id;
+	servo->torque = 0;
+	servo->indirect = 0;
+	servo->comm = SERVO_SUCCESS;
+	servo->time = 0;
+	servo->target_pending = 0;
 	servo_list[servo_count++] = servo;
 
 	servo->rx_sem = xSemaphoreCreateBinaryStatic(&servo->rx_sem_buffer);
@@ -91,17 +172,35 @@ void servo_global_init(void) {
 	dsv2_init(&servo_dsv2);
 	serial_init(&servo_serial, &DYNAMIXEL_UART, &servo_dsv2, servo_decode_fcn);
 	servo_busy_sem = xSemaphoreCreateMutexStatic(&servo_busy_sem_buffer);
+	servo_bus_start_sem = xSemaphoreCreateBinaryStatic(&servo_bus_start_sem_buffer);
+	servo_request_queue = xQueueCreateStatic(REQUEST_QUEUE_DEPTH, sizeof(SERVO_REQUEST_t), servo_request_queue_storage, &servo_request_queue_buffer);
+	//cycle counter for the round trip times
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	servo_rtt_reset();
 }
 
 SERIAL_RET_t servo_decode_fcn(void * inst, uint8_t data) {
 	DSV2_INST_t * dsv2 = (DSV2_INST_t * ) inst;
 	DSV2_ERROR_t tmp = dsv2_decode_fragment(dsv2, data);
-	//this should release the semaphore corresponding the the right epos board if bridged
-	if(tmp == DSV2_SUCCESS || tmp == DSV2_WRONG_CRC) {
+	//a frame with a wrong crc is dropped, the transaction then times out
+	//and the telemetry of the servo is not updated
+	if(tmp == DSV2_SUCCESS) {
 		if(dsv2->rx.inst == 0x55) { // ONLY HANDLE STATUS PACKETS
 			for(uint8_t i = 0; i < servo_count; i++) {
 				if(servo_list[i]->dev_id == dsv2->rx.dev_id) {
-					xSemaphoreGive(servo_list[i]->rx_sem);
+					//copied before the next status packet overwrites the decoder buffer
+					SERVO_INST_t * servo = servo_list[i];
+					uint16_t length = dsv2->rx.data_len - 4; //inst, err and crc
+					if(length > SERVO_RX_MAX) {
+						length = SERVO_RX_MAX;
+					}
+					servo->rx_err = dsv2->rx.data[0];
+					servo->rx_len = length;
+					for(uint16_t j = 0; j < length; j++) {
+						servo->rx_data[j] = dsv2->rx.data[j+1];
+					}
+					xSemaphoreGive(servo->rx_sem);
 					break;
 				}
 			}
@@ -112,6 +211,68 @@ SERIAL_RET_t servo_decode_fcn(void * inst, uint8_t data) {
 
 
 
+/*
+ * transfers are serialized, a frame without answer may still be on the line
+ */
+static void servo_send(uint16_t length) {
+	serial_tx_wait(&servo_serial, SERVO_TX_TIMEOUT);
+	servo_tx_cycles = DWT->CYCCNT;
+	serial_tx_start(&servo_serial, dsv2_tx_data(&servo_dsv2), length, SERVO_TX_TIMEOUT);
+}
+
+/*
+ * time from the start of the request to the last answer of a transaction
+ */
+static void servo_rtt_record(SERVO_ERROR_t error) {
+	uint32_t us = (DWT->CYCCNT - servo_tx_cycles) / (SystemCoreClock / 1000000);
+	taskENTER_CRITICAL();
+	if(error & SERVO_TIMEOUT) {
+		servo_rtt.timeouts++;
+	} else {
+		uint32_t bin = us / SERVO_RTT_BIN_US;
+		servo_rtt.bins[bin < SERVO_RTT_BINS ? bin : SERVO_RTT_BINS-1]++;
+		if(us > servo_rtt.max_us) {
+			servo_rtt.max_us = us;
+		}
+	}
+	taskEXIT_CRITICAL();
+}
+
+void servo_rtt_reset(void) {
+	taskENTER_CRITICAL();
+	for(uint8_t i = 0; i < SERVO_RTT_BINS; i++) {
+		servo_rtt.bins[i] = 0;
+	}
+	servo_rtt.timeouts = 0;
+	servo_rtt.max_us = 0;
+	taskEXIT_CRITICAL();
+}
+
+void servo_get_rtt(SERVO_RTT_t * rtt) {
+	taskENTER_CRITICAL();
+	*rtt = servo_rtt;
+	taskEXIT_CRITICAL();
+	rtt->baudrate = serial_get_baudrate(&servo_serial);
+}
+
+/*
+ * status packet of one servo, data can be NULL
+ */
+static SERVO_ERROR_t servo_wait_status(SERVO_INST_t * servo, uint8_t * data, uint16_t length, uint8_t * err) {
+	if(xSemaphoreTake(servo->rx_sem, COMM_TIMEOUT) != pdTRUE) {
+		servo->comm = SERVO_TIMEOUT;
+		return SERVO_TIMEOUT;
+	}
+	if(err != NULL) {
+		*err = servo->rx_err;
+	}
+	for(uint16_t i = 0; i < length && i < servo->rx_len; i++){
+		data[i] = servo->rx_data[i];
+	}
+	servo->comm = servo->rx_err ? SERVO_REMOTE_ERROR : SERVO_SUCCESS;
+	return servo->comm;
+}
+
 /*
  * address of the object
  * length to read
@@ -124,27 +285,13 @@ SERVO_ERROR_t servo_read(SERVO_INST_t * servo, uint16_t address, uint16_t length
 		send_data[1] = address>>8;
 		send_data[2] = length & 0xff;
 		send_data[3] = length>>8;
+		xSemaphoreTake(servo->rx_sem, 0); //drop a late answer
 		uint16_t len = dsv2_create_frame(&servo_dsv2, servo->dev_id, MAX_READ_LEN, READ_INST, send_data);
-		serial_send(&servo_serial, dsv2_tx_data(&servo_dsv2), len);
-		if(xSemaphoreTake(servo->rx_sem, COMM_TIMEOUT) == pdTRUE) {
-			uint8_t * recieved_data = dsv2_rx_data(&servo_dsv2);
-			if(err != NULL) {
-				*err = recieved_data[0];
-			}
-			for(uint8_t i = 0; i < length; i++){
-				data[i] = recieved_data[i+1];
-			}
-			if(*err == 0) {
-				xSemaphoreGive(servo_busy_sem);
-				return SERVO_SUCCESS;
-			} else {
-				xSemaphoreGive(servo_busy_sem);
-				return SERVO_REMOTE_ERROR;
-			}
-		} else {
-			xSemaphoreGive(servo_busy_sem);
-			return SERVO_TIMEOUT;
-		}
+		servo_send(len);
+		SERVO_ERROR_t error = servo_wait_status(servo, data, length, err);
+		servo_rtt_record(error);
+		xSemaphoreGive(servo_busy_sem);
+		return error;
 	} else {
 		return SERVO_BUSY;
 	}
@@ -163,24 +310,13 @@ SERVO_ERROR_t servo_write(SERVO_INST_t * servo, uint16_t address, uint16_t lengt
 		for(uint16_t i = 0; i < length; i++) {
 			send_data[2 + i] = data[i];
 		}
+		xSemaphoreTake(servo->rx_sem, 0);
 		uint16_t len = dsv2_create_frame(&servo_dsv2, servo->dev_id, length+2, WRITE_INST, send_data);
-		serial_send(&servo_serial, dsv2_tx_data(&servo_dsv2), len);
-		if(xSemaphoreTake(servo->rx_sem, COMM_TIMEOUT) == pdTRUE) {
-			uint8_t * recieved_data = dsv2_rx_data(&servo_dsv2);
-			if(err != NULL) {
-				*err = recieved_data[0];
-			}
-			if(*err == 0) {
-				xSemaphoreGive(servo_busy_sem);
-				return SERVO_SUCCESS;
-			} else {
-				xSemaphoreGive(servo_busy_sem);
-				return SERVO_REMOTE_ERROR;
-			}
-		} else {
-			xSemaphoreGive(servo_busy_sem);
-			return SERVO_TIMEOUT;
-		}
+		servo_send(len);
+		SERVO_ERROR_t error = servo_wait_status(servo, NULL, 0, err);
+		servo_rtt_record(error);
+		xSemaphoreGive(servo_busy_sem);
+		return error;
 	} else {
 		return SERVO_BUSY;
 	}
@@ -192,7 +328,130 @@ SERVO_ERROR_t servo_write(SERVO_INST_t * servo, uint16_t address, uint16_t lengt
 SERVO_ERROR_t servo_ping(uint8_t id) {
 	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
 		uint16_t len = dsv2_create_frame(&servo_dsv2, id, 0, PING_INST, NULL);
-		serial_send(&servo_serial, dsv2_tx_data(&servo_dsv2), len);
+		servo_send(len);
+		xSemaphoreGive(servo_busy_sem);
+		return SERVO_SUCCESS;
+	} else {
+		return SERVO_BUSY;
+	}
+}
+
+/*
+ * ping a registered servo and wait for its answer
+ */
+static SERVO_ERROR_t servo_ping_wait(SERVO_INST_t * servo) {
+	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
+		xSemaphoreTake(servo->rx_sem, 0);
+		uint16_t len = dsv2_create_frame(&servo_dsv2, servo->dev_id, 0, PING_INST, NULL);
+		servo_send(len);
+		SERVO_ERROR_t error = servo_wait_status(servo, NULL, 0, NULL);
+		servo_rtt_record(error);
+		xSemaphoreGive(servo_busy_sem);
+		return error;
+	} else {
+		return SERVO_BUSY;
+	}
+}
+
+/*
+ * Same area of several servos in one transaction
+ * data receives length bytes per servo, err one byte per servo (can be NULL)
+ */
+SERVO_ERROR_t servo_sync_read(SERVO_INST_t ** servos, uint8_t count, uint16_t address, uint16_t length, uint8_t * data, uint8_t * err) {
+	if(count > SERVO_MAX_INST || length > SERVO_RX_MAX) {
+		return SERVO_ERROR;
+	}
+	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
+		uint8_t dev_ids[SERVO_MAX_INST];
+		for(uint8_t i = 0; i < count; i++) {
+			dev_ids[i] = servos[i]->dev_id;
+			xSemaphoreTake(servos[i]->rx_sem, 0);
+		}
+		uint16_t len = dsv2_create_sync_read(&servo_dsv2, address, length, dev_ids, count);
+		servo_send(len);
+		SERVO_ERROR_t error = SERVO_SUCCESS;
+		//the servos answer in the order of the request
+		for(uint8_t i = 0; i < count; i++) {
+			error |= servo_wait_status(servos[i], data+i*length, length, err != NULL ? err+i : NULL);
+		}
+		servo_rtt_record(error);
+		xSemaphoreGive(servo_busy_sem);
+		return error;
+	} else {
+		return SERVO_BUSY;
+	}
+}
+
+/*
+ * Same area of several servos in one transaction, length bytes per servo in data
+ * not acknowledged by the servos
+ */
+SERVO_ERROR_t servo_sync_write(SERVO_INST_t ** servos, uint8_t count, uint16_t address, uint16_t length, uint8_t * data) {
+	if(count > SERVO_MAX_INST) {
+		return SERVO_ERROR;
+	}
+	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
+		uint8_t dev_ids[SERVO_MAX_INST];
+		for(uint8_t i = 0; i < count; i++) {
+			dev_ids[i] = servos[i]->dev_id;
+		}
+		uint16_t len = dsv2_create_sync_write(&servo_dsv2, address, length, dev_ids, data, count);
+		servo_send(len);
+		xSemaphoreGive(servo_busy_sem);
+		return SERVO_SUCCESS;
+	} else {
+		return SERVO_BUSY;
+	}
+}
+
+/*
+ * A different area for each servo in one transaction (one entry per servo)
+ */
+SERVO_ERROR_t servo_bulk_read(SERVO_BULK_t * bulk, uint8_t count) {
+	if(count > SERVO_MAX_INST) {
+		return SERVO_ERROR;
+	}
+	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
+		uint8_t dev_ids[SERVO_MAX_INST];
+		uint16_t addresses[SERVO_MAX_INST];
+		uint16_t lengths[SERVO_MAX_INST];
+		for(uint8_t i = 0; i < count; i++) {
+			dev_ids[i] = bulk[i].servo->dev_id;
+			addresses[i] = bulk[i].address;
+			lengths[i] = bulk[i].length;
+			xSemaphoreTake(bulk[i].servo->rx_sem, 0);
+		}
+		uint16_t len = dsv2_create_bulk_read(&servo_dsv2, dev_ids, addresses, lengths, count);
+		servo_send(len);
+		SERVO_ERROR_t error = SERVO_SUCCESS;
+		for(uint8_t i = 0; i < count; i++) {
+			error |= servo_wait_status(bulk[i].servo, bulk[i].data, bulk[i].length, &bulk[i].err);
+		}
+		servo_rtt_record(error);
+		xSemaphoreGive(servo_busy_sem);
+		return error;
+	} else {
+		return SERVO_BUSY;
+	}
+}
+
+SERVO_ERROR_t servo_bulk_write(SERVO_BULK_t * bulk, uint8_t count) {
+	if(count > SERVO_MAX_INST) {
+		return SERVO_ERROR;
+	}
+	if (xSemaphoreTake(servo_busy_sem, DRIV_TIMEOUT) == pdTRUE) {
+		uint8_t dev_ids[SERVO_MAX_INST];
+		uint16_t addresses[SERVO_MAX_INST];
+		uint16_t lengths[SERVO_MAX_INST];
+		uint8_t * data[SERVO_MAX_INST];
+		for(uint8_t i = 0; i < count; i++) {
+			dev_ids[i] = bulk[i].servo->dev_id;
+			addresses[i] = bulk[i].address;
+			lengths[i] = bulk[i].length;
+			data[i] = bulk[i].data;
+		}
+		uint16_t len = dsv2_create_bulk_write(&servo_dsv2, dev_ids, addresses, lengths, data, count);
+		servo_send(len);
 		xSemaphoreGive(servo_busy_sem);
 		return SERVO_SUCCESS;
 	} else {
@@ -284,17 +543,68 @@ SERVO_ERROR_t servo_read_i32(SERVO_INST_t * servo, uint16_t address, int32_t * d
 //HIGH LEVEL FUNCTIONS
 
 SERVO_ERROR_t servo_sync(SERVO_INST_t * servo) {
-	uint8_t err;
-	SERVO_ERROR_t error = 0;
+	return servo_sync_all(&servo, 1);
+}
 
-	error |= servo_read_u8(servo, SERVO_HARDWARE_ERROR_STATUS, &servo->error, &err);
+/*
+ * Telemetry of several servos
+ * once servo_config has mapped it, all of it is read from the indirect
+ * data area in one transaction, otherwise the hardware error of all of them
+ * is read first, then position, voltage and temperature as one area
+ */
+SERVO_ERROR_t servo_sync_all(SERVO_INST_t ** servos, uint8_t count) {
+	static uint8_t errors[SERVO_MAX_INST];
+	static uint8_t status[SERVO_MAX_INST];
+	static uint8_t area[SERVO_MAX_INST*SYNC_AREA_LEN];
+	SERVO_ERROR_t error = 0;
+	uint8_t indirect = 1;
 
-	error |= servo_read_u16(servo, SERVO_PRESENT_INPUT_VOLTAGE, &servo->psu_voltage, &err);
+	for(uint8_t i = 0; i < count; i++) {
+		indirect &= servos[i]->indirect;
+	}
+	if(indirect) {
+		error |= servo_sync_read(servos, count, SERVO_INDIRECT_DATA_1, INDIRECT_LEN, area, status);
+		if(error & (SERVO_BUSY | SERVO_ERROR)) {
+			return error;
+		}
+		for(uint8_t i = 0; i < count; i++) {
+			uint8_t * d = area + i*INDIRECT_LEN;
+			if(servos[i]->comm == SERVO_TIMEOUT) {
+				continue;
+			}
+			taskENTER_CRITICAL();
+			servos[i]->error = d[INDIRECT_ERROR];
+			servos[i]->status = status[i];
+			servos[i]->position = util_decode_i32(d + INDIRECT_POSITION);
+			servos[i]->psu_voltage = util_decode_u16(d + INDIRECT_VOLTAGE);
+			servos[i]->temperature = util_decode_i8(d + INDIRECT_TEMPERATURE);
+			servos[i]->time = xTaskGetTickCount();
+			taskEXIT_CRITICAL();
+		}
+		return error;
+	}
 
-	error |= servo_read_i8(servo, SERVO_PRESENT_TEMPERATURE, &servo->temperature, &err);
+	error |= servo_sync_read(servos, count, SERVO_HARDWARE_ERROR_STATUS, 1, errors, NULL);
 
-	error |= servo_read_i32(servo, SERVO_PRESENT_POSITION, &servo->position, &err);
+	error |= servo_sync_read(servos, count, SYNC_AREA_START, SYNC_AREA_LEN, area, status);
 
+	if(error & (SERVO_BUSY | SERVO_ERROR)) {
+		return error;
+	}
+	for(uint8_t i = 0; i < count; i++) {
+		uint8_t * d = area + i*SYNC_AREA_LEN;
+		if(servos[i]->comm == SERVO_TIMEOUT) {
+			continue;
+		}
+		taskENTER_CRITICAL();
+		servos[i]->error = errors[i];
+		servos[i]->status = status[i];
+		servos[i]->position = util_decode_i32(d + SERVO_PRESENT_POSITION - SYNC_AREA_START);
+		servos[i]->psu_voltage = util_decode_u16(d + SERVO_PRESENT_INPUT_VOLTAGE - SYNC_AREA_START);
+		servos[i]->temperature = util_decode_i8(d + SERVO_PRESENT_TEMPERATURE - SYNC_AREA_START);
+		servos[i]->time = xTaskGetTickCount();
+		taskEXIT_CRITICAL();
+	}
 
 	return error;
 }
@@ -304,6 +614,7 @@ SERVO_ERROR_t servo_config(SERVO_INST_t * servo) {
 	SERVO_ERROR_t error = 0;
 
 	error |= servo_disable_torque(servo, &err);
+	servo->torque = 0;
 
 	error |= servo_write_i32(servo, SERVO_MAX_POSITION_LIMIT, 4095, &err);
 
@@ -311,6 +622,15 @@ SERVO_ERROR_t servo_config(SERVO_INST_t * servo) {
 
 	error |= servo_write_u8(servo, SERVO_OPERATING_MODE, 3, &err);
 
+	//the indirect addresses are in the EEPROM area, written with the torque off
+	uint8_t map[INDIRECT_LEN*2];
+	for(uint8_t i = 0; i < INDIRECT_LEN; i++) {
+		util_encode_u16(map+i*2, servo_indirect_map[i]);
+	}
+	SERVO_ERROR_t map_error = servo_write(servo, SERVO_INDIRECT_ADDRESS_1, sizeof(map), map, &err);
+	servo->indirect = (map_error == SERVO_SUCCESS);
+	error |= map_error;
+
 	return error;
 }
 
@@ -321,10 +641,185 @@ SERVO_ERROR_t servo_move(SERVO_INST_t * servo, int32_t target) {
 	error |= servo_enable_torque(servo, &err);
 
 	error |= servo_write_i32(servo, SERVO_GOAL_POSITION, target, &err);
+	servo->torque = 1;
+
+	return error;
+}
+
+/*
+ * Link bring-up, before servo_config and servo_bus_start
+ * Finds each registered servo among the known baudrates, sets its return
+ * delay to the minimum and moves it to SERVO_LINK_BAUDRATE, then switches
+ * the uart and checks that every servo answers. The round trip histogram
+ * is cleared so that it only shows the final link.
+ * Servos not found are left as they are (comm SERVO_TIMEOUT).
+ */
+SERVO_ERROR_t servo_link_bringup(void) {
+	SERVO_ERROR_t error = 0;
+	uint8_t err;
+	for(uint8_t i = 0; i < servo_count; i++) {
+		SERVO_INST_t * servo = servo_list[i];
+		uint8_t found = 0;
+		for(uint8_t j = 0; j < sizeof(servo_link_bauds)/sizeof(SERVO_LINK_BAUD_t); j++) {
+			serial_set_baudrate(&servo_serial, servo_link_bauds[j].baudrate, 0);
+			if(servo_ping_wait(servo) != SERVO_TIMEOUT) {
+				found = 1;
+				break;
+			}
+		}
+		if(!found) {
+			error |= SERVO_TIMEOUT;
+			continue;
+		}
+		//EEPROM area, only written with the torque off
+		servo_disable_torque(servo, &err);
+		servo->torque = 0;
+		servo_write_u8(servo, SERVO_RETURN_DELAY_TIME, SERVO_LINK_RETURN_DELAY, &err);
+		if(serial_get_baudrate(&servo_serial) != SERVO_LINK_BAUDRATE) {
+			//answered at the current rate, the servo switches afterwards
+			servo_write_u8(servo, SERVO_BAUD_RATE, servo_link_bauds[0].code, &err);
+		}
+	}
+	serial_set_baudrate(&servo_serial, SERVO_LINK_BAUDRATE, 0);
+	for(uint8_t i = 0; i < servo_count; i++) {
+		if(servo_ping_wait(servo_list[i]) == SERVO_TIMEOUT) {
+			error |= SERVO_TIMEOUT;
+		}
+	}
+	servo_rtt_reset();
+	return error;
+}
+
+/*
+ * Goal positions of several servos in one transaction, the torque is
+ * enabled first on the servos that do not have it yet
+ */
+SERVO_ERROR_t servo_move_all(SERVO_INST_t ** servos, int32_t * targets, uint8_t count) {
+	uint8_t data[SERVO_MAX_INST*4];
+	SERVO_ERROR_t error = 0;
+	uint8_t torque = 1;
+	if(count > SERVO_MAX_INST) {
+		return SERVO_ERROR;
+	}
+	for(uint8_t i = 0; i < count; i++) {
+		torque &= servos[i]->torque;
+		data[i] = 1;
+	}
+	if(!torque) {
+		error |= servo_sync_write(servos, count, SERVO_TORQUE_ENABLE, 1, data);
+		for(uint8_t i = 0; i < count; i++) {
+			servos[i]->torque = 1;
+		}
+	}
+	for(uint8_t i = 0; i < count; i++) {
+		util_encode_i32(data+i*4, targets[i]);
+	}
+	error |= servo_sync_write(servos, count, SERVO_GOAL_POSITION, 4, data);
 
 	return error;
 }
 
+/*
+ * Servo bus scheduler
+ * Owns the bus once started: every cycle it executes the requested register
+ * writes, sends the pending goal positions in one sync write and refreshes
+ * the telemetry of all the servos. A servo that does not answer only delays
+ * this thread, the other threads read the last telemetry and post commands
+ * without waiting.
+ */
+void servo_bus_thread(void * arg) {
+	static TickType_t last_wake_time;
+	static const TickType_t period = pdMS_TO_TICKS(SERVO_BUS_PERIOD);
+	static SERVO_INST_t * movers[SERVO_MAX_INST];
+	static int32_t targets[SERVO_MAX_INST];
+
+	//servos are configured with the blocking functions before the start
+	xSemaphoreTake(servo_bus_start_sem, portMAX_DELAY);
+
+	last_wake_time = xTaskGetTickCount();
+
+	for(;;) {
+		SERVO_REQUEST_t request;
+		for(uint8_t i = 0; i < SERVO_REQUESTS_PER_CYCLE; i++) {
+			if(xQueueReceive(servo_request_queue, &request, 0) != pdTRUE) {
+				break;
+			}
+			uint8_t err;
+			if(servo_write(request.servo, request.address, request.length, request.data, &err) == SERVO_SUCCESS
+					&& request.address == SERVO_TORQUE_ENABLE) {
+				request.servo->torque = request.data[0];
+			}
+		}
+
+		uint8_t count = 0;
+		taskENTER_CRITICAL();
+		for(uint8_t i = 0; i < servo_count; i++) {
+			if(servo_list[i]->target_pending) {
+				servo_list[i]->target_pending = 0;
+				movers[count] = servo_list[i];
+				targets[count++] = servo_list[i]->target;
+			}
+		}
+		taskEXIT_CRITICAL();
+		if(count) {
+			servo_move_all(movers, targets, count);
+		}
+
+		servo_sync_all(servo_list, servo_count);
+
+		vTaskDelayUntil(&last_wake_time, period);
+	}
+}
+
+void servo_bus_start(void) {
+	xSemaphoreGive(servo_bus_start_sem);
+}
+
+/*
+ * Sent at the next bus cycle, a newer target replaces one not sent yet
+ */
+void servo_set_target(SERVO_INST_t * servo, int32_t target) {
+	taskENTER_CRITICAL();
+	servo->target = target;
+	servo->target_pending = 1;
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * Register write executed by the bus thread
+ * returns SERVO_BUSY if too many requests are waiting
+ */
+SERVO_ERROR_t servo_request_write(SERVO_INST_t * servo, uint16_t address, uint16_t length, uint8_t * data) {
+	SERVO_REQUEST_t request;
+	if(length > SERVO_REQUEST_MAX) {
+		return SERVO_ERROR;
+	}
+	request.servo = servo;
+	request.address = address;
+	request.length = length;
+	for(uint16_t i = 0; i < length; i++) {
+		request.data[i] = data[i];
+	}
+	if(xQueueSend(servo_request_queue, &request, 0) != pdTRUE) {
+		return SERVO_BUSY;
+	}
+	return SERVO_SUCCESS;
+}
+
+SERVO_TELEMETRY_t servo_get_telemetry(SERVO_INST_t * servo) {
+	SERVO_TELEMETRY_t telemetry;
+	taskENTER_CRITICAL();
+	telemetry.position = servo->position;
+	telemetry.psu_voltage = servo->psu_voltage;
+	telemetry.temperature = servo->temperature;
+	telemetry.error = servo->error;
+	telemetry.status = servo->status;
+	telemetry.comm = servo->comm;
+	telemetry.time = servo->time;
+	taskEXIT_CRITICAL();
+	return telemetry;
+}
+
 
 
 
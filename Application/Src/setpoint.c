@@ -0,0 +1,169 @@
+/*  Title		: Setpoint
+ *  Filename	: setpoint.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: setpoint generation between cm4 commands
+ *
+ *	The CM4 commands (thrust and vanes) arrive at the GNC rate, the control
+ *	thread reads the setpoints at its own rate. The interval between two
+ *	commands is taken from their timestamps (ms), or from their arrival
+ *	times when the timestamps are not usable.
+ *	SETPOINT_INTERPOLATE goes from the previous to the last command over that
+ *	interval (smooth, one interval late), SETPOINT_EXTRAPOLATE continues the
+ *	slope of the last two commands for at most SETPOINT_HORIZON ms (no delay,
+ *	overshoots on changes), SETPOINT_STEP applies the commands as they come.
+ *	Setpoints older than SETPOINT_TIMEOUT are not valid.
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <main.h>
+#include <cmsis_os.h>
+#include <setpoint.h>
+
+/**********************
+ *	CONFIGURATION
+ **********************/
+
+#define SETPOINT_DEFAULT_MODE	SETPOINT_INTERPOLATE
+
+#define SETPOINT_HORIZON		(50) /* ms */
+
+#define SETPOINT_TIMEOUT		(250) /* ms */
+
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+//commands further apart are steps
+#define SETPOINT_MAX_INTERVAL	(200) /* ms */
+
+
+/**********************
+ *	MACROS
+ **********************/
+
+
+/**********************
+ *	TYPEDEFS
+ **********************/
+
+typedef struct SETPOINT_SAMPLE {
+	int32_t values[SETPOINT_CHANNELS];
+	uint32_t timestamp;
+	uint32_t arrival;
+}SETPOINT_SAMPLE_t;
+
+typedef struct SETPOINT_INST {
+	SETPOINT_SAMPLE_t prev;
+	SETPOINT_SAMPLE_t last;
+	uint8_t count;
+	SETPOINT_MODE_t mode;
+}SETPOINT_INST_t;
+
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static SETPOINT_INST_t setpoint = {.mode = SETPOINT_DEFAULT_MODE};
+
+
+/**********************
+ *	PROTOTYPES
+ **********************/
+
+static uint32_t setpoint_interval(SETPOINT_SAMPLE_t * prev, SETPOINT_SAMPLE_t * last);
+
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+/*
+ * Called with each cm4 command
+ */
+void setpoint_push(CM4_PAYLOAD_COMMAND_t * cmd) {
+	SETPOINT_SAMPLE_t sample;
+	sample.values[SETPOINT_THRUST] = cmd->thrust;
+	for(uint8_t i = 0; i < 4; i++) {
+		sample.values[SETPOINT_VANE_1+i] = cmd->dynamixel[i];
+	}
+	sample.timestamp = cmd->timestamp;
+	sample.arrival = HAL_GetTick();
+	taskENTER_CRITICAL();
+	setpoint.prev = setpoint.last;
+	setpoint.last = sample;
+	if(setpoint.count < 2) {
+		setpoint.count++;
+	}
+	taskEXIT_CRITICAL();
+}
+
+static uint32_t setpoint_interval(SETPOINT_SAMPLE_t * prev, SETPOINT_SAMPLE_t * last) {
+	uint32_t interval = last->timestamp - prev->timestamp;
+	if(interval && interval <= SETPOINT_MAX_INTERVAL) {
+		return interval;
+	}
+	interval = last->arrival - prev->arrival;
+	if(interval && interval <= SETPOINT_MAX_INTERVAL) {
+		return interval;
+	}
+	return 0;
+}
+
+/*
+ * Setpoints at a time (HAL tick) after the last command
+ * returns 0 when there is no valid setpoint
+ */
+uint8_t setpoint_get(uint32_t time, int32_t * values) {
+	SETPOINT_SAMPLE_t prev, last;
+	uint8_t count;
+	SETPOINT_MODE_t mode;
+
+	taskENTER_CRITICAL();
+	prev = setpoint.prev;
+	last = setpoint.last;
+	count = setpoint.count;
+	mode = setpoint.mode;
+	taskEXIT_CRITICAL();
+
+	if(!count || time - last.arrival > SETPOINT_TIMEOUT) {
+		return 0;
+	}
+	uint32_t interval = count < 2 ? 0 : setpoint_interval(&prev, &last);
+	uint32_t elapsed = time - last.arrival;
+	for(uint8_t i = 0; i < SETPOINT_CHANNELS; i++) {
+		int64_t delta = (int64_t) last.values[i] - prev.values[i];
+		if(!interval || mode == SETPOINT_STEP) {
+			values[i] = last.values[i];
+		} else if(mode == SETPOINT_EXTRAPOLATE) {
+			uint32_t horizon = elapsed < SETPOINT_HORIZON ? elapsed : SETPOINT_HORIZON;
+			values[i] = last.values[i] + (int32_t)(delta * horizon / interval);
+		} else if(elapsed < interval) {
+			values[i] = prev.values[i] + (int32_t)(delta * elapsed / interval);
+		} else {
+			values[i] = last.values[i];
+		}
+	}
+	return 1;
+}
+
+void setpoint_set_mode(SETPOINT_MODE_t mode) {
+	setpoint.mode = mode;
+}
+
+/*
+ * Forget the commands received so far
+ */
+void setpoint_reset(void) {
+	taskENTER_CRITICAL();
+	setpoint.count = 0;
+	taskEXIT_CRITICAL();
+}
+
+
+/* END */
@@ -2,9 +2,56 @@
  *  Filename	: storage.c
  *	Author		: iacopo sprenger
  *	Date		: 07.02.2021
- *	Version		: 0.1
+ *	Version		: 0.3
  *	Description	: storage on the onboard flash memory
  *
+ *	When no recording is active the flash is kept in memory-mapped mode, so that
+ *	downloads and log scans are plain memory reads. Writes switch the QSPI back
+ *	to indirect mode, all flash accesses are serialized with storage_flash_mutex.
+ *
+ *	Producers call storage_log() at their own rate with one of the record types,
+ *	the entries are queued and encoded by the storage thread.
+ *	While no recording is active the entries are kept in a RAM pre-trigger ring
+ *	buffer instead, overwriting the oldest ones. storage_trigger() commits the
+ *	ring to flash and starts recording, so that the seconds before an event are
+ *	kept without writing to the flash all the time. The producers keep writing
+ *	to the ring until it has been drained, the queue is only used afterwards.
+ *	A record is dropped when the queue is full.
+ *
+ *	ALLOCATION
+ *	The first subsector holds the STORAGE_HEADER_t, the bad subsector bitmap and
+ *	the session table.
+ *	The log is circular over the remaining subsectors: each restart begins a new
+ *	session right after the end of the previous one, so erases are spread over the
+ *	whole chip and older sessions stay readable until they are overwritten.
+ *	The session id is the generation number written in every block header.
+ *	Sessions are appended to the table in place (no erase), the length of a session
+ *	is programmed when the next one starts. The table is only compacted when full.
+ *	The end of the current session is found at boot by scanning the block headers.
+ *	Each block header keeps the erase count of its subsector, a session entry keeps
+ *	the highest erase count of the log when it is closed so that a subsector whose
+ *	header is unreadable does not restart at zero. Subsectors reporting
+ *	an erase or program fault are cleared in the bitmap (no erase needed) and are
+ *	skipped by the writer and the readers.
+ *
+ *	LOG FORMAT (version 6)
+ *	Version 5 added the session table and version 6 its erase counts, the blocks
+ *	are unchanged since version 4.
+ *	The header subsector holds the STORAGE_HEADER_t, the bad subsector bitmap at
+ *	offset 256 and the STORAGE_SESSION_t table at offset 1024, an erased id ends it.
+ *	The log is a sequence of blocks, one block per subsector.
+ *	Each block starts with a STORAGE_BLOCK_HEADER_t followed by records:
+ *		[type (1 byte)][len (1 byte)][len bytes of payload]
+ *	The payload of data records is a list of zigzag varints: the tick followed
+ *	by the fields of the schema of the type. Every value is stored as the
+ *	difference with the previous record of the same type in the block. The first
+ *	record of each type in a block is encoded against zero (keyframe), so each
+ *	block can be decoded on its own.
+ *	The first block of the log starts with one STORAGE_TYPE_SCHEMA record per type:
+ *		[type][nb_fields][type name (8)] then per field [size | signed<<7][name (8)]
+ *	so that any version of the log can be decoded without the firmware sources.
+ *	An erased type byte (0xff) marks the end of the block.
+ *	The matching decoder is Desktop/control_station/log_format.py
  *
  *	TODO: dual headers in case power is cut while a header is beeing written!
  */
@@ -13,8 +60,13 @@
  *	INCLUDES
  **********************/
 
+#include <string.h>
+#include <stddef.h>
+
+#include <main.h>
 #include <storage.h>
 #include <control.h>
+#include <can_comm.h>
 #include <flash.h>
 #include <led.h>
 
@@ -22,21 +74,43 @@
  *	CONSTANTS
  **********************/
 
-#define DATA_SIZE		(32)
-
 #define MAGIC_NUMBER	0xCBE0C5E6
+#define STORAGE_VERSION	(6)
 #define HEADER_ADDR		0x00000000
-#define USED_SS_ADDR	0x00000004
+#define BAD_MAP_ADDR	(HEADER_ADDR + 256)
+#define SESSION_ADDR	(HEADER_ADDR + 1024)
+
+#define BLOCK_MAGIC		0xB10C
 
 #define SUBSECTOR_SIZE	4096
-#define SAMPLES_PER_SS	(SUBSECTOR_SIZE/DATA_SIZE)
 
-#define NEXT_SUBSECTOR (SUBSECTOR_SIZE*used_subsectors)
 #define DATA_START		SUBSECTOR_SIZE
 #define NB_SUBSECTOR	4096
+#define NB_DATA			(NB_SUBSECTOR - 1)
+#define BAD_MAP_LEN		(NB_SUBSECTOR / 8)
+
+#define SESSION_MAX		((SUBSECTOR_SIZE - SESSION_ADDR) / sizeof(STORAGE_SESSION_t))
+#define SESSION_KEEP	(16) //sessions kept when the table is compacted
+#define SESSION_OPEN	(0xffffffff)
+
+#define RECORD_MAX_LEN	(160)
+#define RECORD_END		(0xff)
+#define RECORD_HEADER	(2)
+
+#define SCHEMA_NAME_LEN	(8)
+#define SCHEMA_SIGNED	(0x80)
+
+#define MAX_FIELDS		(16)
+
+#define READ_AHEAD_MAX	(64)
+
+#define QUEUE_DEPTH		(64)
+#define QUEUE_TIMEOUT	pdMS_TO_TICKS(100)
+
+#define PRETRIGGER_SIZE	(32*1024)
+#define PRETRIGGER_HEAD	(5) //type + tick
 
 #define LONG_TIME		0xffff
-#define SS_TO_PREP		500
 
 #define STORAGE_AFTER_SAVE 3000
 
@@ -50,8 +124,13 @@
  *	MACROS
  **********************/
 
-#define ADDRESS(i)		(DATA_START + (i)*DATA_SIZE)
-#define SUBSECTOR(i)	(ADDRESS(i)>>12)
+#define LOG_ADDRESS(start, i)	(DATA_START + (((start) + (i)) % NB_DATA)*SUBSECTOR_SIZE)
+#define BLOCK_ADDRESS(i)	LOG_ADDRESS(log_start, i)
+#define SESSION_ENTRY(i)	(SESSION_ADDR + (i)*sizeof(STORAGE_SESSION_t))
+#define SUBSECTOR(addr)		((addr) / SUBSECTOR_SIZE)
+
+#define FIELD(type, member, sgn, name)	{offsetof(type, member), sizeof(((type *)0)->member), sgn, name}
+#define SCHEMA(type, name, fields)		{name, sizeof(type), sizeof(fields)/sizeof(STORAGE_FIELD_t), fields}
 
 /**********************
  *	TYPEDEFS
@@ -69,39 +148,193 @@ typedef struct  STORAGE_DATA{
 	int32_t tvc_vel;
 	uint32_t padding;
 	uint32_t time;
-}STORAGE_DATA_t;  //MUST BE AN INTEGER DIVISOR OF 4096
+}STORAGE_DATA_t;  //Status sample as served to the debug interface
 
 
 typedef struct STORAGE_HEADER{
 	uint32_t magic;
-	uint32_t used;
+	uint32_t version;
 	int32_t calib_1;
 	int32_t calib_2;
 }STORAGE_HEADER_t;
 
+typedef struct STORAGE_BLOCK_HEADER{
+	uint16_t magic;
+	uint16_t version;
+	uint32_t first_id; //number of status records before this block
+	uint32_t generation; //generation of the log this block belongs to
+	uint32_t erase_count;
+}STORAGE_BLOCK_HEADER_t;
+
+typedef struct STORAGE_FIELD{
+	uint8_t offset;
+	uint8_t size;
+	uint8_t is_signed;
+	const char * name;
+}STORAGE_FIELD_t;
+
+typedef struct STORAGE_SCHEMA{
+	const char * name;
+	uint16_t size;
+	uint8_t nb_fields;
+	const STORAGE_FIELD_t * fields;
+}STORAGE_SCHEMA_t;
+
+typedef struct STORAGE_ENTRY{
+	uint8_t type;
+	uint32_t tick;
+	uint8_t payload[STORAGE_MAX_PAYLOAD];
+}STORAGE_ENTRY_t;
+
+typedef struct STORAGE_CURSOR{
+	uint32_t block;
+	uint32_t offset;
+	uint32_t id;
+	uint8_t valid;
+	uint32_t prev[STORAGE_TYPE_NUM][MAX_FIELDS+1];
+}STORAGE_CURSOR_t;
+
 /**********************
  *	VARIABLES
  **********************/
 
-
-static uint32_t used_subsectors;
+static const STORAGE_FIELD_t status_fields[] = {
+		FIELD(STORAGE_DATA_t, hb_state, 0, "hb_state"),
+		FIELD(STORAGE_DATA_t, cm4_state, 0, "cm4_stat"),
+		FIELD(STORAGE_DATA_t, pp_thrust, 1, "pp_thrus"),
+		FIELD(STORAGE_DATA_t, av_alti, 1, "av_alti"),
+		FIELD(STORAGE_DATA_t, tvc_thrust, 1, "tvc_thru"),
+		FIELD(STORAGE_DATA_t, tvc_alti, 1, "tvc_alti"),
+		FIELD(STORAGE_DATA_t, tvc_vel, 1, "tvc_vel"),
+		FIELD(STORAGE_DATA_t, time, 0, "time")
+};
+
+static const STORAGE_FIELD_t sensor_fields[] = {
+		FIELD(CM4_PAYLOAD_SENSOR_t, timestamp, 0, "timestam"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, acc_x, 1, "acc_x"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, acc_y, 1, "acc_y"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, acc_z, 1, "acc_z"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, gyro_x, 1, "gyro_x"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, gyro_y, 1, "gyro_y"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, gyro_z, 1, "gyro_z"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, baro, 1, "baro"),
+		FIELD(CM4_PAYLOAD_SENSOR_t, alti, 1, "alti")
+};
+
+static const STORAGE_FIELD_t command_fields[] = {
+		FIELD(CM4_PAYLOAD_COMMAND_t, timestamp, 0, "timestam"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, thrust, 1, "thrust"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, dynamixel[0], 1, "dyn_0"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, dynamixel[1], 1, "dyn_1"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, dynamixel[2], 1, "dyn_2"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, dynamixel[3], 1, "dyn_3"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, position[0], 1, "pos_x"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, position[1], 1, "pos_y"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, position[2], 1, "pos_z"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, speed[0], 1, "vel_x"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, speed[1], 1, "vel_y"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, speed[2], 1, "vel_z"),
+		FIELD(CM4_PAYLOAD_COMMAND_t, state, 0, "state")
+};
+
+static const STORAGE_FIELD_t feedback_fields[] = {
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, timestamp, 0, "timestam"),
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, cc_pressure, 1, "cc_press"),
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, dynamixel[0], 1, "dyn_0"),
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, dynamixel[1], 1, "dyn_1"),
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, dynamixel[2], 1, "dyn_2"),
+		FIELD(CM4_PAYLOAD_FEEDBACK_t, dynamixel[3], 1, "dyn_3")
+};
+
+static const STORAGE_FIELD_t can_fields[] = {
+		FIELD(CAN_msg, id, 0, "id"),
+		FIELD(CAN_msg, data, 0, "data"),
+		FIELD(CAN_msg, timestamp, 0, "timestam"),
+		FIELD(CAN_msg, id_CAN, 0, "board")
+};
+
+static const STORAGE_FIELD_t state_fields[] = {
+		FIELD(STORAGE_TRANSITION_t, from, 0, "from"),
+		FIELD(STORAGE_TRANSITION_t, to, 0, "to")
+};
+
+static const STORAGE_FIELD_t health_fields[] = {
+		FIELD(STORAGE_HEALTH_t, source, 0, "source"),
+		FIELD(STORAGE_HEALTH_t, state, 0, "state"),
+		FIELD(STORAGE_HEALTH_t, age, 0, "age"),
+		FIELD(STORAGE_HEALTH_t, threshold, 0, "threshol")
+};
+
+static const STORAGE_FIELD_t timing_fields[] = {
+		FIELD(STORAGE_TIMING_t, overruns, 0, "overruns"),
+		FIELD(STORAGE_TIMING_t, late, 0, "late"),
+		FIELD(STORAGE_TIMING_t, jitter_min, 1, "jit_min"),
+		FIELD(STORAGE_TIMING_t, jitter_max, 1, "jit_max"),
+		FIELD(STORAGE_TIMING_t, exec_max, 0, "exec_max")
+};
+
+//Compiled in schema table, indexed by STORAGE_TYPE_t
+static const STORAGE_SCHEMA_t storage_schemas[STORAGE_TYPE_NUM] = {
+		{"schema", 0, 0, NULL},
+		SCHEMA(STORAGE_DATA_t, "status", status_fields),
+		SCHEMA(CM4_PAYLOAD_SENSOR_t, "sensor", sensor_fields),
+		SCHEMA(CM4_PAYLOAD_COMMAND_t, "command", command_fields),
+		SCHEMA(CM4_PAYLOAD_FEEDBACK_t, "feedback", feedback_fields),
+		SCHEMA(CAN_msg, "can", can_fields),
+		SCHEMA(STORAGE_TRANSITION_t, "state", state_fields),
+		SCHEMA(STORAGE_HEALTH_t, "health", health_fields),
+		SCHEMA(STORAGE_TIMING_t, "timing", timing_fields)
+};
+
+static uint32_t log_start;
+static uint32_t log_generation;
+static uint32_t nb_blocks;
+static uint8_t schema_written;
+static uint8_t bad_map[BAD_MAP_LEN]; //1 bit per subsector, cleared when faulty
+static uint32_t session_count;
+static uint32_t selected_session;
 static uint32_t data_counter;
+static uint32_t erase_max; //highest erase count seen in the log
 static uint8_t record_active;
 static uint8_t restart_required;
+static uint8_t dump_required;
 static int32_t record_should_stop;
 
-static SemaphoreHandle_t storage_sem = NULL;
-static StaticSemaphore_t storage_sem_buffer;
+static STORAGE_CURSOR_t write_cursor;
+static STORAGE_CURSOR_t read_cursor;
+
+static QueueHandle_t storage_queue = NULL;
+static StaticQueue_t storage_queue_buffer;
+static uint8_t storage_queue_storage[QUEUE_DEPTH*sizeof(STORAGE_ENTRY_t)];
+
+static uint8_t pretrigger_buffer[PRETRIGGER_SIZE];
+static uint32_t pretrigger_head;
+static uint32_t pretrigger_tail;
+static uint32_t pretrigger_fill;
+
+static SemaphoreHandle_t storage_flash_mutex = NULL;
+static StaticSemaphore_t storage_flash_mutex_buffer;
 
 
 /**********************
  *	PROTOTYPES
  **********************/
 
-static STORAGE_DATA_t read_data(uint32_t address);
-static void write_header_used(uint32_t used);
+static uint8_t read_data(uint32_t id, STORAGE_DATA_t * data);
+static void write_header(void);
+static uint8_t session_load(void);
+static void session_append(void);
+static void log_scan(void);
+static uint8_t block_tail_erased(uint32_t block, uint32_t offset);
+
+static void write_record(STORAGE_ENTRY_t * entry);
+static void write_schemas(void);
 
-static void write_data(STORAGE_DATA_t data);
+static uint16_t record_encode(uint8_t * record, STORAGE_ENTRY_t * entry, uint32_t * prev);
+static uint8_t record_decode(uint8_t * record, uint16_t len, uint8_t type, uint8_t * payload, uint32_t * tick, uint32_t * prev);
+
+static uint8_t cursor_open(STORAGE_CURSOR_t * cur, uint32_t block);
+static uint8_t cursor_next(STORAGE_CURSOR_t * cur, uint8_t * type, uint8_t * payload);
 
 
 
@@ -111,34 +344,122 @@ static void write_data(STORAGE_DATA_t data);
 
 void storage_init() {
 	static STORAGE_HEADER_t header;
+	storage_flash_mutex = xSemaphoreCreateMutexStatic(&storage_flash_mutex_buffer);
 	flash_init();
+	//recovery scan is done through the memory mapping
+	flash_mmap_enable();
 	flash_read(HEADER_ADDR, (uint8_t *) &header, sizeof(STORAGE_HEADER_t));
-	if(header.magic == MAGIC_NUMBER) {
-		used_subsectors = header.used;
-		if(used_subsectors > 1) {
-			STORAGE_DATA_t data = {0};
-			STORAGE_DATA_t last_valid_data = {0};
-			uint32_t count = (used_subsectors-2)*SAMPLES_PER_SS;
-			data = read_data(count);
-			while(data.sample_id == count){
-				last_valid_data = data;
-				data = read_data(++count);
+	write_cursor.valid = 0;
+	read_cursor.valid = 0;
+	selected_session = STORAGE_SESSION_CURRENT;
+	if(header.magic == MAGIC_NUMBER && header.version == STORAGE_VERSION && session_load()) {
+		flash_read(BAD_MAP_ADDR, bad_map, BAD_MAP_LEN);
+		log_scan();
+		data_counter = 0;
+		if(nb_blocks > 0 && cursor_open(&write_cursor, nb_blocks-1)) {
+			//decode the last block to find the end of the log
+			static uint8_t payload[STORAGE_MAX_PAYLOAD];
+			uint8_t type;
+			while(cursor_next(&write_cursor, &type, payload));
+			data_counter = write_cursor.id;
+			//a record torn by a power cut cannot be programmed over
+			if(!block_tail_erased(write_cursor.block, write_cursor.offset)) {
+				write_cursor.valid = 0;
 			}
-
-			data_counter = count;
-		} else {
-			data_counter = 0;
 		}
 	} else {
-		write_header_used(1);
+		log_start = 0;
+		log_generation = 0;
+		memset(bad_map, 0xff, BAD_MAP_LEN);
+		write_header();
+		session_count = 0;
+		erase_max = 0;
+		session_append();
+		nb_blocks = 0;
+		schema_written = 0;
 		data_counter = 0;
 	}
 	record_active = 0;
 	restart_required = 0;
+	dump_required = 0;
+	pretrigger_head = 0;
+	pretrigger_tail = 0;
+	pretrigger_fill = 0;
 	record_should_stop = 0;
-	storage_sem = xSemaphoreCreateBinaryStatic(&storage_sem_buffer);
+	storage_queue = xQueueCreateStatic(QUEUE_DEPTH, sizeof(STORAGE_ENTRY_t), storage_queue_storage, &storage_queue_buffer);
 }
 
+static void pretrigger_copy_in(const uint8_t * data, uint32_t len) {
+	for(uint32_t i = 0; i < len; i++) {
+		pretrigger_buffer[pretrigger_head] = data[i];
+		pretrigger_head = (pretrigger_head + 1) % PRETRIGGER_SIZE;
+	}
+}
+
+static void pretrigger_copy_out(uint8_t * data, uint32_t len) {
+	for(uint32_t i = 0; i < len; i++) {
+		data[i] = pretrigger_buffer[pretrigger_tail];
+		pretrigger_tail = (pretrigger_tail + 1) % PRETRIGGER_SIZE;
+	}
+}
+
+/*
+ * Append an entry to the pre-trigger ring, dropping the oldest entries to make room
+ * must be called inside a critical section
+ */
+static void pretrigger_push(STORAGE_ENTRY_t * entry) {
+	uint32_t len = PRETRIGGER_HEAD + storage_schemas[entry->type].size;
+	while(PRETRIGGER_SIZE - pretrigger_fill < len) {
+		uint8_t type = pretrigger_buffer[pretrigger_tail];
+		uint32_t old_len = PRETRIGGER_HEAD + storage_schemas[type].size;
+		pretrigger_tail = (pretrigger_tail + old_len) % PRETRIGGER_SIZE;
+		pretrigger_fill -= old_len;
+	}
+	pretrigger_copy_in(&entry->type, 1);
+	pretrigger_copy_in((uint8_t *) &entry->tick, sizeof(uint32_t));
+	pretrigger_copy_in(entry->payload, storage_schemas[entry->type].size);
+	pretrigger_fill += len;
+}
+
+/*
+ * Remove the oldest entry of the pre-trigger ring
+ * returns 0 when the ring is empty
+ */
+static uint8_t pretrigger_pop(STORAGE_ENTRY_t * entry) {
+	uint8_t ret = 0;
+	taskENTER_CRITICAL();
+	if(pretrigger_fill) {
+		pretrigger_copy_out(&entry->type, 1);
+		pretrigger_copy_out((uint8_t *) &entry->tick, sizeof(uint32_t));
+		pretrigger_copy_out(entry->payload, storage_schemas[entry->type].size);
+		pretrigger_fill -= PRETRIGGER_HEAD + storage_schemas[entry->type].size;
+		ret = 1;
+	}
+	taskEXIT_CRITICAL();
+	return ret;
+}
+
+/*
+ * Queue a record for the storage thread, or keep it in the pre-trigger ring when not recording
+ * can be called from any thread, the record is dropped if the queue is full
+ */
+void storage_log(STORAGE_TYPE_t type, const void * payload) {
+	STORAGE_ENTRY_t entry;
+	if(storage_queue == NULL || type == STORAGE_TYPE_SCHEMA || type >= STORAGE_TYPE_NUM) {
+		return;
+	}
+	entry.type = type;
+	entry.tick = HAL_GetTick();
+	memcpy(entry.payload, payload, storage_schemas[type].size);
+	taskENTER_CRITICAL();
+	if(record_active) {
+		taskEXIT_CRITICAL();
+		xQueueSend(storage_queue, &entry, 0);
+	} else {
+		pretrigger_push(&entry);
+		taskEXIT_CRITICAL();
+	}
+}
 
 void storage_record_sample() {
 	STORAGE_DATA_t data = {0};
@@ -158,46 +479,576 @@ void storage_record_sample() {
 	data.tvc_thrust = cmd.thrust;
 
 
-	write_data(data);
+	storage_log(STORAGE_TYPE_STATUS, &data);
 
 }
 
 
 
-static void write_header_used(uint32_t used) {
+static void write_header(void) {
 	static STORAGE_HEADER_t header;
 	flash_read(HEADER_ADDR, (uint8_t *) &header, sizeof(STORAGE_HEADER_t));
 	flash_erase_subsector(HEADER_ADDR);
 	header.magic = MAGIC_NUMBER;
-	header.used = used;
+	header.version = STORAGE_VERSION;
 	flash_write(HEADER_ADDR, (uint8_t *) &header, sizeof(STORAGE_HEADER_t));
-	used_subsectors = used;
+	flash_write(BAD_MAP_ADDR, bad_map, BAD_MAP_LEN);
 }
 
+static uint8_t subsector_is_bad(uint32_t address) {
+	uint32_t sub = SUBSECTOR(address);
+	return !(bad_map[sub / 8] & (1 << (sub % 8)));
+}
 
+/*
+ * Retire a faulty subsector
+ * bits can be cleared in place, so the bitmap is updated without erasing the header
+ */
+static void subsector_mark_bad(uint32_t address) {
+	uint32_t sub = SUBSECTOR(address);
+	bad_map[sub / 8] &= ~(1 << (sub % 8));
+	flash_write(BAD_MAP_ADDR + sub / 8, &bad_map[sub / 8], 1);
+}
 
-static STORAGE_DATA_t read_data(uint32_t id) {
-	static STORAGE_DATA_t data;
-	flash_read(ADDRESS(id), (uint8_t *) &data, sizeof(STORAGE_DATA_t));
-	return data;
+static uint8_t block_header_read(uint32_t address, STORAGE_BLOCK_HEADER_t * header) {
+	flash_read(address, (uint8_t *) header, sizeof(STORAGE_BLOCK_HEADER_t));
+	return header->magic == BLOCK_MAGIC && header->version == STORAGE_VERSION;
 }
 
-static void write_data(STORAGE_DATA_t data) {
-	data.sample_id = data_counter;
-	uint32_t addr = ADDRESS(data_counter++);
-	if(addr % SUBSECTOR_SIZE == 0) {
-		write_header_used(used_subsectors + 1);
-		flash_erase_subsector(addr);
+/*
+ * Find the end of the current log: blocks of the current generation following
+ * log_start, bad subsectors are skipped
+ */
+static void log_scan(void) {
+	STORAGE_BLOCK_HEADER_t header;
+	nb_blocks = 0;
+	schema_written = 0;
+	for(uint32_t i = 0; i < NB_DATA; i++) {
+		if(subsector_is_bad(BLOCK_ADDRESS(i))) {
+			continue;
+		}
+		if(!block_header_read(BLOCK_ADDRESS(i), &header) || header.generation != log_generation) {
+			break;
+		}
+		nb_blocks = i + 1;
+		schema_written = 1;
+		if(header.erase_count > erase_max) {
+			erase_max = header.erase_count;
+		}
+	}
+}
+
+/*
+ * Check that a block is still erased from an offset to its end
+ */
+static uint8_t block_tail_erased(uint32_t block, uint32_t offset) {
+	static uint8_t buffer[64];
+	while(offset < SUBSECTOR_SIZE) {
+		uint32_t len = SUBSECTOR_SIZE - offset;
+		if(len > sizeof(buffer)) {
+			len = sizeof(buffer);
+		}
+		flash_read(BLOCK_ADDRESS(block) + offset, buffer, len);
+		for(uint32_t i = 0; i < len; i++) {
+			if(buffer[i] != 0xff) {
+				return 0;
+			}
+		}
+		offset += len;
+	}
+	return 1;
+}
+
+/*
+ * Find the current session, the last entry of the table
+ * returns 0 if the table is empty
+ */
+static uint8_t session_load(void) {
+	STORAGE_SESSION_t session;
+	session_count = 0;
+	erase_max = 0;
+	while(session_count < SESSION_MAX) {
+		flash_read(SESSION_ENTRY(session_count), (uint8_t *) &session, sizeof(STORAGE_SESSION_t));
+		if(session.id == SESSION_OPEN) {
+			break;
+		}
+		if(session.erase_count != SESSION_OPEN && session.erase_count > erase_max) {
+			erase_max = session.erase_count;
+		}
+		log_start = SUBSECTOR(session.start - DATA_START);
+		log_generation = session.id;
+		session_count++;
+	}
+	return session_count > 0;
+}
+
+/*
+ * Keep only the most recent sessions when the table is full
+ */
+static void session_compact(void) {
+	static STORAGE_SESSION_t sessions[SESSION_KEEP];
+	flash_read(SESSION_ENTRY(session_count - SESSION_KEEP), (uint8_t *) sessions, sizeof(sessions));
+	write_header();
+	flash_write(SESSION_ADDR, (uint8_t *) sessions, sizeof(sessions));
+	session_count = SESSION_KEEP;
+	selected_session = STORAGE_SESSION_CURRENT;
+}
+
+/*
+ * Register the current log as a new session
+ */
+static void session_append(void) {
+	STORAGE_SESSION_t session;
+	if(session_count >= SESSION_MAX) {
+		session_compact();
+	}
+	session.id = log_generation;
+	session.start = LOG_ADDRESS(log_start, 0);
+	session.length = SESSION_OPEN;
+	session.start_tick = HAL_GetTick();
+	session.fw_version = FIRMWARE_VERSION;
+	session.erase_count = SESSION_OPEN; //programmed when the session is closed
+	flash_write(SESSION_ENTRY(session_count), (uint8_t *) &session, sizeof(STORAGE_SESSION_t));
+	session_count++;
+}
+
+/*
+ * Close the current session and start a new one right after its end
+ */
+static void log_rotate(void) {
+	uint32_t length = nb_blocks*SUBSECTOR_SIZE;
+	flash_write(SESSION_ENTRY(session_count-1) + offsetof(STORAGE_SESSION_t, length), (uint8_t *) &length, sizeof(uint32_t));
+	flash_write(SESSION_ENTRY(session_count-1) + offsetof(STORAGE_SESSION_t, erase_count), (uint8_t *) &erase_max, sizeof(uint32_t));
+	log_start = (log_start + nb_blocks) % NB_DATA;
+	log_generation++;
+	nb_blocks = 0;
+	schema_written = 0;
+	session_append();
+}
+
+/*
+ * A session is readable until the log wraps over its first block
+ */
+static uint8_t session_available(STORAGE_SESSION_t * session) {
+	STORAGE_BLOCK_HEADER_t header;
+	uint32_t start = SUBSECTOR(session->start - DATA_START);
+	if(session->id == log_generation) {
+		return 1;
+	}
+	if(session->length == SESSION_OPEN) {
+		return 0;
+	}
+	for(uint32_t i = 0; i < session->length / SUBSECTOR_SIZE; i++) {
+		if(!subsector_is_bad(LOG_ADDRESS(start, i))) {
+			return block_header_read(LOG_ADDRESS(start, i), &header) && header.generation == session->id;
+		}
+	}
+	return session->length == 0;
+}
+
+/*
+ * Sign or zero extend a field of a payload to 32 bits
+ */
+static uint32_t field_load(const uint8_t * payload, const STORAGE_FIELD_t * field) {
+	const uint8_t * p = payload + field->offset;
+	if(field->size == 1) {
+		return field->is_signed ? (uint32_t) *((int8_t *) p) : *p;
+	} else if(field->size == 2) {
+		return field->is_signed ? (uint32_t) *((int16_t *) p) : *((uint16_t *) p);
+	} else {
+		return *((uint32_t *) p);
+	}
+}
+
+static void field_store(uint8_t * payload, const STORAGE_FIELD_t * field, uint32_t value) {
+	uint8_t * p = payload + field->offset;
+	if(field->size == 1) {
+		*p = value;
+	} else if(field->size == 2) {
+		*((uint16_t *) p) = value;
+	} else {
+		*((uint32_t *) p) = value;
+	}
+}
+
+static uint16_t varint_encode(uint8_t * data, uint32_t value, uint32_t prev) {
+	uint16_t len = 0;
+	int32_t delta = value - prev;
+	uint32_t zz = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+	while(zz >= 0x80) {
+		data[len++] = (zz & 0x7f) | 0x80;
+		zz >>= 7;
+	}
+	data[len++] = zz;
+	return len;
+}
+
+static uint8_t varint_decode(uint8_t * data, uint16_t len, uint16_t * pos, uint32_t * value, uint32_t prev) {
+	uint32_t zz = 0;
+	uint8_t shift = 0;
+	uint8_t d;
+	do {
+		if(*pos >= len || shift > 28) {
+			return 0;
+		}
+		d = data[(*pos)++];
+		zz |= (uint32_t) (d & 0x7f) << shift;
+		shift += 7;
+	} while(d & 0x80);
+	*value = prev + ((zz >> 1) ^ -(zz & 1));
+	return 1;
+}
+
+/*
+ * Encode an entry as zigzag varint deltas against prev (tick first, then the fields)
+ * returns the payload length
+ */
+static uint16_t record_encode(uint8_t * record, STORAGE_ENTRY_t * entry, uint32_t * prev) {
+	const STORAGE_SCHEMA_t * schema = &storage_schemas[entry->type];
+	uint16_t len = varint_encode(record, entry->tick, prev[0]);
+	prev[0] = entry->tick;
+	for(uint16_t i = 0; i < schema->nb_fields; i++) {
+		uint32_t value = field_load(entry->payload, &schema->fields[i]);
+		len += varint_encode(record+len, value, prev[i+1]);
+		prev[i+1] = value;
+	}
+	return len;
+}
+
+/*
+ * Decode a payload against prev
+ * returns 1 if the record is consistent
+ */
+static uint8_t record_decode(uint8_t * record, uint16_t len, uint8_t type, uint8_t * payload, uint32_t * tick, uint32_t * prev) {
+	const STORAGE_SCHEMA_t * schema = &storage_schemas[type];
+	uint16_t pos = 0;
+	if(!varint_decode(record, len, &pos, tick, prev[0])) {
+		return 0;
+	}
+	prev[0] = *tick;
+	for(uint16_t i = 0; i < schema->nb_fields; i++) {
+		if(!varint_decode(record, len, &pos, &prev[i+1], prev[i+1])) {
+			return 0;
+		}
+		field_store(payload, &schema->fields[i], prev[i+1]);
+	}
+	return pos == len;
+}
+
+/*
+ * Position a cursor at the start of a block
+ * returns 1 if the block contains a valid header
+ */
+static uint8_t cursor_open(STORAGE_CURSOR_t * cur, uint32_t block) {
+	STORAGE_BLOCK_HEADER_t header;
+	cur->valid = 0;
+	if(block >= nb_blocks || subsector_is_bad(BLOCK_ADDRESS(block))) {
+		return 0;
+	}
+	if(!block_header_read(BLOCK_ADDRESS(block), &header) || header.generation != log_generation) {
+		return 0;
+	}
+	cur->block = block;
+	cur->offset = sizeof(STORAGE_BLOCK_HEADER_t);
+	cur->id = header.first_id;
+	memset(cur->prev, 0, sizeof(cur->prev));
+	cur->valid = 1;
+	return 1;
+}
+
+/*
+ * Decode the record under the cursor and advance
+ * returns 0 at the end of the block
+ */
+static uint8_t cursor_next(STORAGE_CURSOR_t * cur, uint8_t * type, uint8_t * payload) {
+	static uint8_t record[RECORD_HEADER+RECORD_MAX_LEN];
+	uint32_t tick;
+	if(!cur->valid || cur->offset + RECORD_HEADER > SUBSECTOR_SIZE) {
+		return 0;
+	}
+	flash_read(BLOCK_ADDRESS(cur->block) + cur->offset, record, RECORD_HEADER);
+	*type = record[0];
+	uint8_t len = record[1];
+	if(*type >= STORAGE_TYPE_NUM || cur->offset + RECORD_HEADER + len > SUBSECTOR_SIZE) {
+		return 0;
+	}
+	if(*type != STORAGE_TYPE_SCHEMA) {
+		flash_read(BLOCK_ADDRESS(cur->block) + cur->offset + RECORD_HEADER, record, len);
+		if(!record_decode(record, len, *type, payload, &tick, cur->prev[*type])) {
+			return 0;
+		}
+	}
+	if(*type == STORAGE_TYPE_STATUS) {
+		((STORAGE_DATA_t *) payload)->sample_id = cur->id;
+		cur->id++;
+	}
+	cur->offset += RECORD_HEADER + len;
+	return 1;
+}
+
+/*
+ * Open the first valid block at or after a given block
+ */
+static uint8_t cursor_open_next(STORAGE_CURSOR_t * cur, uint32_t block) {
+	while(block < nb_blocks) {
+		if(cursor_open(cur, block)) {
+			return 1;
+		}
+		block++;
+	}
+	return 0;
+}
+
+/*
+ * Find the block containing a status id (blocks have increasing first ids)
+ * faulty blocks are skipped by probing the next valid one
+ */
+static uint8_t seek_block(STORAGE_CURSOR_t * cur, uint32_t id) {
+	uint32_t lo = 0;
+	uint32_t hi = nb_blocks;
+	while(hi - lo > 1) {
+		uint32_t mid = (lo + hi) / 2;
+		if(cursor_open_next(cur, mid) && cur->block < hi && cur->id <= id) {
+			lo = cur->block;
+		} else {
+			hi = mid;
+		}
+	}
+	return cursor_open_next(cur, lo);
+}
+
+static uint8_t read_data(uint32_t id, STORAGE_DATA_t * data) {
+	static uint8_t payload[STORAGE_MAX_PAYLOAD];
+	uint8_t found = 0;
+	uint8_t type;
+	if(storage_flash_mutex != NULL && xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+		if(id < data_counter) {
+			//sequential reads reuse the cursor, anything else needs a seek
+			if(!read_cursor.valid || read_cursor.id > id || id - read_cursor.id > READ_AHEAD_MAX) {
+				seek_block(&read_cursor, id);
+			}
+			while(read_cursor.valid) {
+				if(!cursor_next(&read_cursor, &type, payload)) {
+					if(!cursor_open_next(&read_cursor, read_cursor.block+1)) {
+						break;
+					}
+					continue;
+				}
+				if(type == STORAGE_TYPE_STATUS && ((STORAGE_DATA_t *) payload)->sample_id == id) {
+					*data = *((STORAGE_DATA_t *) payload);
+					found = 1;
+					break;
+				}
+			}
+		}
+		xSemaphoreGive(storage_flash_mutex);
+	}
+	return found;
+}
+
+/*
+ * Append raw bytes to the current block
+ * a program fault retires the block, the writer continues in a new one
+ */
+static uint8_t block_append(uint8_t * data, uint16_t len) {
+	uint32_t address = BLOCK_ADDRESS(write_cursor.block);
+	if(!flash_write(address + write_cursor.offset, data, len)) {
+		subsector_mark_bad(address);
+		write_cursor.valid = 0;
+		return 0;
+	}
+	write_cursor.offset += len;
+	return 1;
+}
+
+/*
+ * Open a new block after the current one, skipping faulty subsectors
+ * returns 0 if the flash is full
+ */
+static uint8_t block_open(void) {
+	STORAGE_BLOCK_HEADER_t header;
+	write_cursor.valid = 0;
+	while(nb_blocks < NB_DATA) {
+		uint32_t block = nb_blocks++;
+		uint32_t address = BLOCK_ADDRESS(block);
+		if(subsector_is_bad(address)) {
+			continue;
+		}
+		//carry the erase count over from the previous owner of the subsector,
+		//the highest known count is the best guess when its header is unreadable
+		uint32_t erase_count = block_header_read(address, &header) ? header.erase_count : erase_max;
+		header.magic = BLOCK_MAGIC;
+		header.version = STORAGE_VERSION;
+		header.first_id = data_counter;
+		header.generation = log_generation;
+		header.erase_count = erase_count + 1;
+		if(header.erase_count > erase_max) {
+			erase_max = header.erase_count;
+		}
+		if(!flash_erase_subsector(address) || !flash_write(address, (uint8_t *) &header, sizeof(STORAGE_BLOCK_HEADER_t))) {
+			subsector_mark_bad(address);
+			continue;
+		}
+		cursor_open(&write_cursor, block);
+		if(!schema_written) {
+			write_schemas();
+			schema_written = write_cursor.valid;
+			if(!write_cursor.valid) {
+				continue;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Describe every record type at the start of the log
+ */
+static void write_schemas(void) {
+	static uint8_t record[RECORD_HEADER+RECORD_MAX_LEN];
+	for(uint8_t t = STORAGE_TYPE_SCHEMA+1; t < STORAGE_TYPE_NUM; t++) {
+		const STORAGE_SCHEMA_t * schema = &storage_schemas[t];
+		uint16_t len = RECORD_HEADER;
+		record[len++] = t;
+		record[len++] = schema->nb_fields;
+		strncpy((char *) record+len, schema->name, SCHEMA_NAME_LEN);
+		len += SCHEMA_NAME_LEN;
+		for(uint8_t i = 0; i < schema->nb_fields; i++) {
+			record[len++] = schema->fields[i].size | (schema->fields[i].is_signed ? SCHEMA_SIGNED : 0);
+			strncpy((char *) record+len, schema->fields[i].name, SCHEMA_NAME_LEN);
+			len += SCHEMA_NAME_LEN;
+		}
+		record[0] = STORAGE_TYPE_SCHEMA;
+		record[1] = len - RECORD_HEADER;
+		if(!block_append(record, len)) {
+			return;
+		}
+	}
+}
+
+static void write_record(STORAGE_ENTRY_t * entry) {
+	static uint8_t record[RECORD_HEADER+RECORD_MAX_LEN];
+	if(xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+		uint32_t prev[MAX_FIELDS+1];
+		uint16_t len = 0;
+		do {
+			if(write_cursor.valid) {
+				memcpy(prev, write_cursor.prev[entry->type], sizeof(prev));
+				len = record_encode(record+RECORD_HEADER, entry, prev);
+			}
+			if(!write_cursor.valid || write_cursor.offset + RECORD_HEADER + len > SUBSECTOR_SIZE) {
+				//open a new block, starting with keyframes
+				if(!block_open()) {
+					xSemaphoreGive(storage_flash_mutex);
+					return;
+				}
+				memcpy(prev, write_cursor.prev[entry->type], sizeof(prev));
+				len = record_encode(record+RECORD_HEADER, entry, prev);
+			}
+			record[0] = entry->type;
+			record[1] = len;
+		} while(!block_append(record, RECORD_HEADER + len));
+		memcpy(write_cursor.prev[entry->type], prev, sizeof(prev));
+		if(entry->type == STORAGE_TYPE_STATUS) {
+			write_cursor.id++;
+			data_counter++;
+		}
+		xSemaphoreGive(storage_flash_mutex);
+	}
+}
+
+/*
+ * Put the flash back in memory-mapped mode once the writes are over
+ */
+static void storage_map(void) {
+	if(!flash_mmap_active() && xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+		flash_mmap_enable();
+		xSemaphoreGive(storage_flash_mutex);
 	}
-	flash_write(addr, (uint8_t *) &data, sizeof(STORAGE_DATA_t));
 }
 
 uint32_t storage_get_used() {
 	return data_counter;
 }
 
+uint32_t storage_get_used_bytes() {
+	if(write_cursor.valid) {
+		return write_cursor.block*SUBSECTOR_SIZE + write_cursor.offset;
+	} else {
+		return nb_blocks*SUBSECTOR_SIZE;
+	}
+}
+
 void storage_get_sample(uint32_t id, void * dest) {
-	*((STORAGE_DATA_t *)dest) = read_data(id);
+	STORAGE_DATA_t data;
+	if(!read_data(id, &data)) {
+		memset(&data, 0xff, sizeof(STORAGE_DATA_t));
+	}
+	*((STORAGE_DATA_t *)dest) = data;
+}
+
+/*
+ * Read the selected session as one contiguous stream of blocks
+ * a read never crosses a block, since consecutive blocks may not be adjacent
+ */
+uint32_t storage_get_raw(uint32_t offset, uint8_t * dest, uint32_t length) {
+	uint32_t used = nb_blocks*SUBSECTOR_SIZE;
+	uint32_t start = log_start;
+	if(storage_flash_mutex != NULL && xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+		STORAGE_SESSION_t session;
+		if(selected_session != STORAGE_SESSION_CURRENT && selected_session != log_generation) {
+			flash_read(SESSION_ENTRY(selected_session), (uint8_t *) &session, sizeof(STORAGE_SESSION_t));
+			start = SUBSECTOR(session.start - DATA_START);
+			used = session.length;
+		}
+		if(offset >= used) {
+			xSemaphoreGive(storage_flash_mutex);
+			return 0;
+		}
+		if(offset % SUBSECTOR_SIZE + length > SUBSECTOR_SIZE) {
+			length = SUBSECTOR_SIZE - offset % SUBSECTOR_SIZE;
+		}
+		flash_read(LOG_ADDRESS(start, offset / SUBSECTOR_SIZE) + offset % SUBSECTOR_SIZE, dest, length);
+		xSemaphoreGive(storage_flash_mutex);
+		return length;
+	}
+	return 0;
+}
+
+/*
+ * Get a session of the table, index 0 is the current one
+ * returns 0 past the oldest session still readable
+ */
+uint8_t storage_get_session(uint32_t index, STORAGE_SESSION_t * session) {
+	uint8_t found = 0;
+	if(storage_flash_mutex != NULL && xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+		if(index < session_count) {
+			flash_read(SESSION_ENTRY(session_count-1-index), (uint8_t *) session, sizeof(STORAGE_SESSION_t));
+			if(index == 0) {
+				session->length = nb_blocks*SUBSECTOR_SIZE;
+			}
+			found = session_available(session);
+		}
+		xSemaphoreGive(storage_flash_mutex);
+	}
+	return found;
+}
+
+/*
+ * Choose the session served by storage_get_raw
+ * STORAGE_SESSION_CURRENT follows the current session across restarts
+ */
+uint8_t storage_select_session(uint32_t id, uint32_t * length) {
+	STORAGE_SESSION_t session;
+	for(uint32_t i = 0; storage_get_session(i, &session); i++) {
+		if(id == STORAGE_SESSION_CURRENT || session.id == id) {
+			selected_session = (i == 0) ? STORAGE_SESSION_CURRENT : session_count-1-i;
+			*length = session.length;
+			return 1;
+		}
+	}
+	return 0;
 }
 
 void storage_enable() {
@@ -208,14 +1059,31 @@ void storage_disable() {
 	record_should_stop = STORAGE_AFTER_SAVE;
 }
 
+/*
+ * Commit the pre-trigger ring to flash and start recording
+ * the recording stops STORAGE_AFTER_SAVE ms after the next storage_disable()
+ */
+void storage_trigger() {
+	taskENTER_CRITICAL();
+	if(!record_active) {
+		dump_required = 1;
+	}
+	record_should_stop = 0;
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * Start a new session, a storage_trigger() issued afterwards dumps the
+ * pre-trigger ring into the new session
+ */
 void storage_restart() {
+	taskENTER_CRITICAL();
 	restart_required = 1;
+	taskEXIT_CRITICAL();
 }
 
 void storage_notify() {
-	if(storage_sem != NULL) {
-		xSemaphoreGive(storage_sem);
-	}
+	storage_record_sample();
 }
 
 
@@ -227,6 +1095,9 @@ void storage_thread(void * arg) {
 
 	static uint32_t time;
 	static uint32_t last_time;
+	static STORAGE_ENTRY_t entry;
+	static uint8_t restart;
+	static uint8_t dump;
 
 
 
@@ -234,10 +1105,38 @@ void storage_thread(void * arg) {
 	for(;;) {
 		last_time = time;
 		time = HAL_GetTick();
-		if(restart_required) {
-			write_header_used(1);
-			data_counter = 0;
-			restart_required = 0;
+		//both requests are sampled together, so that a restart issued before a trigger
+		//is always applied before the dump
+		taskENTER_CRITICAL();
+		restart = restart_required;
+		dump = dump_required;
+		restart_required = 0;
+		dump_required = 0;
+		taskEXIT_CRITICAL();
+		if(restart) {
+			if(xSemaphoreTake(storage_flash_mutex, LONG_TIME) == pdTRUE) {
+				log_rotate();
+				data_counter = 0;
+				write_cursor.valid = 0;
+				read_cursor.valid = 0;
+				xSemaphoreGive(storage_flash_mutex);
+			}
+		}
+		if(dump) {
+			//the producers keep feeding the ring while it is written (the block erases
+			//would overflow the queue), the queue only takes over once the ring is empty
+			for(;;) {
+				while(pretrigger_pop(&entry)) {
+					write_record(&entry);
+				}
+				taskENTER_CRITICAL();
+				if(pretrigger_fill == 0) {
+					record_active = 1;
+					taskEXIT_CRITICAL();
+					break;
+				}
+				taskEXIT_CRITICAL();
+			}
 		}
 		if(record_should_stop) {
 			record_should_stop -= time-last_time;;
@@ -246,10 +1145,11 @@ void storage_thread(void * arg) {
 				record_should_stop=0;
 			}
 		}
-		if(xSemaphoreTake(storage_sem, 0xffff) == pdTRUE) {
-			if(record_active) {
-				storage_record_sample();
-			}
+		if(!record_active && uxQueueMessagesWaiting(storage_queue) == 0) {
+			storage_map();
+		}
+		if(xQueueReceive(storage_queue, &entry, QUEUE_TIMEOUT) == pdTRUE) {
+			write_record(&entry);
 		}
 	}
 }
@@ -257,5 +1157,3 @@ void storage_thread(void * arg) {
 
 
 /* END */
-
-
@@ -19,6 +19,8 @@
 #include <serial.h>
 #include <debug.h>
 #include <pipeline.h>
+#include <servo.h>
+#include <cm4.h>
 
 #include <can_comm.h>
 
@@ -42,6 +44,15 @@
 #define CAN_SZ		DEFAULT_SZ
 #define CAN_PRIO		(3)
 
+#define STREAM_SZ	DEFAULT_SZ
+#define STREAM_PRIO		(2)
+
+#define SERVO_SZ	DEFAULT_SZ
+#define SERVO_PRIO		(4)
+
+#define CM4_SZ		DEFAULT_SZ
+#define CM4_PRIO		(3)
+
 
 /**********************
  *	MACROS
@@ -73,6 +84,9 @@ static TaskHandle_t control_handle = NULL;
 static TaskHandle_t serial_handle = NULL;
 static TaskHandle_t storage_handle = NULL;
 static TaskHandle_t pipeline_handle = NULL;
+static TaskHandle_t stream_handle = NULL;
+static TaskHandle_t servo_handle = NULL;
+static TaskHandle_t cm4_handle = NULL;
 
 
 /**********************
@@ -96,6 +110,8 @@ void threads_init(void) {
 
 	can_init();
 
+	servo_global_init();
+
 
 	/*
 	 *  Feedback thread
@@ -111,6 +127,18 @@ void threads_init(void) {
 
 	CREATE_THREAD(storage_handle, storage, storage_thread, STORAGE_SZ, STORAGE_PRIO);
 
+	/*
+	 * Debug log stream thread
+	 * below storage, only active during downloads
+	 */
+	CREATE_THREAD(stream_handle, stream, debug_stream_thread, STREAM_SZ, STREAM_PRIO);
+
+	/*
+	 *  Servo bus thread
+	 *  below the serial thread which decodes the servo answers
+	 */
+	CREATE_THREAD(servo_handle, servo, servo_bus_thread, SERVO_SZ, SERVO_PRIO);
+
 	/*
 	 *  Serial RX processing thread (Bottom half)
 	 *  low priority
@@ -129,6 +157,12 @@ void threads_init(void) {
 	 */
 	CREATE_THREAD(pipeline_handle, pipeline, pipeline_thread, CAN_SZ, CAN_PRIO);
 
+	/*
+	 *  cm4 link thread
+	 *  blocking transactions with the cm4, out of the control loop
+	 */
+	CREATE_THREAD(cm4_handle, cm4, cm4_link_thread, CM4_SZ, CM4_PRIO);
+
 
 }
 
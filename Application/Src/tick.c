@@ -0,0 +1,137 @@
+/*  Title		: Tick
+ *  Filename	: tick.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: hardware timer releasing the control thread
+ *
+ *	TIM2 counts microseconds and notifies the registered task at each update,
+ *	so the control period does not depend on configTICK_RATE_HZ.
+ *	The task waits with ulTaskNotifyTake, a count above one means that
+ *	releases were missed.
+ *	The period can be changed at runtime, the auto-reload register is
+ *	preloaded so the change takes effect at the end of the current period.
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <main.h>
+#include <tick.h>
+
+/**********************
+ *	CONFIGURATION
+ **********************/
+
+#define TICK_TIM			TIM2
+#define TICK_IRQn			TIM2_IRQn
+
+//highest priority allowed to call the FreeRTOS API
+#define TICK_IRQ_PRIORITY	(configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY)
+
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+#define TICK_COUNTER_FREQ	(1000000)
+
+
+/**********************
+ *	MACROS
+ **********************/
+
+
+/**********************
+ *	TYPEDEFS
+ **********************/
+
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static TaskHandle_t tick_task = NULL;
+static volatile uint32_t tick_period = 0;
+static volatile uint32_t tick_count = 0;
+
+
+/**********************
+ *	PROTOTYPES
+ **********************/
+
+static uint32_t tick_timer_clock(void);
+
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+/*
+ * TIM2 sits on APB1, its clock is doubled when the bus is divided
+ */
+static uint32_t tick_timer_clock(void) {
+	uint32_t clock = HAL_RCC_GetPCLK1Freq();
+	if((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_CFGR_PPRE1_DIV1) {
+		clock *= 2;
+	}
+	return clock;
+}
+
+/*
+ * Registers the task to release and starts the timer
+ * period in us
+ */
+void tick_start(TaskHandle_t task, uint32_t period) {
+	if(period < TICK_MIN_PERIOD || period > TICK_MAX_PERIOD) {
+		period = TICK_MAX_PERIOD;
+	}
+	tick_task = task;
+	tick_period = period;
+	__HAL_RCC_TIM2_CLK_ENABLE();
+	TICK_TIM->CR1 = 0;
+	TICK_TIM->PSC = tick_timer_clock() / TICK_COUNTER_FREQ - 1;
+	TICK_TIM->ARR = period - 1;
+	TICK_TIM->CNT = 0;
+	TICK_TIM->EGR = TIM_EGR_UG; //load the prescaler
+	TICK_TIM->SR = 0;
+	TICK_TIM->DIER = TIM_DIER_UIE;
+	HAL_NVIC_SetPriority(TICK_IRQn, TICK_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(TICK_IRQn);
+	TICK_TIM->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+}
+
+/*
+ * period in us, returns 0 if it is out of range
+ */
+uint8_t tick_set_period(uint32_t period) {
+	if(period < TICK_MIN_PERIOD || period > TICK_MAX_PERIOD) {
+		return 0;
+	}
+	tick_period = period;
+	TICK_TIM->ARR = period - 1;
+	return 1;
+}
+
+uint32_t tick_get_period(void) {
+	return tick_period;
+}
+
+uint32_t tick_get_count(void) {
+	return tick_count;
+}
+
+void TIM2_IRQHandler(void) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	if(TICK_TIM->SR & TIM_SR_UIF) {
+		TICK_TIM->SR = (uint32_t) ~TIM_SR_UIF; //rc_w0
+		tick_count++;
+		if(tick_task != NULL) {
+			vTaskNotifyGiveFromISR(tick_task, &xHigherPriorityTaskWoken);
+		}
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+
+
+/* END */
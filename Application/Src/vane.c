@@ -0,0 +1,166 @@
+/*  Title		: Vane
+ *  Filename	: vane.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: TVC vane control
+ *
+ *	The control thread passes the vane setpoints of the current cycle
+ *	(see setpoint.c, which smooths the CM4 commands between updates).
+ *	The output is rate and position limited before being posted to the
+ *	servo bus. Without valid setpoints the vanes go back to neutral.
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <cmsis_os.h>
+#include <vane.h>
+
+/**********************
+ *	CONFIGURATION
+ **********************/
+
+//servo ticks (4096 per turn), +/-45 degrees around neutral
+#define VANE_MIN_POSITION	(VANE_NEUTRAL - 512)
+#define VANE_MAX_POSITION	(VANE_NEUTRAL + 512)
+
+#define VANE_MAX_RATE		(2048) /* ticks/s */
+
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+//longest step of the rate limit
+#define VANE_MAX_DT			(100) /* ms */
+
+
+/**********************
+ *	MACROS
+ **********************/
+
+
+/**********************
+ *	TYPEDEFS
+ **********************/
+
+typedef struct VANE_INST {
+	SERVO_INST_t * servos[VANE_COUNT];
+	uint8_t active;
+	uint8_t started;
+	uint32_t last_update;
+	uint32_t step_rest; //fraction of a tick left by the previous updates, ticks/1000
+	int32_t output[VANE_COUNT];
+}VANE_INST_t;
+
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static VANE_INST_t vane = {0};
+
+
+/**********************
+ *	PROTOTYPES
+ **********************/
+
+static int32_t vane_clamp(int32_t value, int32_t min, int32_t max);
+
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+static int32_t vane_clamp(int32_t value, int32_t min, int32_t max) {
+	if(value < min) {
+		return min;
+	}
+	if(value > max) {
+		return max;
+	}
+	return value;
+}
+
+void vane_init(SERVO_INST_t ** servos) {
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		vane.servos[i] = servos[i];
+		vane.output[i] = VANE_NEUTRAL;
+	}
+	vane.started = 0;
+	vane.active = 1;
+}
+
+/*
+ * Called by the control thread at each cycle while the vanes are controlled
+ * targets is NULL when there is no valid setpoint
+ */
+void vane_update(uint32_t time, int32_t * targets) {
+	if(!vane.active) {
+		return;
+	}
+
+	if(!vane.started) {
+		//start from where the vanes are
+		for(uint8_t i = 0; i < VANE_COUNT; i++) {
+			SERVO_TELEMETRY_t telemetry = servo_get_telemetry(vane.servos[i]);
+			if(telemetry.time) {
+				vane.output[i] = vane_clamp(telemetry.position, VANE_MIN_POSITION, VANE_MAX_POSITION);
+			}
+		}
+		vane.last_update = time;
+		vane.step_rest = 0;
+	}
+
+	//the period can be shorter than the ms of the time, the fraction of a tick
+	//allowed by each update is carried over to the next ones
+	uint32_t dt = vane_clamp(time - vane.last_update, 0, VANE_MAX_DT);
+	vane.last_update = time;
+	uint32_t budget = VANE_MAX_RATE * dt + vane.step_rest;
+	int32_t max_step = budget / 1000;
+	vane.step_rest = budget % 1000;
+
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		int32_t target = targets != NULL ? targets[i] : VANE_NEUTRAL;
+		int32_t output = vane.output[i] + vane_clamp(target - vane.output[i], -max_step, max_step);
+		output = vane_clamp(output, VANE_MIN_POSITION, VANE_MAX_POSITION);
+		if(output != vane.output[i] || !vane.started) {
+			vane.output[i] = output;
+			servo_set_target(vane.servos[i], output);
+		}
+	}
+	vane.started = 1;
+}
+
+/*
+ * Straight vanes at once, without rate limit
+ */
+void vane_neutral(void) {
+	if(!vane.active) {
+		return;
+	}
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		vane.output[i] = VANE_NEUTRAL;
+		servo_set_target(vane.servos[i], VANE_NEUTRAL);
+	}
+	//the next update starts from the telemetry
+	vane.started = 0;
+}
+
+/*
+ * Measured positions
+ * returns 0 and leaves positions untouched when the vanes are not controlled
+ */
+uint8_t vane_get_positions(int32_t * positions) {
+	if(!vane.active) {
+		return 0;
+	}
+	for(uint8_t i = 0; i < VANE_COUNT; i++) {
+		positions[i] = servo_get_telemetry(vane.servos[i]).position;
+	}
+	return 1;
+}
+
+
+/* END */
@@ -81,6 +81,7 @@ void Error_Handler(void);
 #define GLOBAL_EN_Pin GPIO_PIN_11
 #define GLOBAL_EN_GPIO_Port GPIOA
 /* USER CODE BEGIN Private defines */
+#define FIRMWARE_VERSION	(0x0105) //major << 8 | minor
 
 /* USER CODE END Private defines */
 
@@ -0,0 +1,58 @@
+# This Python file uses the following encoding: utf-8
+#
+# Converts a columnar log (see log_store.py) to csv files
+#
+# usage: python log_export.py remote0.hbcol [-s stream] [--from t0] [--to t1] [-i]
+#   every stream is written to <file>_<stream>.csv unless one is selected
+#   -i only prints the streams, their size and the limits of each column
+
+import argparse
+import os
+import sys
+
+import numpy as np
+
+import log_store
+
+
+def export(reader, stream, filename, t0=None, t1=None):
+    table = reader.table(stream, t0, t1)
+    with open(filename, 'w') as file:
+        #same format as the csv written by the control station
+        file.write(';'.join(reader.columns(stream)) + '\n')
+        np.savetxt(file, table, fmt='%d', delimiter=';')
+    return len(table)
+
+
+def info(reader):
+    for stream in reader.streams():
+        print("{}: {} rows".format(stream, reader.rows(stream)))
+        for name in reader.columns(stream):
+            print("    {:<12} {} .. {}".format(name, *reader.limits(stream, name)))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Export a downloaded log to csv")
+    parser.add_argument('file')
+    parser.add_argument('-s', '--stream', action='append', help="stream to export (all by default)")
+    parser.add_argument('--from', dest='t0', type=int, help="first time to export")
+    parser.add_argument('--to', dest='t1', type=int, help="last time to export")
+    parser.add_argument('-i', '--info', action='store_true', help="only describe the file")
+    args = parser.parse_args(argv)
+
+    reader = log_store.Reader(args.file)
+    if args.info:
+        info(reader)
+        return 0
+    base = os.path.splitext(args.file)[0]
+    for stream in args.stream or reader.streams():
+        if stream not in reader.streams():
+            print("no stream {}".format(stream))
+            return 1
+        filename = "{}_{}.csv".format(base, stream)
+        print("{}: {} rows".format(filename, export(reader, stream, filename, args.t0, args.t1)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,223 @@
+# This Python file uses the following encoding: utf-8
+#
+# Decoder for the compressed flash log (see Application/Src/storage.c)
+#
+# The log is a sequence of 4096 bytes blocks:
+#   block header: magic (u16), version (u16), first status id (u32),
+#                 generation (u32), erase count (u32) since version 4
+#   records: [type (u8)][len (u8)][len bytes of payload], 0xff type ends the block
+# Data payloads are zigzag varints: the tick then the fields of the type,
+# each as a delta against the previous record of the same type in the block,
+# the first record of each type in a block is stored against zero.
+# Schema records (type 0) at the start of the log describe the other types,
+# the built-in table is used when they are missing.
+# Blocks of another generation (faulty subsectors left in the log) are skipped.
+# Version 5 only changes the header subsector (session table), blocks are unchanged.
+# Version 6 adds the erase count to the session table, blocks are unchanged.
+
+import struct
+
+BLOCK_SIZE = 4096
+BLOCK_MAGIC = 0xB10C
+BLOCK_HEADER = "HHI"
+BLOCK_HEADER_LEN = struct.calcsize(BLOCK_HEADER)
+BLOCK_HEADER_V4 = "HHIII"
+RECORD_END = 0xff
+
+SUPPORTED_VERSIONS = [2, 3, 4, 5, 6]
+
+TYPE_SCHEMA = 0
+TYPE_STATUS = 1
+NAME_LEN = 8
+SCHEMA_SIGNED = 0x80
+
+# version 2 logs only contain status samples, (name, bits, signed) in record order
+FIELDS = [
+    ('hb_state', 8, False),
+    ('cm4_state', 8, False),
+    ('pp_thrust', 32, True),
+    ('av_alti', 32, True),
+    ('tvc_thrust', 32, True),
+    ('tvc_alti', 32, True),
+    ('tvc_vel', 32, True),
+    ('time', 32, False),
+]
+
+# built-in schemas since version 3, {type: (stream name, fields)}
+SCHEMAS = {
+    TYPE_STATUS: ('status', FIELDS),
+    2: ('sensor', [('timestamp', 32, False), ('acc_x', 32, True), ('acc_y', 32, True),
+                   ('acc_z', 32, True), ('gyro_x', 32, True), ('gyro_y', 32, True),
+                   ('gyro_z', 32, True), ('baro', 32, True), ('alti', 32, True)]),
+    3: ('command', [('timestamp', 32, False), ('thrust', 32, True),
+                    ('dyn_0', 32, True), ('dyn_1', 32, True), ('dyn_2', 32, True), ('dyn_3', 32, True),
+                    ('pos_x', 32, True), ('pos_y', 32, True), ('pos_z', 32, True),
+                    ('vel_x', 32, True), ('vel_y', 32, True), ('vel_z', 32, True),
+                    ('state', 16, False)]),
+    4: ('feedback', [('timestamp', 32, False), ('cc_pressure', 32, True),
+                     ('dyn_0', 32, True), ('dyn_1', 32, True), ('dyn_2', 32, True), ('dyn_3', 32, True)]),
+    5: ('can', [('id', 8, False), ('data', 32, False), ('timestamp', 32, False), ('board', 32, False)]),
+    6: ('state', [('from', 8, False), ('to', 8, False)]),
+    7: ('health', [('source', 8, False), ('state', 8, False), ('age', 32, False), ('threshol', 32, False)]),
+    8: ('timing', [('overruns', 32, False), ('late', 32, False), ('jit_min', 32, True),
+                   ('jit_max', 32, True), ('exec_max', 32, False)]),
+}
+
+
+def wrap(value, bits, signed):
+    value &= (1 << bits) - 1
+    if signed and value >= 1 << (bits - 1):
+        value -= 1 << bits
+    return value
+
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while 1:
+        if pos >= len(data) or shift > 28:
+            raise ValueError("truncated varint")
+        d = data[pos]
+        pos += 1
+        value |= (d & 0x7f) << shift
+        shift += 7
+        if not d & 0x80:
+            return value, pos
+
+
+def unzigzag(zz):
+    return (zz >> 1) ^ -(zz & 1)
+
+
+def read_name(data):
+    return bytes(data[:NAME_LEN]).split(b'\0')[0].decode('ascii', 'replace')
+
+
+def parse_schema(record, schemas):
+    """Replace the built-in schema of a type with the one stored in the log."""
+    rtype, nb_fields = record[0], record[1]
+    name = read_name(record[2:])
+    fields = []
+    pos = 2 + NAME_LEN
+    for _ in range(nb_fields):
+        code = record[pos]
+        fields.append((read_name(record[pos+1:]), (code & 0x7f)*8, bool(code & SCHEMA_SIGNED)))
+        pos += 1 + NAME_LEN
+    schemas[rtype] = (name, fields)
+
+
+def status_row(sample_id, values):
+    #data_id, hb_state, cm4_state, pp_thrust, av_alti, tvc_thrust, tvc_alti, tvc_vel, padding, time
+    return [sample_id] + values[:7] + [0, values[7]]
+
+
+def decode_block_v2(block, first_id, pos):
+    samples = []
+    prev = [0]*len(FIELDS)
+    sample_id = first_id
+    while pos < len(block):
+        length = block[pos]
+        if length == RECORD_END or pos + 1 + length > len(block):
+            break
+        record = block[pos+1:pos+1+length]
+        rpos = 0
+        try:
+            for i, (name, bits, signed) in enumerate(FIELDS):
+                zz, rpos = read_varint(record, rpos)
+                prev[i] = wrap(prev[i] + unzigzag(zz), bits, signed)
+        except ValueError:
+            break
+        samples.append(status_row(sample_id, prev))
+        sample_id += 1
+        pos += 1 + length
+    return {'status': samples}
+
+
+def decode_block_v3(block, first_id, schemas, pos):
+    streams = {}
+    prev = {}
+    sample_id = first_id
+    while pos + 2 <= len(block):
+        rtype, length = block[pos], block[pos+1]
+        if rtype == RECORD_END or pos + 2 + length > len(block):
+            break
+        record = block[pos+2:pos+2+length]
+        pos += 2 + length
+        if rtype == TYPE_SCHEMA:
+            parse_schema(record, schemas)
+            continue
+        if rtype not in schemas:
+            break
+        name, fields = schemas[rtype]
+        values = prev.setdefault(rtype, [0]*(len(fields)+1))
+        rpos = 0
+        try:
+            zz, rpos = read_varint(record, rpos)
+            values[0] = wrap(values[0] + unzigzag(zz), 32, False)
+            for i, (fname, bits, signed) in enumerate(fields):
+                zz, rpos = read_varint(record, rpos)
+                values[i+1] = wrap(values[i+1] + unzigzag(zz), bits, signed)
+        except ValueError:
+            break
+        if rtype == TYPE_STATUS:
+            streams.setdefault(name, []).append(status_row(sample_id, values[1:]))
+            sample_id += 1
+        else:
+            streams.setdefault(name, []).append(list(values))
+    return streams
+
+
+def block_header(block):
+    """Returns (version, first_id, generation, erase_count) or None if the block is not valid."""
+    if len(block) < BLOCK_HEADER_LEN:
+        return None
+    magic, version, first_id = struct.unpack(BLOCK_HEADER, bytes(block[:BLOCK_HEADER_LEN]))
+    if magic != BLOCK_MAGIC or version not in SUPPORTED_VERSIONS:
+        return None
+    if version < 4:
+        return version, first_id, 0, 0
+    if len(block) < struct.calcsize(BLOCK_HEADER_V4):
+        return None
+    return struct.unpack(BLOCK_HEADER_V4, bytes(block[:struct.calcsize(BLOCK_HEADER_V4)]))[1:]
+
+
+def decode_block(block, schemas=None, generation=None):
+    """Decode one block, returns {stream name: rows}.
+    status rows follow the remote_labels order, other rows are [tick] + fields."""
+    if schemas is None:
+        schemas = dict(SCHEMAS)
+    header = block_header(block)
+    if header is None:
+        return {}
+    version, first_id, gen, erase_count = header
+    if generation is not None and gen != generation:
+        return {}
+    if version == 2:
+        return decode_block_v2(block, first_id, BLOCK_HEADER_LEN)
+    if version == 3:
+        return decode_block_v3(block, first_id, schemas, BLOCK_HEADER_LEN)
+    return decode_block_v3(block, first_id, schemas, struct.calcsize(BLOCK_HEADER_V4))
+
+
+def stream_header(schemas, name):
+    """Column names of a stream (other than status)."""
+    for sname, fields in schemas.values():
+        if sname == name:
+            return ['tick'] + [f[0] for f in fields]
+    return []
+
+
+def decode(data, schemas=None, generation=None):
+    """Decode a raw log dump starting at the first block.
+    The generation is taken from the first valid block when not given."""
+    if schemas is None:
+        schemas = dict(SCHEMAS)
+    streams = {}
+    for i in range(0, len(data), BLOCK_SIZE):
+        if generation is None:
+            header = block_header(data[i:i+BLOCK_SIZE])
+            if header is not None:
+                generation = header[2]
+        for name, rows in decode_block(data[i:i+BLOCK_SIZE], schemas, generation).items():
+            streams.setdefault(name, []).extend(rows)
+    return streams
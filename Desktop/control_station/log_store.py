@@ -0,0 +1,155 @@
+# This Python file uses the following encoding: utf-8
+#
+# Columnar storage of the downloaded logs
+#
+# File layout (little endian):
+#   magic "HBCOL" (5 bytes), version (u8), header length (u32)
+#   json header, padded with spaces to a multiple of 8 bytes
+#   the columns of every stream, each as one contiguous array
+# The header describes each stream:
+#   {"streams": {name: {"rows": n, "time": time column,
+#                       "columns": [{"name", "dtype", "offset", "min", "max"}],
+#                       "index": {"stride", "offset", "count"}}}}
+# The index holds the time of every stride-th row, a time range is located by
+# a binary search in it, only the matching rows of the columns are then read.
+# Offsets are relative to the start of the data (after the header).
+
+import json
+import os
+import struct
+
+import numpy as np
+
+MAGIC = b'HBCOL'
+VERSION = 1
+PREAMBLE = "<5sBI"
+PREAMBLE_LEN = struct.calcsize(PREAMBLE)
+ALIGN = 8
+INDEX_STRIDE = 256
+INDEX_DTYPE = '<i8'
+
+# smallest type able to hold a column
+DTYPES = ['<i1', '<i2', '<i4', '<i8']
+
+
+def column_dtype(lo, hi):
+    for dtype in DTYPES:
+        info = np.iinfo(dtype)
+        if info.min <= lo and hi <= info.max:
+            return dtype
+    return DTYPES[-1]
+
+
+def time_column(header):
+    for name in ('time', 'tick'):
+        if name in header:
+            return name
+    return header[0]
+
+
+class Writer:
+    """Collects the rows of each stream during a download, the file is written on close."""
+    def __init__(self, filename):
+        self.filename = filename
+        self.headers = {}
+        self.rows = {}
+
+    def append(self, stream, header, rows):
+        if stream not in self.headers:
+            self.headers[stream] = list(header)
+            self.rows[stream] = []
+        self.rows[stream].extend(rows)
+
+    def close(self):
+        streams = {}
+        blobs = []
+        offset = 0
+        for stream, header in self.headers.items():
+            rows = self.rows[stream]
+            table = np.array(rows, dtype=np.int64).reshape(len(rows), len(header))
+            columns = []
+            for i, name in enumerate(header):
+                data = table[:, i]
+                lo = int(data.min()) if len(data) else 0
+                hi = int(data.max()) if len(data) else 0
+                dtype = column_dtype(lo, hi)
+                blob = data.astype(dtype).tobytes()
+                columns.append({'name': name, 'dtype': dtype, 'offset': offset, 'min': lo, 'max': hi})
+                blobs.append(blob)
+                offset += len(blob)
+                blobs.append(b'\0'*(-offset % ALIGN))
+                offset += -offset % ALIGN
+            time = time_column(header)
+            index = table[::INDEX_STRIDE, header.index(time)].astype(INDEX_DTYPE).tobytes()
+            streams[stream] = {'rows': len(rows), 'time': time, 'columns': columns,
+                               'index': {'stride': INDEX_STRIDE, 'offset': offset, 'count': len(index)//8}}
+            blobs.append(index)
+            offset += len(index)
+        text = json.dumps({'streams': streams}).encode('ascii')
+        text += b' '*(-(PREAMBLE_LEN + len(text)) % ALIGN)
+        tmp = self.filename + '.tmp'
+        with open(tmp, 'wb') as file:
+            file.write(struct.pack(PREAMBLE, MAGIC, VERSION, len(text)))
+            file.write(text)
+            for blob in blobs:
+                file.write(blob)
+        os.replace(tmp, self.filename)
+
+
+class Reader:
+    """Columns are memory mapped, nothing is read before it is used."""
+    def __init__(self, filename):
+        with open(filename, 'rb') as file:
+            magic, version, length = struct.unpack(PREAMBLE, file.read(PREAMBLE_LEN))
+            if magic != MAGIC or version != VERSION:
+                raise ValueError("not a columnar log: {}".format(filename))
+            self.header = json.loads(file.read(length).decode('ascii'))
+        self.data = np.memmap(filename, dtype=np.uint8, mode='r', offset=PREAMBLE_LEN + length)
+
+    def streams(self):
+        return list(self.header['streams'])
+
+    def columns(self, stream):
+        return [c['name'] for c in self.header['streams'][stream]['columns']]
+
+    def rows(self, stream):
+        return self.header['streams'][stream]['rows']
+
+    def limits(self, stream, name):
+        """(min, max) of a column without reading it."""
+        for c in self.header['streams'][stream]['columns']:
+            if c['name'] == name:
+                return c['min'], c['max']
+        raise KeyError(name)
+
+    def column(self, stream, name, start=0, stop=None):
+        desc = self.header['streams'][stream]
+        for c in desc['columns']:
+            if c['name'] == name:
+                stop = desc['rows'] if stop is None else min(stop, desc['rows'])
+                size = np.dtype(c['dtype']).itemsize
+                return self.data[c['offset'] + start*size:c['offset'] + stop*size].view(c['dtype'])
+        raise KeyError(name)
+
+    def time_range(self, stream, t0=None, t1=None):
+        """Rows [start, stop) with t0 <= time <= t1, the time column is assumed increasing."""
+        desc = self.header['streams'][stream]
+        start, stop = 0, desc['rows']
+        index = desc['index']
+        marks = self.data[index['offset']:index['offset'] + index['count']*8].view(INDEX_DTYPE)
+        stride = index['stride']
+        if t0 is not None:
+            lo = max(int(np.searchsorted(marks, t0, 'left')) - 1, 0)*stride
+            block = self.column(stream, desc['time'], lo, lo + 2*stride)
+            start = lo + int(np.searchsorted(block, t0, 'left'))
+        if t1 is not None:
+            hi = max(int(np.searchsorted(marks, t1, 'right')) - 1, 0)*stride
+            block = self.column(stream, desc['time'], hi, hi + 2*stride)
+            stop = hi + int(np.searchsorted(block, t1, 'right'))
+        return start, max(start, stop)
+
+    def table(self, stream, t0=None, t1=None):
+        """Rows of a stream as a 2d array in column order."""
+        start, stop = self.time_range(stream, t0, t1)
+        return np.stack([np.asarray(self.column(stream, name, start, stop), dtype=np.int64)
+                         for name in self.columns(stream)], axis=1)
@@ -1,6 +1,8 @@
 # File: main.py
 import sys
 import os
+import time
+import collections
 import platform
 import re
 from PySide2.QtUiTools import QUiLoader
@@ -12,12 +14,16 @@ import numpy as np
 
 import struct
 import msv2
+import log_format
+import log_store
 
 
 
 
 DATA_BUFFER_LEN = 500
 HEART_BEAT = 100
+FRAME_PERIOD = 50 #ui refresh [ms]
+SAMPLE_QUEUE_LEN = 1000
 
 
 SENSOR_REMOTE_BUFFER = 5
@@ -31,6 +37,7 @@ window = []
 worker = []
 
 total_data = 1
+total_bytes = 1
 
 #COMMANDS
 GET_STAT =  0x00
@@ -43,6 +50,27 @@ RECOVER =   0x06
 SENSOR_WRITE = 0x07
 COMMAND_READ = 0x08
 SENSOR_READ =  0x09
+FEEDBACK_WRITE = 0x0A
+DOWNLOAD_RAW = 0x0B
+SESSION_LIST = 0x0C
+SESSION_SELECT = 0x0D
+STREAM_START = 0x0E
+STREAM_ACK = 0x0F
+STREAM_STOP = 0x10
+BAUDRATE_SET = 0x11
+TELEMETRY = 0x12
+TELEMETRY_PUSH = 0x92
+
+DOWNLOAD_RAW_MAX = 256
+STREAM_MAX_TIMEOUTS = 10
+SESSION_LIST_MAX = 8
+SESSION_ENTRY = "IIIII" #id, start, length, start_tick, fw_version
+SESSION_CURRENT = -1
+TELEMETRY_HEAD = "HH" #seq, groups
+TELEMETRY_GROUPS = [24, 46, 28, 24] #status, command, sensors, feedback
+TELEMETRY_ALL = 0x0f
+TELEMETRY_POLL = 20 #ms
+TELEMETRY_RENEW = 1.0 #s, the board drops the subscription after 5s
 
 
 #MOVE MODES
@@ -92,13 +120,44 @@ def deg2dyn(deg):
 def dyn2deg(dyn):
     return round((dyn - 2048)*360/4096, 2)
 
+class Ring_buffer:
+    """Last DATA_BUFFER_LEN samples of a set of channels, filled once per ui frame."""
+    def __init__(self, channels, length=DATA_BUFFER_LEN):
+        self.length = length
+        self.time = np.zeros(length)
+        self.data = np.zeros((length, channels))
+        self.count = 0
+
+    def push(self, stamp, values):
+        i = self.count % self.length
+        self.time[i] = stamp
+        self.data[i] = values
+        self.count += 1
+
+    def ordered(self):
+        n = min(self.count, self.length)
+        idx = np.arange(self.count - n, self.count) % self.length
+        return self.time[idx], self.data[idx]
+
+    def decimated(self, points):
+        """At most points samples spread over the buffer, for plotting."""
+        t, d = self.ordered()
+        step = max(1, len(t) // points)
+        return t[::step], d[::step]
+
+
+status_buffer = Ring_buffer(9)
+command_buffer = Ring_buffer(12)
+sensor_buffer = Ring_buffer(7)
+
+
 @Slot()
 def connect_trig():
     device = window.connect_device.text()
     if connection_status == "DISCONNECTED":
-        serial_worker.ser_connect(device)
+        requests.connect_req.emit(device)
     else:
-        serial_worker.ser_disconnect()
+        requests.disconnect_req.emit()
         
 
 @Slot(str)
@@ -111,7 +170,7 @@ def connect_cb(stat):
 def tvc_motor_move_trig():
     target = deg2dyn(safe_float(window.tvc_motor_target.text()))
     bin_data = struct.pack("i", target)
-    serial_worker.send_generic(TVC_MOVE, bin_data)
+    requests.generic_req.emit(TVC_MOVE, bin_data)
 
 
 def transaction_auto_trig():
@@ -140,26 +199,26 @@ def transaction_trig():
                                 baro)
 
 
-        serial_worker.send_generic(SENSOR_WRITE, bin_data)
+        requests.generic_req.emit(SENSOR_WRITE, bin_data)
 
 def boot_trig():
-    serial_worker.send_generic(BOOT, [0x00, 0x00])
+    requests.generic_req.emit(BOOT, [0x00, 0x00])
 
 def shutdown_trig():
-    serial_worker.send_generic(SHUTDOWN, [0x00, 0x00])
+    requests.generic_req.emit(SHUTDOWN, [0x00, 0x00])
 
 def abort_trig():
-    serial_worker.send_generic(ABORT, [0x00, 0x00])
+    requests.generic_req.emit(ABORT, [0x00, 0x00])
 
 def recover_trig():
-    serial_worker.send_generic(RECOVER, [0x00, 0x00])
+    requests.generic_req.emit(RECOVER, [0x00, 0x00])
 
 def ping_trig():
-    serial_worker.send_ping()
+    requests.ping_req.emit()
 
 
-def id_2_mem(id):
-    usage = float(id)*32
+def bytes_2_mem(usage):
+    usage = float(usage)
     u_str = "B"
     u_flt = usage
     if(usage > 1000):
@@ -171,14 +230,35 @@ def id_2_mem(id):
     return "{:.3f} {}".format(u_flt, u_str)
 
 
+def refresh_cb():
+    #samples queued by the serial worker since the last frame go to the buffers,
+    #the widgets only show the latest one
+    samples = serial_worker.take_samples()
+    if not samples:
+        return
+    last = [None, None, None]
+    for stamp, stat, trans, sens in samples:
+        if(isinstance(stat, list) and len(stat) == 24):
+            last[0] = struct.unpack("HHiIiHBbI", bytes(stat))
+            status_buffer.push(stamp, last[0])
+        if(isinstance(trans, list) and len(trans) == 46):
+            last[1] = struct.unpack("i"+"iiii"+"iii"+"iii"+"H", bytes(trans))
+            command_buffer.push(stamp, last[1])
+        if(isinstance(sens, list) and len(sens) == 28):
+            last[2] = struct.unpack("iii"+"iii"+"i", bytes(sens))
+            sensor_buffer.push(stamp, last[2])
+    ping_cb(*last)
+
+
 def ping_cb(stat, trans, sens):
     global status_state
     global counter
     global total_data
+    global total_bytes
 
-    if(stat and len(stat) == 20):
-        data = struct.unpack("HHiIiHBb", bytes(stat))
-        #data [state, padding, counter, memory, tvc_pos, tvc_psu, tvc_error, tvc_temp]
+    if(stat is not None):
+        data = stat
+        #data [state, padding, counter, memory, tvc_pos, tvc_psu, tvc_error, tvc_temp, memory_bytes]
         state = data[0]
         status_state = state
         window.status_state.clear()
@@ -190,15 +270,15 @@ def ping_cb(stat, trans, sens):
 
         state_text = ['IDLE', 'BOOT', 'COMPUTE', 'SHUTDOWN', 'ABORT', 'ERROR']
         window.status_state.insert(state_text[state])
-        window.dl_used.setText(id_2_mem(data[3]))
-        print(id_2_mem(data[3]))
+        window.dl_used.setText(bytes_2_mem(data[8]))
         total_data = data[3]
+        total_bytes = data[8]
         window.tvc_psu.insert(str(data[5]/10))
         window.tvc_motor_current.insert(str(dyn2deg(data[4])))
         window.tvc_error.insert(hex(data[6]))
         window.tvc_temperature.insert(str(data[7]))
-    if(trans and len(trans) == 46):
-        data = struct.unpack("i"+"iiii"+"iii"+"iii"+"H", bytes(trans))
+    if(trans is not None):
+        data = trans
         window.trans_thrust.clear()
         window.trans_dyn_0.clear()
         window.trans_dyn_1.clear()
@@ -232,8 +312,8 @@ def ping_cb(stat, trans, sens):
 
         window.gnc_state.insert(fsm_states[data[11]])
 
-    if(sens and len(sens) == 28 and not window.emission.checkState()):
-        data = struct.unpack("iii"+"iii"+"i", bytes(sens))
+    if(sens is not None and not window.emission.checkState()):
+        data = sens
         window.trans_acc_x.clear()
         window.trans_acc_y.clear()
         window.trans_acc_z.clear()
@@ -300,57 +380,124 @@ def record_sample(data):
         data_sampled = 0
 
 def download_trig():
-    global rem_file
     fn = window.dl_name.text()
     if(fn == ''):
         fn = 'remote'
     num = 0
-    fnam = "{}{}.csv".format(fn, num);
+    fnam = "{}{}.hbcol".format(fn, num);
     while(os.path.isfile(fnam)):
         num += 1
-        fnam = "{}{}.csv".format(fn, num);
-    rem_file = open(fnam, 'w')
-    write_csv(rem_file, remote_labels)
-    serial_worker.download()
+        fnam = "{}{}.hbcol".format(fn, num);
+    session = window.dl_session.currentData()
+    if session is None:
+        session = SESSION_CURRENT
+    #columnar file written by the worker, converted to csv with log_export.py
+    requests.download_req.emit(session, fnam)
+
+
+def list_sessions_trig():
+    requests.sessions_req.emit()
+
+
+def sessions_cb(sessions):
+    window.dl_session.clear()
+    window.dl_session.addItem("current", SESSION_CURRENT)
+    for (sid, start, length, tick, fw) in sessions[1:]:
+        window.dl_session.addItem("#{} {} (fw {}.{})".format(sid, bytes_2_mem(length), fw >> 8, fw & 0xff), sid)
 
 
-def download_cb(data, cnt):
-    progress = cnt/total_data*100
-    print(progress)
-    print(data)
+def download_cb(cnt, total):
+    progress = min(cnt/max(total, 1)*100, 100)
     window.dl_bar.setValue(progress)
-    for d in data:
-        if(d[0] != 0xffff):
-            write_csv(rem_file, d)
-    if(cnt > total_data):
-        rem_file.close()
 
 
+class Serial_requests(QObject):
+    """Requests of the ui, queued to the worker thread."""
+    connect_req = Signal(str)
+    disconnect_req = Signal()
+    generic_req = Signal(int, object)
+    ping_req = Signal()
+    start_ping_req = Signal(int)
+    download_req = Signal(int, str)
+    sessions_req = Signal()
+
 
 class Serial_worker(QObject):
-    update_status_sig = Signal(list, list, list) #status
     connect_sig = Signal(str)
-    download_sig = Signal(list, int)
+    download_sig = Signal(int, int) #progress
+    sessions_sig = Signal(list)
 
     def __init__(self):
         QObject.__init__(self)
         self.msv2 = msv2.msv2()
         self.downloading = 0
+        self.schemas = dict(log_format.SCHEMAS)
+        self.store = None
+        self.link_state = ""
+        #(time, status, command, sensors) polled, drained by the ui frame timer
+        self.samples = collections.deque(maxlen=SAMPLE_QUEUE_LEN)
+        self.telemetry = 0
+        self.telemetry_renew = 0
+        self.telemetry_seq = None
+        self.lost_frames = 0
+        self.msv2.on_frame(TELEMETRY_PUSH, self.telemetry_cb)
+
+    def take_samples(self):
+        #called from the ui thread, deque appends and pops are atomic
+        samples = []
+        while self.samples:
+            samples.append(self.samples.popleft())
+        return samples
+
+    def set_link_state(self, state):
+        if(state != self.link_state):
+            self.link_state = state
+            self.connect_sig.emit(state)
 
     @Slot(str)
     def ser_connect(self, port):
         if(self.msv2.connect(port)):
-            self.connect_sig.emit("CONNECTED")
+            baudrate = self.msv2.negotiate(BAUDRATE_SET, GET_STAT)
+            print("link at {} baud".format(baudrate))
+            self.subscribe(baudrate)
+            self.set_link_state("CONNECTED")
         else:
-            self.connect_sig.emit("ERROR")
+            self.set_link_state("ERROR")
+    def subscribe(self, baudrate):
+        #every control cycle when the link allows it, polling on older firmware
+        self.telemetry_period = 10 if baudrate >= 460800 else HEART_BEAT
+        resp = self.msv2.send(TELEMETRY, struct.pack("HH", TELEMETRY_ALL, self.telemetry_period))
+        self.telemetry = resp == [0xc5, 0x5c]
+        self.telemetry_renew = time.monotonic() + TELEMETRY_RENEW
+        self.telemetry_seq = None
+        if hasattr(self, 'timer'):
+            self.timer.setInterval(TELEMETRY_POLL if self.telemetry else HEART_BEAT)
+
+    def telemetry_cb(self, data):
+        if(len(data) < struct.calcsize(TELEMETRY_HEAD)):
+            return
+        seq, groups = struct.unpack(TELEMETRY_HEAD, bytes(data[:4]))
+        if(self.telemetry_seq is not None):
+            self.lost_frames += (seq - self.telemetry_seq - 1) & 0xffff
+        self.telemetry_seq = seq
+        #same layout as the polling responses
+        parts = [None]*len(TELEMETRY_GROUPS)
+        pos = 4
+        for i, length in enumerate(TELEMETRY_GROUPS):
+            if(groups & (1 << i)):
+                parts[i] = data[pos:pos+length]
+                pos += length
+        self.samples.append((time.monotonic(), parts[0], parts[1], parts[2]))
+
     @Slot()
     def ser_disconnect(self):
+        self.telemetry = 0
         if(self.msv2.disconnect()):
-            self.connect_sig.emit("DISCONNECTED")
+            self.set_link_state("DISCONNECTED")
         else:
-            self.connect_sig.emit("ERROR")
+            self.set_link_state("ERROR")
 
-    @Slot(int, list)
+    @Slot(int, object)
     def send_generic(self, opcode, data):
         if self.msv2.is_connected():
             resp = self.msv2.send(opcode, data)
@@ -361,46 +508,88 @@ class Serial_worker(QObject):
 
 
     @Slot()
-    def download(self):
+    def list_sessions(self):
         if self.msv2.is_connected():
-            last_recv = 0
-            err_counter = 0
-            self.downloading = 1
+            sessions = []
             while 1:
-                bin_data = struct.pack("I", last_recv)
-                recv_data = []
-                data = self.msv2.send(DOWNLOAD, bin_data)
-                if(not data):
-                    err_counter += 1
-                    if(err_counter > 10):
-                        last_recv += 1
-                        err_counter = 0
-                    continue
-                for i in range(5):
-                    tmp_data = struct.unpack("HBBiiiiiII", bytes(data[i*32:(i+1)*32]))
-                    #print(bytes(data[i*32:(i+1)*32]))
-                    recv_data.append(tmp_data)
-                last_recv += 5
-                self.download_sig.emit(recv_data, last_recv)
-                if(last_recv > total_data):
-                    self.downloading = 0
+                data = self.msv2.send(SESSION_LIST, struct.pack("I", len(sessions)))
+                if(not data or data == -1 or len(data) % struct.calcsize(SESSION_ENTRY)):
                     break
+                sessions += list(struct.iter_unpack(SESSION_ENTRY, bytes(data)))
+                if(len(data) < SESSION_LIST_MAX*struct.calcsize(SESSION_ENTRY)):
+                    break
+            self.sessions_sig.emit(sessions)
 
-
+    @Slot(int, str)
+    def download(self, session, filename):
+        if self.msv2.is_connected():
+            #the session is selected first, its length replaces the one of the status
+            data = self.msv2.send(SESSION_SELECT, struct.pack("I", session & 0xffffffff))
+            if(not data or data == -1 or len(data) != 4):
+                return
+            total_bytes = struct.unpack("I", bytes(data))[0]
+            #the compressed log is streamed as is and decoded block by block
+            self.schemas = dict(log_format.SCHEMAS)
+            self.generation = None
+            self.downloading = 1
+            self.store = log_store.Writer(filename)
+            self.log = bytearray()
+            self.decoded = 0
+            self.msv2.stream(STREAM_START, STREAM_ACK, STREAM_STOP, 0, total_bytes,
+                             lambda chunk: self.download_chunk(chunk, total_bytes), STREAM_MAX_TIMEOUTS)
+            if(self.decoded < len(self.log)):
+                self.store_streams(log_format.decode(self.log[self.decoded:], self.schemas, self.generation))
+            self.store.close()
+            self.store = None
+            self.download_sig.emit(total_bytes, total_bytes)
+            self.downloading = 0
+
+
+
+    def download_chunk(self, chunk, total_bytes):
+        #blocks are decoded as soon as they are complete
+        self.log += chunk
+        while(len(self.log) - self.decoded >= log_format.BLOCK_SIZE):
+            block = self.log[self.decoded:self.decoded+log_format.BLOCK_SIZE]
+            if self.generation is None:
+                header = log_format.block_header(block)
+                if header is not None:
+                    self.generation = header[2]
+            self.decoded += len(block)
+            self.store_streams(log_format.decode(block, self.schemas, self.generation))
+            self.download_sig.emit(self.decoded, total_bytes)
+
+    def store_streams(self, streams):
+        for name, rows in streams.items():
+            if(name == 'status'):
+                header = remote_labels
+            else:
+                header = log_format.stream_header(self.schemas, name)
+            self.store.append(name, header, rows)
 
     @Slot()
     def send_ping(self):
+        if self.msv2.is_connected() and not self.downloading and self.telemetry:
+            if(self.msv2.poll() == -1):
+                self.set_link_state("RECONNECTING...")
+            if(time.monotonic() > self.telemetry_renew):
+                self.subscribe(self.msv2.baudrate)
+                if not self.telemetry:
+                    self.set_link_state("RECONNECTING...")
+                else:
+                    self.set_link_state("CONNECTED")
+            return
         if self.msv2.is_connected() and not self.downloading:
             stat = self.msv2.send(GET_STAT, [0x00, 0x00])
             trans = self.msv2.send(COMMAND_READ, [0x00, 0x00])
             sens = self.msv2.send(SENSOR_READ, [0x00, 0x00])
             if stat == -1 or stat==0 or trans == -1 or trans == 0:
-                self.connect_sig.emit("RECONNECTING...")
+                self.set_link_state("RECONNECTING...")
             else:
-                self.connect_sig.emit("CONNECTED")
-            self.update_status_sig.emit(stat, trans, sens)
+                self.set_link_state("CONNECTED")
+            self.samples.append((time.monotonic(), stat, trans, sens))
 
-    @Slot()
+    @Slot(int)
     def start_ping(self, period):
         self.timer = QTimer()
         self.timer.timeout.connect(self.send_ping)
@@ -467,14 +656,31 @@ if __name__ == "__main__":
 
 
     serial_worker.connect_sig.connect(connect_cb)
-    serial_worker.update_status_sig.connect(ping_cb)
     serial_worker.download_sig.connect(download_cb)
+    serial_worker.sessions_sig.connect(sessions_cb)
+
+    #CONNECT REQUESTS (run in the worker thread)
+
+    requests = Serial_requests()
+    requests.connect_req.connect(serial_worker.ser_connect)
+    requests.disconnect_req.connect(serial_worker.ser_disconnect)
+    requests.generic_req.connect(serial_worker.send_generic)
+    requests.ping_req.connect(serial_worker.send_ping)
+    requests.start_ping_req.connect(serial_worker.start_ping)
+    requests.download_req.connect(serial_worker.download)
+    requests.sessions_req.connect(serial_worker.list_sessions)
 
     #start worker thread
     worker_thread.start()
-    #worker_thread.setPriority(QThread.TimeCriticalPriority)
+    worker_thread.setPriority(QThread.HighPriority)
+
+    #the ping timer lives in the worker thread
+    requests.start_ping_req.emit(HEART_BEAT)
 
-    serial_worker.start_ping(HEART_BEAT)
+    #ui refresh at a fixed rate, independent of the telemetry rate
+    frame_timer = QTimer()
+    frame_timer.timeout.connect(refresh_cb)
+    frame_timer.start(FRAME_PERIOD)
 
 
 
@@ -488,13 +694,14 @@ if __name__ == "__main__":
     window.quit.clicked.connect(clean_quit)
     window.local_record.clicked.connect(start_record)
     window.download.clicked.connect(download_trig)
+    window.dl_list.clicked.connect(list_sessions_trig)
     window.tvc_motor_move.clicked.connect(tvc_motor_move_trig)
 
     window.trans_btn.clicked.connect(transaction_trig)
 
     transaction_timer = QTimer()
     transaction_timer.timeout.connect(transaction_auto_trig)
-    transaction_timer.start(0.5)
+    transaction_timer.start(HEART_BEAT)
 
 
     window.show()
@@ -1,12 +1,17 @@
 # This Python file uses the following encoding: utf-8
 
 
+import struct
+import time
 import serial
 import serial.tools.list_ports
 
 from PySide2.QtCore import QMutex
 
 BAUDRATE = 115200
+BAUDRATES = [921600, 460800, 230400, BAUDRATE] #rates the firmware accepts, the fastest first
+BAUDRATE_CONFIRM = 1.0 #s before the device restores its rate if the new one is not confirmed
+BAUDRATE_PING_TRIES = 3
 
 DLE = 0x90
 STX = 0x02
@@ -22,6 +27,11 @@ WAITING_CRC2 = 6
 MSV2_PROGRESS = 1
 MSV2_SUCCESS = 0
 MSV2_ERROR = 2
+MSV2_WRONG_CRC = 3
+
+STREAM_WINDOW = 16 #frames in flight, width of the ack bitmap
+STREAM_HEAD = "HHI" #seq, length, offset
+STREAM_HEAD_LEN = struct.calcsize(STREAM_HEAD)
 
 
 def crc16(message):
@@ -56,6 +66,8 @@ class msv2:
         self.crc_data = []
         self.data = []
         self.mutex = QMutex()
+        self.baudrate = BAUDRATE
+        self.handlers = {} #opcode: callback(data) for frames pushed by the device
 
     def explore(self):
          list = serial.tools.list_ports.comports(include_links=False)
@@ -63,6 +75,7 @@ class msv2:
 
     def connect(self, port):
         self.port = port
+        self.baudrate = BAUDRATE
         self.ser.baudrate = BAUDRATE
         self.ser.port = port
         self.ser.timeout = 0.2
@@ -76,7 +89,7 @@ class msv2:
     def reconnect(self):
         try:
             self.ser.port = self.port
-            self.ser.baudrate = BAUDRATE
+            self.ser.baudrate = self.baudrate
             self.ser.timeout = 0.2
             self.ser.open()
             self.connected = 1
@@ -210,6 +223,8 @@ class msv2:
                         return 0
                     res = self.decode(byte)
                     #print("res:", res)
+                    if res == MSV2_SUCCESS and self.dispatch(opcode):
+                        continue
                     if not res == MSV2_PROGRESS:
                         break
                 #print('[{}]'.format(', '.join(hex(x) for x in self.data)))
@@ -230,6 +245,166 @@ class msv2:
             print("CONN_ERROR")
             return -1
 
+    def write(self, opcode, data):
+        """Send a frame without waiting for a response (stream acknowledgements)."""
+        if self.connected:
+            self.mutex.lock()
+            try:
+                self.ser.write(self.encode(opcode, data))
+            except:
+                print("WRITE ERROR")
+                self.mutex.unlock()
+                self.reconnect()
+                return -1
+            self.mutex.unlock()
+            return 0
+        return -1
+
+    def receive(self):
+        """Wait for the next unsolicited frame (streams).
+        returns (opcode, data), 0 on timeout or wrong crc and -1 on error"""
+        if self.connected:
+            self.mutex.lock()
+            try:
+                while 1:
+                    byte = self.ser.read(1)
+                    if not byte:
+                        self.mutex.unlock()
+                        return 0
+                    res = self.decode(byte)
+                    if res == MSV2_SUCCESS and self.dispatch():
+                        continue
+                    if res == MSV2_SUCCESS:
+                        self.mutex.unlock()
+                        return (self.opcode, self.data)
+                    if res == MSV2_WRONG_CRC:
+                        self.mutex.unlock()
+                        return 0
+            except:
+                print("READ ERROR")
+                self.mutex.unlock()
+                self.reconnect()
+                return -1
+        return -1
+
+    def on_frame(self, opcode, callback):
+        """Frames of this opcode pushed by the device go to callback(data) instead of
+        being taken as a response."""
+        self.handlers[opcode] = callback
+
+    def dispatch(self, expected=None):
+        if self.opcode != expected and self.opcode in self.handlers:
+            self.handlers[self.opcode](self.data)
+            return 1
+        return 0
+
+    def poll(self):
+        """Decode what was already received without waiting, pushed frames go to their handler."""
+        if self.connected:
+            self.mutex.lock()
+            try:
+                waiting = self.ser.in_waiting
+                if waiting:
+                    for byte in self.ser.read(waiting):
+                        if self.decode(bytes([byte])) == MSV2_SUCCESS:
+                            self.dispatch()
+            except:
+                print("READ ERROR")
+                self.mutex.unlock()
+                self.reconnect()
+                return -1
+            self.mutex.unlock()
+            return 0
+        return -1
+
+    def set_baudrate(self, baudrate):
+        self.mutex.lock()
+        self.baudrate = baudrate
+        self.ser.baudrate = baudrate
+        self.ser.reset_input_buffer()
+        self.state = WAITING_DLE
+        self.escape = 0
+        self.mutex.unlock()
+
+    def ping(self, ping_opcode):
+        return self.send(ping_opcode, [0x00, 0x00]) not in (0, -1)
+
+    def negotiate(self, opcode, ping_opcode):
+        """Move the link to the fastest rate the device accepts.
+        The device answers at the old rate and switches, the new rate is confirmed
+        by a ping, failures fall back to the next slower rate.
+        If the device does not answer (left at another rate) the rates are probed first.
+        returns the rate in use or 0 if the device was not found"""
+        if not self.ping(ping_opcode):
+            for baudrate in BAUDRATES:
+                self.set_baudrate(baudrate)
+                if self.ping(ping_opcode):
+                    break
+            else:
+                self.set_baudrate(BAUDRATE)
+                return 0
+        for baudrate in BAUDRATES:
+            if baudrate <= self.baudrate:
+                break
+            previous = self.baudrate
+            if self.send(opcode, struct.pack("I", baudrate)) != [0xc5, 0x5c]:
+                continue
+            self.set_baudrate(baudrate)
+            for _ in range(BAUDRATE_PING_TRIES):
+                if self.ping(ping_opcode):
+                    return baudrate
+            #not confirmed, the device restores the previous rate by itself
+            self.set_baudrate(previous)
+            time.sleep(BAUDRATE_CONFIRM)
+        return self.baudrate
+
+    def stream(self, start_opcode, ack_opcode, stop_opcode, offset, length, data_cb, max_timeouts=10):
+        """Windowed download of a range streamed by the device (selective repeat).
+        Frames arriving out of order are kept until the gap is filled, every frame
+        and every timeout is answered with (first missing seq, bitmap of the next
+        frames received) so that only the missing frames are sent again.
+        data_cb(data) gets the range in order, returns the number of bytes received or -1"""
+        if self.send(start_opcode, struct.pack("II", offset, length)) in (0, -1):
+            return -1
+        base = 0
+        pending = {}
+        received = 0
+        timeouts = 0
+        while received < length:
+            frame = self.receive()
+            if frame == -1:
+                break
+            if frame == 0:
+                #timeout or wrong crc, the device learns which frames are missing from the ack
+                timeouts += 1
+                if(timeouts > max_timeouts):
+                    break
+                self.write(ack_opcode, self.stream_ack(base, pending))
+                continue
+            opcode, data = frame
+            if(opcode != start_opcode or len(data) < STREAM_HEAD_LEN):
+                continue
+            timeouts = 0
+            seq, flen, foff = struct.unpack(STREAM_HEAD, bytes(data[:STREAM_HEAD_LEN]))
+            if(((seq - base) & 0xffff) < STREAM_WINDOW and seq not in pending):
+                pending[seq] = bytes(data[STREAM_HEAD_LEN:STREAM_HEAD_LEN+flen])
+            while base in pending:
+                chunk = pending.pop(base)
+                received += len(chunk)
+                base = (base + 1) & 0xffff
+                data_cb(chunk)
+            self.write(ack_opcode, self.stream_ack(base, pending))
+        if(received < length):
+            self.send(stop_opcode, [0x00, 0x00])
+        return received
+
+    def stream_ack(self, base, pending):
+        bitmap = 0
+        for i in range(STREAM_WINDOW-1):
+            if ((base + 1 + i) & 0xffff) in pending:
+                bitmap |= 1 << i
+        return struct.pack("HH", base, bitmap)
+
 
 
 
@@ -5,6 +5,7 @@ import struct
 PING = 0x00
 SHUTDOWN = 0x01
 PAYLOAD = 0x02
+BAUDRATE = 0x05
 
 hb = None
 
@@ -71,6 +72,6 @@ def recv_data(opcode, data):
 hb = msv2.msv2()
 if hb.connect("/dev/serial0"):
     print("connected")
-    hb.slave(recv_data)
+    hb.slave(recv_data, BAUDRATE)
 else:
     print("error")
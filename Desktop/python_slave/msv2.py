@@ -1,9 +1,14 @@
 # This Python file uses the following encoding: utf-8
 
 
+import struct
+import time
 import serial
 
 BAUDRATE = 115200
+BAUDRATES = [921600, 460800, 230400, BAUDRATE] #rates the firmware accepts, the fastest first
+BAUDRATE_SILENCE = 2 #s without a valid frame before going back to the default rate
+BAUDRATE_POLL = 0.1 #s, read timeout while checking the silence
 
 DLE = 0x90
 STX = 0x02
@@ -53,7 +58,7 @@ class msv2:
         self.state = WAITING_DLE
         self.crc_data = []
         self.data = []
-
+        self.baudrate = BAUDRATE
 
     def connect(self, port):
         self.port = port
@@ -70,7 +75,7 @@ class msv2:
     def reconnect(self):
         try:
             self.ser.port = self.port
-            self.ser.baudrate = BAUDRATE
+            self.ser.baudrate = self.baudrate
             self.ser.timeout = 0.2
             self.ser.open()
             self.connected = 1
@@ -218,18 +223,48 @@ class msv2:
             print("CONN_ERROR")
             return -1
 
-    def slave(self, callback):
-        self.ser.timeout = 10 #no timeout for slave mode
+    def set_baudrate(self, baudrate):
+        self.ser.flush() #the answer still goes at the old rate
+        self.baudrate = baudrate
+        self.ser.baudrate = baudrate
+        self.ser.reset_input_buffer()
+        self.state = WAITING_DLE
+        self.escape = 0
+
+    def slave(self, callback, baudrate_opcode=None):
+        """Serve the master, baudrate_opcode requests (rate u32) are handled here.
+        Without a valid frame for BAUDRATE_SILENCE the link goes back to the default rate,
+        bytes sent by the master at another rate only look like garbage."""
+        last_frame = time.monotonic()
         while 1:
+            self.ser.timeout = 10 if self.baudrate == BAUDRATE else BAUDRATE_POLL
             d = self.ser.read(1)
+            if self.baudrate != BAUDRATE and time.monotonic() - last_frame > BAUDRATE_SILENCE:
+                print("back to {} baud".format(BAUDRATE))
+                self.set_baudrate(BAUDRATE)
+                last_frame = time.monotonic()
+                continue
             if not d:
                 print("no byte")
                 continue
             res = self.decode(d)
             if res == MSV2_SUCCESS:
-                callback(self.opcode, self.data)
+                last_frame = time.monotonic()
+                if baudrate_opcode is not None and self.opcode == baudrate_opcode:
+                    self.slave_baudrate(self.opcode, self.data)
+                else:
+                    callback(self.opcode, self.data)
             elif res == MSV2_WRONG_CRC:
                 print("crc error")
+
+    def slave_baudrate(self, opcode, data):
+        baudrate = struct.unpack("I", bytes(data))[0] if len(data) == 4 else 0
+        if baudrate in BAUDRATES:
+            self.send_from_slave(opcode, [0xc5, 0x5c])
+            print("switching to {} baud".format(baudrate))
+            self.set_baudrate(baudrate)
+        else:
+            self.send_from_slave(opcode, [0xce, 0xec])
     def send_from_slave(self, opcode, data):
         if self.connected:
             msg = self.encode(opcode, data)
@@ -10,14 +10,19 @@
 
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 void flash_read(uint32_t address, uint8_t* buffer, uint32_t length);
-void flash_write(uint32_t address, uint8_t* buffer, uint32_t length);
+bool flash_write(uint32_t address, uint8_t* buffer, uint32_t length);
 void flash_write_fast(uint32_t address, uint8_t* buffer, uint32_t length);
-void flash_erase_subsector(uint32_t address);
-void flash_erase_sector(uint32_t address);
+bool flash_erase_subsector(uint32_t address);
+bool flash_erase_sector(uint32_t address);
 void flash_init(void);
 
+bool flash_mmap_enable(void);
+void flash_mmap_disable(void);
+bool flash_mmap_active(void);
+
 
 #endif /* FLASH_H_ */
@@ -16,6 +16,13 @@
 // State commands
 #define READ_STATUS_REGISTER 0x05
 #define READ_FLAG_STATUS_REGISTER 0x70
+#define CLEAR_FLAG_STATUS_REGISTER 0x50
+
+
+// Flag status register bits
+#define FLAG_ERASE_FAULT (1 << 5)
+#define FLAG_PROGRAM_FAULT (1 << 4)
+#define FLAG_PROTECTION_FAULT (1 << 1)
 
 
 // Write latch commands
@@ -12,6 +12,16 @@
 
 #define IO_TIMEOUT 2000L
 
+/*
+ * The QUADSPI maps the external flash at this address in memory-mapped mode.
+ */
+#define QSPI_MMAP_BASE 0x90000000
+
+/*
+ * Number of idle QUADSPI clock cycles before nCS is released in memory-mapped mode.
+ */
+#define QSPI_MMAP_TIMEOUT 0x20
+
 
 
 #include <stdbool.h>
@@ -54,13 +64,19 @@ bool qspi_run(Command* cmd, uint32_t instruction);
 bool qspi_poll(Command* cmd, uint32_t instruction, uint8_t bit, bool value);
 bool qspi_transmit(uint8_t* buffer);
 bool qspi_receive(uint8_t* buffer);
+bool qspi_memory_map(Command* cmd, uint32_t instruction);
+bool qspi_abort();
 
 void flash_init();
 void flash_read(uint32_t address, uint8_t* buffer, uint32_t length);
-void flash_write(uint32_t address, uint8_t* buffer, uint32_t length);
-void flash_erase_subsector(uint32_t address);
-void flash_erase_sector(uint32_t address);
-void flash_erase_all();
+bool flash_write(uint32_t address, uint8_t* buffer, uint32_t length);
+bool flash_erase_subsector(uint32_t address);
+bool flash_erase_sector(uint32_t address);
+bool flash_erase_all();
+
+bool flash_mmap_enable();
+void flash_mmap_disable();
+bool flash_mmap_active();
 
 
 
@@ -5,10 +5,16 @@
  *      Author: Arion
  */
 
+#include <string.h>
+
 #include "io_driver.h"
 #include "MT25QL128ABA.h"
 
 
+static bool __mmap_active = false;
+
+
+
 /*
  * Reads the flag status register and returns the value of the 8-bits register
  */
@@ -57,13 +63,46 @@ bool __write_enable_latch() {
  */
 bool __write_disable_latch() {
 	Command cmd = get_default_command();
-	return qspi_run(&cmd, WRITE_ENABLE_LATCH);
+	return qspi_run(&cmd, WRITE_DISABLE_LATCH);
+}
+
+/*
+ * Checks the fault bits of the flag status register after a PROGRAM or ERASE operation.
+ * The fault bits are sticky, they are cleared here so that the next operation starts clean.
+ * Returns false if the operation failed.
+ */
+bool __check_faults(uint8_t mask) {
+	uint8_t flags = __read_flags();
+
+	if(flags & (mask | FLAG_PROTECTION_FAULT)) {
+		__write_disable_latch(); // Manually reset the latch
+
+		Command cmd = get_default_command();
+		qspi_run(&cmd, CLEAR_FLAG_STATUS_REGISTER);
+
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Leaves memory-mapped mode if needed.
+ * Every indirect command (program, erase, register access) must be preceded by this call.
+ */
+void __mmap_leave() {
+	if(__mmap_active) {
+		qspi_abort();
+		__mmap_active = false;
+	}
 }
 
 /*
  * Initialises the flash driver
  */
 void flash_init() {
+	__mmap_leave();
+
 	uint8_t configuration = 0b00011011; // 1 Dummy cycle
 	Command cmd = get_default_command();
 	with_data(&cmd, 1);
@@ -93,6 +132,11 @@ void flash_init() {
  */
 
 void flash_read(uint32_t address, uint8_t* buffer, uint32_t length) {
+	if(__mmap_active) {
+		memcpy(buffer, (uint8_t *) (QSPI_MMAP_BASE + address), length);
+		return;
+	}
+
 	while(QUADSPI->SR & QUADSPI_SR_BUSY);
 	QUADSPI->CCR = (uint32_t) (FREAD_SINGLE) | (0b00000001 << 24) | (0b00000100 << 16) | (0b00100101 << 8);
 	while(QUADSPI->SR & QUADSPI_SR_BUSY);
@@ -107,6 +151,41 @@ void flash_read(uint32_t address, uint8_t* buffer, uint32_t length) {
 
 
 
+/*
+ *
+ * --- Memory-mapped operations ---
+ *
+ * In memory-mapped mode the whole flash is readable at QSPI_MMAP_BASE and flash_read
+ * becomes a plain memcpy. Program and erase operations switch back to indirect mode
+ * automatically, the caller has to re-enable the mapping once it is done writing.
+ *
+ */
+
+bool flash_mmap_enable() {
+	if(__mmap_active) {
+		return true;
+	}
+
+	Command cmd = get_default_command();
+	with_address(&cmd, 0);
+	with_data(&cmd, 0);
+	cmd.qspi_command.DummyCycles = 1; // Matches the volatile configuration written in flash_init
+
+	__mmap_active = qspi_memory_map(&cmd, FREAD_SINGLE);
+
+	return __mmap_active;
+}
+
+void flash_mmap_disable() {
+	__mmap_leave();
+}
+
+bool flash_mmap_active() {
+	return __mmap_active;
+}
+
+
+
 /*
  *
  * --- Write operations ---
@@ -116,7 +195,9 @@ void flash_read(uint32_t address, uint8_t* buffer, uint32_t length) {
  *
  */
 
-void __flash_write_page(uint32_t address, uint8_t* buffer, uint32_t length) {
+bool __flash_write_page(uint32_t address, uint8_t* buffer, uint32_t length) {
+	__mmap_leave();
+
 	__write_enable_latch();
 
 	Command cmd = get_default_command();
@@ -143,23 +224,21 @@ void __flash_write_page(uint32_t address, uint8_t* buffer, uint32_t length) {
 
 	}
 
-	uint8_t flags = __read_flags();
-
-	// Checks if the protection fault flag is set
-	if(flags & (1 << 4)) {
-		__write_disable_latch(); // Manually reset the latch
-
-
-	}
+	// Checks if the program or protection fault flag is set
+	return __check_faults(FLAG_PROGRAM_FAULT);
 }
 
-void flash_write(uint32_t address, uint8_t* buffer, uint32_t length) {
+/*
+ * Returns false if any of the pages reported a program or protection fault.
+ */
+bool flash_write(uint32_t address, uint8_t* buffer, uint32_t length) {
 	uint32_t internal_address = address % PAGE_SIZE;
+	bool success = true;
 
 	while(internal_address + length > PAGE_SIZE) {
 		uint32_t write_length = PAGE_SIZE - internal_address;
 
-		__flash_write_page(address, buffer, write_length);
+		success &= __flash_write_page(address, buffer, write_length);
 		buffer += write_length;
 		address += write_length;
 		length -= write_length;
@@ -167,7 +246,9 @@ void flash_write(uint32_t address, uint8_t* buffer, uint32_t length) {
 		internal_address = 0;
 	}
 
-	__flash_write_page(address, buffer, length);
+	success &= __flash_write_page(address, buffer, length);
+
+	return success;
 }
 
 /*
@@ -178,7 +259,9 @@ void flash_write(uint32_t address, uint8_t* buffer, uint32_t length) {
  * 	 - erase_ut.c
  *
  */
-void flash_erase_all() {
+bool flash_erase_all() {
+   __mmap_leave();
+
    __write_enable_latch();
 
    Command cmd = get_default_command();
@@ -198,18 +281,13 @@ void flash_erase_all() {
    }
 
    /*
-    * Checks if the protection fault flag is set
+    * Checks if the erase or protection fault flag is set
     */
-   uint8_t flags = __read_flags();
-
-   if(flags & (1 << 5)) {
-      __write_disable_latch(); // Manually reset the latch
-
-
-   }
+   return __check_faults(FLAG_ERASE_FAULT);
 }
 
-void __flash_erase(uint32_t instruction, uint32_t address) {
+bool __flash_erase(uint32_t instruction, uint32_t address) {
+	__mmap_leave();
 
 	__write_enable_latch();
 
@@ -233,23 +311,17 @@ void __flash_erase(uint32_t instruction, uint32_t address) {
 	}
 
 	/*
-	 * Checks if the protection fault flag is set
+	 * Checks if the erase or protection fault flag is set
 	 */
-	uint8_t flags = __read_flags();
-
-	if(flags & (1 << 5)) {
-		__write_disable_latch(); // Manually reset the latch
-
-
-	}
+	return __check_faults(FLAG_ERASE_FAULT);
 }
 
 /*
  * Erases the whole sector represented by the provided address.
  * The address may be any of those within the sector.
  */
-void flash_erase_sector(uint32_t address) {
-	__flash_erase(ERASE_SECTOR, address);
+bool flash_erase_sector(uint32_t address) {
+	return __flash_erase(ERASE_SECTOR, address);
 }
 
 
@@ -257,6 +329,6 @@ void flash_erase_sector(uint32_t address) {
  * Erases the whole sub-sector represented by the provided address.
  * The address may be any of those within the sub-sector.
  */
-void flash_erase_subsector(uint32_t address) {
-	__flash_erase(ERASE_SUBSECTOR, address);
+bool flash_erase_subsector(uint32_t address) {
+	return __flash_erase(ERASE_SUBSECTOR, address);
 }
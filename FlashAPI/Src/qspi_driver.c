@@ -72,3 +72,22 @@ bool qspi_transmit(uint8_t* buffer) {
 bool qspi_receive(uint8_t* buffer) {
 	return HAL_QSPI_Receive(&hqspi, buffer, IO_TIMEOUT) == HAL_OK;
 }
+
+/*
+ * Puts the peripheral in memory-mapped mode using the provided command as read template.
+ * The peripheral stays busy until qspi_abort is called.
+ */
+bool qspi_memory_map(Command* cmd, uint32_t instruction) {
+	QSPI_MemoryMappedTypeDef config;
+
+	config.TimeOutActivation = QSPI_TIMEOUT_COUNTER_ENABLE;
+	config.TimeOutPeriod = QSPI_MMAP_TIMEOUT;
+
+	cmd->qspi_command.Instruction = instruction;
+
+	return HAL_QSPI_MemoryMapped(&hqspi, &(cmd->qspi_command), &config) == HAL_OK;
+}
+
+bool qspi_abort() {
+	return HAL_QSPI_Abort(&hqspi) == HAL_OK;
+}
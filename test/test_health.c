@@ -0,0 +1,138 @@
+/*  Title		: Test health
+ *  Filename	: test_health.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: host test of the servo checks of the health monitor
+ *
+ *	health.c is built with stubs of the tick, the log and the servo telemetry,
+ *	built and run on the host from the repository root:
+ *		gcc -std=gnu11 -Wall -DUSE_HAL_DRIVER -DSTM32F446xx \
+ *			-IApplication/Inc -ICore/Inc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Include \
+ *			-IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IMiddlewares/Third_Party/FreeRTOS/Source/include \
+ *			-IMiddlewares/Third_Party/FreeRTOS/Source/portable/GCC/ARM_CM4F \
+ *			-IMiddlewares/Third_Party/FreeRTOS/Source/CMSIS_RTOS \
+ *			test/test_health.c Application/Src/health.c -o test_health && ./test_health
+ *	returns the number of failed checks
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <stdio.h>
+#include <cmsis_os.h>
+#include <health.h>
+#include <storage.h>
+
+/**********************
+ *	CONSTANTS
+ **********************/
+
+#define NB_SERVOS	(4)
+
+/**********************
+ *	MACROS
+ **********************/
+
+#define CHECK(cond)	check((cond), #cond, __LINE__)
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static int failures = 0;
+
+static TickType_t test_time;
+static uint32_t test_logged;
+static SERVO_INST_t test_servos[NB_SERVOS];
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+//stubs of the firmware
+
+TickType_t xTaskGetTickCount(void) {
+	return test_time;
+}
+
+void storage_log(STORAGE_TYPE_t type, const void * payload) {
+	if(type == STORAGE_TYPE_HEALTH) {
+		test_logged++;
+	}
+}
+
+SERVO_TELEMETRY_t servo_get_telemetry(SERVO_INST_t * servo) {
+	SERVO_TELEMETRY_t telemetry = {0};
+	telemetry.error = servo->error;
+	telemetry.status = servo->status;
+	telemetry.time = servo->time;
+	return telemetry;
+}
+
+static void check(int cond, const char * text, int line) {
+	if(!cond) {
+		printf("FAIL line %d: %s\n", line, text);
+		failures++;
+	}
+}
+
+//every source fresh, the servos with recent telemetry and no error
+static void feed_all(void) {
+	for(uint8_t i = 0; i < HEALTH_SOURCE_NUM; i++) {
+		health_feed(i);
+	}
+	for(uint8_t i = 0; i < NB_SERVOS; i++) {
+		test_servos[i].time = test_time;
+	}
+}
+
+int main(void) {
+	SERVO_INST_t * servos[NB_SERVOS];
+	for(uint8_t i = 0; i < NB_SERVOS; i++) {
+		servos[i] = &test_servos[i];
+	}
+	health_init(servos, NB_SERVOS);
+	test_time = 1000;
+	health_arm();
+
+	//healthy servos
+	test_time += 10;
+	feed_all();
+	CHECK(health_check(0) == 0);
+
+	//a hardware error status without the alert bit does not trip
+	test_servos[1].error = 0x04;
+	test_time += 10;
+	feed_all();
+	CHECK(health_check(0) == 0);
+
+	//alert bit of the status packet
+	test_servos[2].status = 0x80;
+	test_time += 10;
+	feed_all();
+	CHECK(health_check(0) == (1 << HEALTH_SERVOS));
+	CHECK(test_logged == 1);
+	CHECK(health_get_triggers(HEALTH_SERVOS) == 1);
+	//tripped once per arming
+	CHECK(health_check(0) == 0);
+
+	//stale telemetry
+	test_servos[2].status = 0;
+	health_arm();
+	test_time += 10;
+	feed_all();
+	CHECK(health_check(0) == 0);
+	uint32_t last = test_servos[3].time;
+	test_time += health_get_threshold(HEALTH_SERVOS) + 1;
+	feed_all();
+	test_servos[3].time = last;
+	CHECK(health_check(0) == (1 << HEALTH_SERVOS));
+
+	if(failures == 0) {
+		printf("health: all tests passed\n");
+	}
+	return failures;
+}
+
+/* END */
@@ -0,0 +1,136 @@
+/*  Title		: Test util
+ *  Filename	: test_util.c
+ *	Date		: 19.10.2026
+ *	Version		: 0.1
+ *	Description	: host test of the fixed point helpers of util.h
+ *
+ *	util.h is header only, built and run on the host from the repository root:
+ *		gcc -std=gnu11 -Wall -IApplication/Inc test/test_util.c -o test_util && ./test_util
+ *	returns the number of failed checks
+ */
+
+/**********************
+ *	INCLUDES
+ **********************/
+
+#include <stdio.h>
+#include <util.h>
+
+/**********************
+ *	MACROS
+ **********************/
+
+#define Q	UTIL_DECIMAL
+#define FIX(a)	((int32_t) util_double_2_fix(a))
+
+#define CHECK(cond)	check((cond), #cond, __LINE__)
+
+/**********************
+ *	VARIABLES
+ **********************/
+
+static int failures = 0;
+
+/**********************
+ *	DECLARATIONS
+ **********************/
+
+static void check(int cond, const char * text, int line) {
+	if(!cond) {
+		printf("FAIL line %d: %s\n", line, text);
+		failures++;
+	}
+}
+
+static int mat_equal(const int32_t * A, const int32_t * B, uint16_t len) {
+	for(uint16_t i = 0; i < len; i++) {
+		if(A[i] != B[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_scalar(void) {
+	CHECK(util_fix_qadd(FIX(1.5), FIX(2.25)) == FIX(3.75));
+	CHECK(util_fix_qsub(FIX(1.5), FIX(2.25)) == FIX(-0.75));
+	CHECK(util_fix_qmul(FIX(1.5), FIX(-2), Q) == FIX(-3));
+	CHECK(util_fix_qdiv(FIX(3), FIX(2), Q) == FIX(1.5));
+
+	//saturation instead of wrapping
+	CHECK(util_fix_qadd(INT32_MAX, 1) == INT32_MAX);
+	CHECK(util_fix_qsub(INT32_MIN, 1) == INT32_MIN);
+	CHECK(util_fix_qmul(1 << 30, 1 << 30, Q) == INT32_MAX);
+	CHECK(util_fix_qmul(1 << 30, -(1 << 30), Q) == INT32_MIN);
+	CHECK(util_fix_qdiv(FIX(1), 0, Q) == INT32_MAX);
+	CHECK(util_fix_qdiv(FIX(-1), 0, Q) == INT32_MIN);
+
+	//rounded to nearest: 3 * 0.5 lsb = 1.5 lsb
+	CHECK(util_fix_qmul(3, FIX(0.5), Q) == 2);
+	CHECK(util_fix_qmul(1, FIX(0.25), Q) == 0);
+}
+
+static void test_matrix(void) {
+	const int32_t A[6] = {	FIX(1), FIX(2), FIX(3),
+							FIX(4), FIX(5), FIX(6)};
+	const int32_t B[6] = {	FIX(1), FIX(0),
+							FIX(0), FIX(1),
+							FIX(1), FIX(1)};
+	const int32_t AB[4] = {	FIX(4), FIX(5),
+							FIX(10), FIX(11)};
+	int32_t R[9];
+	int32_t T[6];
+	int32_t I[9];
+
+	util_fix_mat_mul(R, A, B, 2, 3, 2, Q);
+	CHECK(mat_equal(R, AB, 4));
+
+	//A * B = A * (B')'
+	util_fix_mat_transpose(T, B, 3, 2);
+	CHECK(T[0] == FIX(1) && T[1] == FIX(0) && T[2] == FIX(1));
+	util_fix_mat_mul_t(R, A, T, 2, 3, 2, Q);
+	CHECK(mat_equal(R, AB, 4));
+
+	util_fix_mat_identity(I, 3, Q);
+	util_fix_mat_mul(R, A, I, 2, 3, 3, Q);
+	CHECK(mat_equal(R, A, 6));
+
+	util_fix_mat_add(R, A, A, 2, 3);
+	util_fix_mat_scale(T, A, FIX(2), 2, 3, Q);
+	CHECK(mat_equal(R, T, 6));
+	util_fix_mat_sub(R, R, A, 2, 3);
+	CHECK(mat_equal(R, A, 6));
+
+	//the products are accumulated on 64 bits, only the result saturates
+	const int32_t L[2] = {FIX(30000), FIX(-30000)};
+	const int32_t V[2] = {FIX(2), FIX(2)};
+	util_fix_mat_mul(R, L, V, 1, 2, 1, Q);
+	CHECK(R[0] == 0);
+	util_fix_mat_mul(R, L, L, 1, 2, 1, Q);
+	CHECK(R[0] == INT32_MAX);
+}
+
+static void test_mat22(void) {
+	UTIL_MAT22_t A = {FIX(1), FIX(2), FIX(3), FIX(4)};
+	UTIL_MAT21_t v = {FIX(1), FIX(-1)};
+	UTIL_MAT21_t r = util_fix_mat22_mul_mat21(A, v);
+	CHECK(r.x11 == FIX(-1) && r.x21 == FIX(-1));
+
+	UTIL_MAT22_t At = util_fix_mat22_transpose(A);
+	CHECK(At.x12 == FIX(3) && At.x21 == FIX(2));
+
+	UTIL_MAT22_t AA = util_fix_mat22_mul_mat22(A, A);
+	CHECK(AA.x11 == FIX(7) && AA.x12 == FIX(10) && AA.x21 == FIX(15) && AA.x22 == FIX(22));
+}
+
+int main(void) {
+	test_scalar();
+	test_matrix();
+	test_mat22();
+	if(failures == 0) {
+		printf("util: all tests passed\n");
+	}
+	return failures;
+}
+
+/* END */